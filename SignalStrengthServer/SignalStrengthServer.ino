@@ -7,12 +7,41 @@
 #include <ESP8266WiFi.h>
 #include <WiFiClient.h>
 #include <ESP8266WebServer.h>
+#include <WiFiUdp.h>
 #include "WifiCredentials.h"
 
 #define MAX_SSID_LENGTH 64
 #define MAX_PASSWORD_LENGTH 64
 
+// RSSI streaming (see RssiStream.h in WiFiMapper for the packet layouts)
+#define STREAM_PORT 4210
+#define SUBSCRIBE_PACKET_LENGTH 8
+#define SAMPLE_PACKET_LENGTH 16
+#define MIN_STREAM_INTERVAL_US 1000
+#define SUBSCRIPTION_TIMEOUT_MS 5000
+
+// Continuous sampling (see WiFiReceiver.h in WiFiMapper for the batch layout)
+#define SAMPLE_INTERVAL_US 2000
+#define SAMPLE_BUFFER_LENGTH 256
+#define MAX_BATCH_SAMPLES 64
+#define BATCH_HEADER_LENGTH 8
+#define BATCH_SAMPLE_LENGTH 6
+
+// Requires ESP8266 core 3.0.0 or later, whose web server keeps connections open between requests (see readme.md)
 ESP8266WebServer server(80);
+WiFiUDP streamUdp;
+IPAddress streamHost;
+uint16_t streamPort = 0; // 0 when not streaming
+uint32_t streamInterval_us = 0;
+uint32_t lastSubscription_ms = 0;
+uint32_t lastSample_us = 0;
+uint32_t streamSequence = 0;
+
+// The most recent samples, where sample n (numbered from 1) is stored at (n - 1) % SAMPLE_BUFFER_LENGTH
+uint32_t sampleTimes_us[SAMPLE_BUFFER_LENGTH];
+int16_t sampleValues[SAMPLE_BUFFER_LENGTH];
+uint32_t sampleCount = 0;
+uint32_t lastBufferedSample_us = 0;
 IPAddress broadcastAddress = IPAddress(0, 0, 0, 0);
 char g_ssid[MAX_SSID_LENGTH] = {0};
 char g_password[MAX_PASSWORD_LENGTH] = {0};
@@ -71,6 +100,129 @@ void handleRssi() {
 }
 
 
+// Writes a 32-bit value in little-endian order
+void writeUint32(uint8_t *destination, uint32_t value) {
+  destination[0] = value & 0xFF;
+  destination[1] = (value >> 8) & 0xFF;
+  destination[2] = (value >> 16) & 0xFF;
+  destination[3] = (value >> 24) & 0xFF;
+}
+
+
+// Records a sample in the buffer (at most once per SAMPLE_INTERVAL_US)
+void updateSamples() {
+  uint32_t now_us = micros();
+  if (sampleCount > 0 && now_us - lastBufferedSample_us < SAMPLE_INTERVAL_US) {
+    return;
+  }
+
+  uint32_t index = sampleCount % SAMPLE_BUFFER_LENGTH;
+  sampleTimes_us[index] = now_us;
+  sampleValues[index] = WiFi.RSSI();
+  sampleCount++;
+  lastBufferedSample_us = now_us;
+}
+
+
+// Responds to HTTP GET messages (with the argument "since", a sequence number) with the buffered
+// samples recorded after the given one: "WB", version, count, first sequence number, then for
+// each sample micros() and RSSI (16 bits), all little-endian
+void handleRssiBatch() {
+  uint32_t since = strtoul(server.arg("since").c_str(), NULL, 10);
+
+  // The host's sequence number is ahead of ours if we have restarted
+  if (since > sampleCount) {
+    since = 0;
+  }
+
+  uint32_t oldest = sampleCount > SAMPLE_BUFFER_LENGTH ? sampleCount - SAMPLE_BUFFER_LENGTH : 0;
+  uint32_t first = max(since, oldest) + 1; // the first sequence number to send
+  uint32_t count = min((uint32_t)MAX_BATCH_SAMPLES, sampleCount + 1 - first);
+
+  uint8_t batch[BATCH_HEADER_LENGTH + MAX_BATCH_SAMPLES * BATCH_SAMPLE_LENGTH] = { 'W', 'B', 1, (uint8_t)count };
+  writeUint32(batch + 4, first);
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t index = (first - 1 + i) % SAMPLE_BUFFER_LENGTH;
+    uint8_t *sample = batch + BATCH_HEADER_LENGTH + i * BATCH_SAMPLE_LENGTH;
+    writeUint32(sample, sampleTimes_us[index]);
+    sample[4] = sampleValues[index] & 0xFF;
+    sample[5] = (sampleValues[index] >> 8) & 0xFF;
+  }
+
+  size_t length = BATCH_HEADER_LENGTH + count * BATCH_SAMPLE_LENGTH;
+  server.setContentLength(length);
+  server.send(200, "application/octet-stream", "");
+  server.client().write(batch, length);
+}
+
+
+// The identifier included in streamed packets (the last byte of the network IP address)
+uint8_t moduleId() {
+  return WiFi.localIP()[3];
+}
+
+
+// Starts (or renews) streaming to the sender of a subscribe packet: "WS", version, 0, interval (us)
+void handleSubscription() {
+  uint8_t packet[SUBSCRIBE_PACKET_LENGTH];
+  if (streamUdp.read(packet, SUBSCRIBE_PACKET_LENGTH) != SUBSCRIBE_PACKET_LENGTH
+      || packet[0] != 'W' || packet[1] != 'S' || packet[2] != 1) {
+    return;
+  }
+
+  uint32_t interval_us = packet[4] | (packet[5] << 8) | ((uint32_t)packet[6] << 16) | ((uint32_t)packet[7] << 24);
+  if (interval_us == 0) {
+    streamPort = 0; // unsubscribe
+    return;
+  }
+
+  streamHost = streamUdp.remoteIP();
+  streamPort = streamUdp.remotePort();
+  streamInterval_us = max((uint32_t)MIN_STREAM_INTERVAL_US, interval_us);
+  lastSubscription_ms = millis();
+}
+
+
+// Sends one sample packet: "WR", version, module id, sequence, micros(), RSSI (16 bits), 0 (16 bits)
+void sendSample() {
+  uint32_t now_us = micros();
+  int16_t rssi = WiFi.RSSI();
+
+  uint8_t packet[SAMPLE_PACKET_LENGTH] = { 'W', 'R', 1, moduleId() };
+  writeUint32(packet + 4, ++streamSequence);
+  writeUint32(packet + 8, now_us);
+  packet[12] = rssi & 0xFF;
+  packet[13] = (rssi >> 8) & 0xFF;
+
+  streamUdp.beginPacket(streamHost, streamPort);
+  streamUdp.write(packet, SAMPLE_PACKET_LENGTH);
+  streamUdp.endPacket();
+
+  lastSample_us = now_us;
+}
+
+
+// Streams samples to the subscribed host (if any), which must renew its subscription regularly
+void updateStream() {
+  if (streamUdp.parsePacket() > 0) {
+    handleSubscription();
+  }
+
+  if (streamPort == 0) {
+    return;
+  }
+
+  if (millis() - lastSubscription_ms > SUBSCRIPTION_TIMEOUT_MS) {
+    streamPort = 0;
+    return;
+  }
+
+  if (micros() - lastSample_us >= streamInterval_us) {
+    sendSample();
+  }
+}
+
+
 // Responds to an HTTP GET message with a text entry form to supply a ssid and password
 void handleSetNetwork() {
   server.send(200, "text/html", "<form action=\"/login\" method=\"POST\"><input type=\"text\" name=\"ssid\" placeholder=\"SSID\"></br><input type=\"password\" name=\"password\" placeholder=\"Password\"></br><input type=\"submit\" value=\"Submit\"></form><p>Please enter the name and password of the WiFi network to map.</br><a href=\"/\">Home</a></p>");
@@ -102,14 +254,18 @@ void setup(void) {
   
   server.on("/", HTTP_GET, handleRoot);
   server.on("/rssi", HTTP_GET, handleRssi);
+  server.on("/rssi/batch", HTTP_GET, handleRssiBatch);
   server.on("/set-network", HTTP_GET, handleSetNetwork);
   server.on("/login", HTTP_POST, handleLogin);
   server.on("/toggle-ap", HTTP_GET, handleToggleAp);
   server.begin();
+  streamUdp.begin(STREAM_PORT);
 }
 
 
-// Waits for and handles incoming requests
+// Records samples, waits for and handles incoming requests, and streams samples (if subscribed)
 void loop(void) {
+  updateSamples();
   server.handleClient();
+  updateStream();
 }
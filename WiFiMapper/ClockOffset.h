@@ -0,0 +1,57 @@
+/*
+ * The (header-only) module responsible for mapping the timestamps of a device's
+ * clock (eg: the Kinect's, or an ESP8266 module's) to times on the host's clock.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+
+// Estimates the offset between a device's clock and the host's steady clock from the times at which the device's
+// timestamps arrive. The offset is the smallest seen, ie: from the timestamp delayed least in reaching the host,
+// but it is allowed to rise by cMaxDrift_ppm of the time elapsed, so that the offset follows the device's clock
+// whether it runs faster or slower than the host's (by up to cMaxDrift_ppm).
+class ClockOffset {
+public:
+	typedef std::chrono::steady_clock::duration duration;
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	// Returns the host time of the given device time (since any fixed epoch) which arrived at the given time
+	time_point hostTime(duration deviceTime, time_point arrival) {
+		duration offset = arrival.time_since_epoch() - deviceTime;
+
+		if (m_initialised && arrival > m_lastArrival) {
+			m_offset += (arrival - m_lastArrival) * cMaxDrift_ppm / 1000000;
+		}
+
+		if (!m_initialised || offset < m_offset) {
+			m_offset = offset;
+			m_initialised = true;
+		}
+
+		if (arrival > m_lastArrival) {
+			m_lastArrival = arrival;
+		}
+
+		return time_point(deviceTime + m_offset);
+	}
+
+	// Forgets the offset (eg: when the device restarts)
+	void reset() {
+		m_initialised = false;
+		m_lastArrival = time_point();
+	}
+
+private:
+	// The crystals of the Kinect and the ESP8266 are accurate to tens of ppm, so this follows either comfortably,
+	// while adding no more than this proportion of the time between the least-delayed timestamps to the offset
+	static const int64_t cMaxDrift_ppm = 200;
+
+	bool m_initialised = false;
+	duration m_offset{ 0 };
+	time_point m_lastArrival;
+};
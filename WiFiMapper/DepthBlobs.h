@@ -0,0 +1,193 @@
+/*
+ * The module responsible for finding the connected regions (blobs) of a depth image
+ * mask and their statistics, in a single pass over the mask.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+
+// The statistics of one connected (8-connected) region of a mask, in the mask's coordinates
+struct DepthBlob {
+	uint area = 0; // pixels
+	int minX = INT32_MAX;
+	int minY = INT32_MAX;
+	int maxX = -1;
+	int maxY = -1;
+	double sumX = 0;
+	double sumY = 0;
+
+	// The blob's pixels with a (non-zero) depth
+	uint depthCount = 0;
+	double depthSum = 0;
+	UINT16 minDepth = UINT16_MAX;
+	UINT16 maxDepth = 0;
+
+	cv::Point2f centroid() const {
+		return { (float)(sumX / area), (float)(sumY / area) };
+	}
+
+	cv::Rect boundingBox() const {
+		return { minX, minY, maxX - minX + 1, maxY - minY + 1 };
+	}
+
+	// Half of the blob's largest extent (the radius of a disk-shaped blob)
+	float radius() const {
+		return std::max(maxX - minX + 1, maxY - minY + 1) / 2.0f;
+	}
+
+	// The fraction of the circle of the blob's radius which is covered by the blob (1 for a disk)
+	float circularity() const {
+		float r = radius();
+		return (float)(area / (CV_PI * r * r));
+	}
+
+	float meanDepth() const {
+		return depthCount > 0 ? (float)(depthSum / depthCount) : 0;
+	}
+
+	void merge(const DepthBlob &other) {
+		area += other.area;
+		minX = std::min(minX, other.minX);
+		minY = std::min(minY, other.minY);
+		maxX = std::max(maxX, other.maxX);
+		maxY = std::max(maxY, other.maxY);
+		sumX += other.sumX;
+		sumY += other.sumY;
+		depthCount += other.depthCount;
+		depthSum += other.depthSum;
+		minDepth = std::min(minDepth, other.minDepth);
+		maxDepth = std::max(maxDepth, other.maxDepth);
+	}
+};
+
+
+// Finds the blobs of a mask by labelling each row's runs of set pixels, joining the labels of
+// touching runs (union-find) and accumulating the statistics of each run as it is found. The
+// mask is only read once, and the buffers are kept between calls to avoid allocation.
+class BlobLabeller {
+public:
+	// Finds the blobs of the given CV_8UC1 mask (set where 255, as formed by thresholdAndOpen), with depth statistics
+	// from the given CV_16UC1 image of the same size. The blobs are written to the given vector, in no particular order.
+	void label(const cv::Mat &mask, const cv::Mat &depth, std::vector<DepthBlob> &blobs) {
+		blobs.clear();
+		m_parents.clear();
+		m_stats.clear();
+		m_previousRuns.clear();
+
+		for (int y = 0; y < mask.rows; y++) {
+			const uint8_t *maskRow = mask.ptr<uint8_t>(y);
+			const UINT16 *depthRow = depth.ptr<UINT16>(y);
+			m_runs.clear();
+
+			int x = 0;
+			while (x < mask.cols) {
+				const uint8_t *start = (const uint8_t*)memchr(maskRow + x, 0xFF, mask.cols - x);
+				if (!start) {
+					break;
+				}
+
+				int runStart = (int)(start - maskRow);
+				int runEnd = runStart;
+				while (runEnd + 1 < mask.cols && maskRow[runEnd + 1]) {
+					runEnd++;
+				}
+				x = runEnd + 1;
+
+				Run run{ runStart, runEnd, newLabel() };
+				accumulate(m_stats[run.label], depthRow, y, runStart, runEnd);
+
+				// Runs of the previous row touch this one (including diagonally) if they overlap [start - 1, end + 1]
+				for (const Run &above : m_previousRuns) {
+					if (above.end >= runStart - 1 && above.start <= runEnd + 1) {
+						join(run.label, above.label);
+					}
+				}
+
+				m_runs.push_back(run);
+			}
+
+			std::swap(m_runs, m_previousRuns);
+		}
+
+		// Combine the statistics of each blob's runs (in its root label)
+		for (int i = 0; i < (int)m_parents.size(); i++) {
+			int root = find(i);
+			if (root != i) {
+				m_stats[root].merge(m_stats[i]);
+			}
+		}
+
+		for (int i = 0; i < (int)m_parents.size(); i++) {
+			if (m_parents[i] == i) {
+				blobs.push_back(m_stats[i]);
+			}
+		}
+	}
+
+private:
+	// A horizontal run of set pixels, [start, end], within one row
+	struct Run {
+		int start;
+		int end;
+		int label;
+	};
+
+	std::vector<int> m_parents; // by label
+	std::vector<DepthBlob> m_stats; // by label
+	std::vector<Run> m_runs;
+	std::vector<Run> m_previousRuns;
+
+	int newLabel() {
+		m_parents.push_back((int)m_parents.size());
+		m_stats.emplace_back();
+		return (int)m_parents.size() - 1;
+	}
+
+	int find(int label) {
+		while (m_parents[label] != label) {
+			m_parents[label] = m_parents[m_parents[label]]; // halve the path as it is walked
+			label = m_parents[label];
+		}
+		return label;
+	}
+
+	void join(int a, int b) {
+		a = find(a);
+		b = find(b);
+		if (a != b) {
+			// Keep the older label as the root, so roots are always found before the labels joined to them
+			m_parents[std::max(a, b)] = std::min(a, b);
+		}
+	}
+
+	static void accumulate(DepthBlob &blob, const UINT16 *depthRow, int y, int start, int end) {
+		int length = end - start + 1;
+		blob.area += length;
+		blob.minX = std::min(blob.minX, start);
+		blob.maxX = std::max(blob.maxX, end);
+		blob.minY = std::min(blob.minY, y);
+		blob.maxY = std::max(blob.maxY, y);
+		blob.sumX += (double)(start + end) * length / 2;
+		blob.sumY += (double)y * length;
+
+		for (int x = start; x <= end; x++) {
+			UINT16 depth = depthRow[x];
+			if (depth > 0) {
+				blob.depthCount++;
+				blob.depthSum += depth;
+				blob.minDepth = std::min(blob.minDepth, depth);
+				blob.maxDepth = std::max(blob.maxDepth, depth);
+			}
+		}
+	}
+};
@@ -0,0 +1,176 @@
+/*
+ * The module responsible for forming the binary mask of a depth image region in
+ * which a marker is searched for (a depth threshold followed by a 3x3 opening),
+ * using SIMD instructions where available.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DEPTH_MASK_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DEPTH_MASK_SSE2
+#endif
+
+#include "opencv2/core.hpp"
+
+
+// Sets dst[x] to 255 if min <= src[x] <= max, and to 0 otherwise
+inline void thresholdRow(const UINT16 *src, uint8_t *dst, int width, UINT16 min, UINT16 max) {
+	int x = 0;
+
+#if defined(DEPTH_MASK_AVX2)
+	const __m256i minimum = _mm256_set1_epi16((short)min);
+	const __m256i maximum = _mm256_set1_epi16((short)max);
+	const __m256i zero = _mm256_setzero_si256();
+	for (; x + 32 <= width; x += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(src + x));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + x + 16));
+
+		// Saturating (unsigned) subtraction is zero where the value is within each limit
+		__m256i outsideA = _mm256_or_si256(_mm256_subs_epu16(a, maximum), _mm256_subs_epu16(minimum, a));
+		__m256i outsideB = _mm256_or_si256(_mm256_subs_epu16(b, maximum), _mm256_subs_epu16(minimum, b));
+		__m256i insideA = _mm256_cmpeq_epi16(outsideA, zero);
+		__m256i insideB = _mm256_cmpeq_epi16(outsideB, zero);
+
+		// Packing works within 128-bit lanes, so restore the order afterwards
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(insideA, insideB), 0xD8);
+		_mm256_storeu_si256((__m256i*)(dst + x), packed);
+	}
+#elif defined(DEPTH_MASK_SSE2)
+	const __m128i minimum = _mm_set1_epi16((short)min);
+	const __m128i maximum = _mm_set1_epi16((short)max);
+	const __m128i zero = _mm_setzero_si128();
+	for (; x + 16 <= width; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + x + 8));
+
+		// Saturating (unsigned) subtraction is zero where the value is within each limit
+		__m128i outsideA = _mm_or_si128(_mm_subs_epu16(a, maximum), _mm_subs_epu16(minimum, a));
+		__m128i outsideB = _mm_or_si128(_mm_subs_epu16(b, maximum), _mm_subs_epu16(minimum, b));
+		__m128i insideA = _mm_cmpeq_epi16(outsideA, zero);
+		__m128i insideB = _mm_cmpeq_epi16(outsideB, zero);
+
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packs_epi16(insideA, insideB));
+	}
+#endif
+
+	for (; x < width; x++) {
+		dst[x] = (src[x] >= min && src[x] <= max) ? 255 : 0;
+	}
+}
+
+
+// Sets dst[x] to a[x] & b[x] & c[x] (the minimum of 0/255 values), or to a[x] | b[x] | c[x] (the maximum)
+template <bool IS_AND>
+inline void combineRows(const uint8_t *a, const uint8_t *b, const uint8_t *c, uint8_t *dst, int width) {
+	int x = 0;
+
+#if defined(DEPTH_MASK_AVX2)
+	for (; x + 32 <= width; x += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + x));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + x));
+		__m256i vc = _mm256_loadu_si256((const __m256i*)(c + x));
+		__m256i result = IS_AND ? _mm256_and_si256(_mm256_and_si256(va, vb), vc) : _mm256_or_si256(_mm256_or_si256(va, vb), vc);
+		_mm256_storeu_si256((__m256i*)(dst + x), result);
+	}
+#elif defined(DEPTH_MASK_SSE2)
+	for (; x + 16 <= width; x += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+		__m128i vc = _mm_loadu_si128((const __m128i*)(c + x));
+		__m128i result = IS_AND ? _mm_and_si128(_mm_and_si128(va, vb), vc) : _mm_or_si128(_mm_or_si128(va, vb), vc);
+		_mm_storeu_si128((__m128i*)(dst + x), result);
+	}
+#endif
+
+	for (; x < width; x++) {
+		dst[x] = IS_AND ? (a[x] & b[x] & c[x]) : (a[x] | b[x] | c[x]);
+	}
+}
+
+
+// Row buffers for thresholdAndOpen, kept between calls to avoid allocation
+struct DepthMaskScratch {
+	int width = 0;
+	std::vector<uint8_t> thresholded; // one row, with a column either side
+	std::vector<uint8_t> eroded; // one row, with a column either side
+	std::vector<uint8_t> rowMinima; // the horizontal minima of three rows (by row % 3)
+	std::vector<uint8_t> rowMaxima; // the horizontal maxima of three rows (by row % 3)
+	std::vector<uint8_t> ones; // stands in for rows beyond the edges when eroding
+	std::vector<uint8_t> zeros; // stands in for rows beyond the edges when dilating
+
+	// Prepares buffers for rows of the given width
+	void reserve(int rowWidth) {
+		if (rowWidth <= width) {
+			return;
+		}
+
+		width = rowWidth;
+		size_t padded = rowWidth + 2;
+		thresholded.assign(padded, 0);
+		eroded.assign(padded, 0);
+		rowMinima.assign(3 * (size_t)rowWidth, 0);
+		rowMaxima.assign(3 * (size_t)rowWidth, 0);
+		ones.assign(rowWidth, 255);
+		zeros.assign(rowWidth, 0);
+	}
+};
+
+
+// Forms the mask (CV_8UC1, 255 where set) of the pixels of the given UINT16 image which are within
+// [minDepth, maxDepth], opened (eroded then dilated) with a 3x3 square. The result matches cv::inRange
+// followed by cv::erode and cv::dilate with their default borders, but is formed in a single pass
+// over the rows, into the given mask (which is only reallocated if its size changes).
+inline void thresholdAndOpen(const cv::Mat &depth, UINT16 minDepth, UINT16 maxDepth, DepthMaskScratch &scratch, cv::Mat &mask) {
+	int width = depth.cols;
+	int height = depth.rows;
+	mask.create(height, width, CV_8UC1);
+	if (width == 0 || height == 0) {
+		return;
+	}
+
+	scratch.reserve(width);
+	uint8_t *thresholded = scratch.thresholded.data() + 1;
+	uint8_t *eroded = scratch.eroded.data() + 1;
+	const uint8_t *ones = scratch.ones.data();
+	const uint8_t *zeros = scratch.zeros.data();
+
+	// Pixels beyond the left and right edges neither erode nor dilate their neighbours
+	thresholded[-1] = thresholded[width] = 255;
+	eroded[-1] = eroded[width] = 0;
+
+	auto rowMinima = [&](int row) -> const uint8_t* {
+		return row < 0 || row >= height ? ones : scratch.rowMinima.data() + (row % 3) * (size_t)width;
+	};
+	auto rowMaxima = [&](int row) -> const uint8_t* {
+		return row < 0 || row >= height ? zeros : scratch.rowMaxima.data() + (row % 3) * (size_t)width;
+	};
+
+	// Row i is thresholded while row i - 1 is eroded and row i - 2 is dilated
+	for (int i = 0; i < height + 2; i++) {
+		if (i < height) {
+			thresholdRow(depth.ptr<UINT16>(i), thresholded, width, minDepth, maxDepth);
+			combineRows<true>(thresholded - 1, thresholded, thresholded + 1, const_cast<uint8_t*>(rowMinima(i)), width);
+		}
+
+		int erodedRow = i - 1;
+		if (erodedRow >= 0 && erodedRow < height) {
+			combineRows<true>(rowMinima(erodedRow - 1), rowMinima(erodedRow), rowMinima(erodedRow + 1), eroded, width);
+			combineRows<false>(eroded - 1, eroded, eroded + 1, const_cast<uint8_t*>(rowMaxima(erodedRow)), width);
+		}
+
+		int dilatedRow = i - 2;
+		if (dilatedRow >= 0) {
+			combineRows<false>(rowMaxima(dilatedRow - 1), rowMaxima(dilatedRow), rowMaxima(dilatedRow + 1), mask.ptr<uint8_t>(dilatedRow), width);
+		}
+	}
+}
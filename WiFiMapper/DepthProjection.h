@@ -0,0 +1,134 @@
+/*
+ * The module responsible for converting depth image descriptions to camera space positions.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+
+static const char cDepthProjectionMagic[4] = { 'W', 'M', 'P', 'T' };
+
+
+// A per-pixel table of the (x, y) camera space factors for a depth image, such
+// that a pixel at depth z lies at (table.x * z, table.y * z, z) in camera space.
+class DepthProjection {
+public:
+	DepthProjection() = default;
+
+	// Copies a table of interleaved (x, y) factors (eg: from GetDepthFrameToCameraSpaceTable)
+	void setTable(const float *xyFactors, uint width, uint height) {
+		m_width = width;
+		m_height = height;
+		m_table.resize(width * height);
+		for (size_t i = 0; i < m_table.size(); i++) {
+			m_table[i] = { xyFactors[2 * i], xyFactors[2 * i + 1] };
+		}
+	}
+
+	// Approximates the table with an ideal pinhole camera with square pixels
+	// (used when no sensor is available, eg: when replaying a recording).
+	void setPinhole(uint width, uint height, double vfov_deg) {
+		double focalLength_px = (height / 2.0) / std::tan(vfov_deg * 3.14159265358979 / 360.0);
+		double centerX = (width - 1) / 2.0;
+		double centerY = (height - 1) / 2.0;
+
+		m_width = width;
+		m_height = height;
+		m_table.resize(width * height);
+		for (size_t y = 0; y < height; y++) {
+			for (size_t x = 0; x < width; x++) {
+				m_table[y * width + x] = { (float)((x - centerX) / focalLength_px), (float)((centerY - y) / focalLength_px) };
+			}
+		}
+	}
+
+	// Writes the table to a file (eg: to skip waiting for the sensor's table the next time it is used).
+	// Returns false if the file could not be written.
+	bool writeToFile(const std::string &filename) const {
+		std::ofstream outFile(filename, std::ios::binary);
+		uint32_t size[2] = { m_width, m_height };
+		outFile.write(cDepthProjectionMagic, sizeof(cDepthProjectionMagic));
+		outFile.write(reinterpret_cast<const char*>(size), sizeof(size));
+		outFile.write(reinterpret_cast<const char*>(m_table.data()), m_table.size() * sizeof(cv::Point2f));
+		return (bool)outFile;
+	}
+
+	// Reads a table written by writeToFile. Returns false (leaving the table unchanged) if the file
+	// does not exist, or does not hold a complete table of the given size.
+	bool readFromFile(const std::string &filename, uint width, uint height) {
+		std::ifstream inFile(filename, std::ios::binary);
+		char magic[sizeof(cDepthProjectionMagic)];
+		uint32_t size[2] = { 0, 0 };
+		if (!inFile.read(magic, sizeof(magic)) || std::memcmp(magic, cDepthProjectionMagic, sizeof(magic)) != 0
+			|| !inFile.read(reinterpret_cast<char*>(size), sizeof(size)) || size[0] != width || size[1] != height) {
+			return false;
+		}
+
+		std::vector<cv::Point2f> table(width * height);
+		if (!inFile.read(reinterpret_cast<char*>(table.data()), table.size() * sizeof(cv::Point2f))) {
+			return false;
+		}
+
+		m_width = width;
+		m_height = height;
+		m_table.swap(table);
+		return true;
+	}
+
+	bool empty() const {
+		return m_table.empty();
+	}
+
+	uint width() const {
+		return m_width;
+	}
+
+	uint height() const {
+		return m_height;
+	}
+
+	const cv::Point2f *table() const {
+		return m_table.data();
+	}
+
+	// Convert from (px, px, mm) in depth space to (mm, mm, mm) in camera space
+	cv::Point3f desc2Pos(cv::Point3f desc) const {
+		int x = (int)(desc.x + 0.5);
+		int y = (int)(desc.y + 0.5);
+		float z = desc.z;
+
+		x = std::min(std::max(x, 0), (int)m_width - 1);
+		y = std::min(std::max(y, 0), (int)m_height - 1);
+
+		cv::Point2f mapping = m_table[y * m_width + x];
+		return{ mapping.x * z, mapping.y * z, z };
+	}
+
+	// Convert from (mm, mm, mm) in camera space to (px, px) in depth space.
+	// Exact for a pinhole table, and a close approximation near the centre of a sensor's table.
+	cv::Point2f pos2Pixel(cv::Point3f pos) const {
+		double centerX = (m_width - 1) / 2.0;
+		double centerY = (m_height - 1) / 2.0;
+		size_t centerIndex = (m_height / 2) * m_width + m_width / 2;
+		double focalLength_px = 1.0 / (m_table[centerIndex].x - m_table[centerIndex - 1].x);
+
+		return{ (float)(centerX + pos.x / pos.z * focalLength_px), (float)(centerY - pos.y / pos.z * focalLength_px) };
+	}
+
+private:
+	uint m_width = 0;
+	uint m_height = 0;
+	std::vector<cv::Point2f> m_table;
+};
@@ -0,0 +1,185 @@
+/*
+ * The module responsible for finding sphere-shaped objects anywhere in a depth image,
+ * using a pyramid of downsampled depth images.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+
+// A downsampled depth image, holding the nearest and farthest (valid) depth of each square cell of pixels
+struct DepthLevel {
+	int width = 0; // cells
+	int height = 0;
+	int cellSize = 1; // pixels
+	std::vector<UINT16> nearest; // 0 where no pixel of the cell has a depth
+	std::vector<UINT16> farthest;
+
+	UINT16 nearestAt(int x, int y) const {
+		return nearest[y * width + x];
+	}
+
+	UINT16 farthestAt(int x, int y) const {
+		return farthest[y * width + x];
+	}
+};
+
+
+// A series of depth images, each with half the resolution of the last (starting with cells of 2x2 pixels)
+class DepthPyramid {
+public:
+	// Forms levels 1 to levelCount of the given CV_16UC1 image (level i has cells of 2^i x 2^i pixels).
+	// Pixels without a depth (0) are ignored.
+	void build(const cv::Mat &depth, int levelCount) {
+		m_levels.resize(levelCount);
+
+		for (int i = 0; i < levelCount; i++) {
+			DepthLevel &level = m_levels[i];
+			int sourceWidth = i == 0 ? depth.cols : m_levels[i - 1].width;
+			int sourceHeight = i == 0 ? depth.rows : m_levels[i - 1].height;
+
+			level.width = (sourceWidth + 1) / 2;
+			level.height = (sourceHeight + 1) / 2;
+			level.cellSize = 2 << i;
+			level.nearest.assign(level.width * level.height, 0);
+			level.farthest.assign(level.width * level.height, 0);
+
+			for (int y = 0; y < sourceHeight; y++) {
+				const UINT16 *nearestRow = i == 0 ? depth.ptr<UINT16>(y) : &m_levels[i - 1].nearest[y * sourceWidth];
+				const UINT16 *farthestRow = i == 0 ? nearestRow : &m_levels[i - 1].farthest[y * sourceWidth];
+				UINT16 *levelNearest = &level.nearest[(y / 2) * level.width];
+				UINT16 *levelFarthest = &level.farthest[(y / 2) * level.width];
+
+				for (int x = 0; x < sourceWidth; x++) {
+					UINT16 nearest = nearestRow[x];
+					if (nearest == 0) {
+						continue;
+					}
+
+					UINT16 &cellNearest = levelNearest[x / 2];
+					if (cellNearest == 0 || nearest < cellNearest) {
+						cellNearest = nearest;
+					}
+					levelFarthest[x / 2] = std::max(levelFarthest[x / 2], farthestRow[x]);
+				}
+			}
+		}
+	}
+
+	// The given level (from 1)
+	const DepthLevel &level(int index) const {
+		return m_levels[index - 1];
+	}
+
+private:
+	std::vector<DepthLevel> m_levels;
+};
+
+
+// A possible sphere found in a downsampled depth image
+struct SphereCandidate {
+	cv::Point2f center_px; // the centre of the cell containing its nearest point
+	UINT16 nearest_mm; // the depth of its nearest point
+	float radius_px; // its expected radius at that depth
+};
+
+
+// Finds the cells of the given level which could contain the nearest point of a sphere of the given radius:
+// cells which are nearer than the cells around them, surrounded (at the sphere's expected radius, in most
+// directions) by a much farther background. The sphere's expected radius (px) follows from the camera's focal
+// length (px). Candidates are written to the given vector, nearest first, with at most one per sphere.
+inline void findSphereCandidates(const DepthLevel &level, float sphereRadius_mm, float focalLength_px, std::vector<SphereCandidate> &candidates) {
+	// Directions in which the background is sampled
+	static const int cDirectionCount = 8;
+	static const int cMinBackgroundDirections = 6; // allows for a handle or rod attached to the sphere
+	static const float cDirections[cDirectionCount][2] = {
+		{ 1, 0 }, { 0.7071f, 0.7071f }, { 0, 1 }, { -0.7071f, 0.7071f },
+		{ -1, 0 }, { -0.7071f, -0.7071f }, { 0, -1 }, { 0.7071f, -0.7071f } };
+
+	candidates.clear();
+	float cellSize = (float)level.cellSize;
+	UINT16 sphereDepth_mm = (UINT16)sphereRadius_mm;
+
+	for (int y = 0; y < level.height; y++) {
+		for (int x = 0; x < level.width; x++) {
+			UINT16 nearest = level.nearestAt(x, y);
+			if (nearest == 0) {
+				continue;
+			}
+
+			float radius_px = focalLength_px * sphereRadius_mm / (nearest + sphereRadius_mm);
+			float radius_cells = radius_px / cellSize;
+
+			// The sphere's front: no nearer cells nearby, and every cell well within its silhouette is on it. The
+			// farthest depth of this cell is only checked when the sphere is large enough to contain whole cells.
+			int core = (int)(radius_cells / 2);
+			bool isFront = core == 0 || level.farthestAt(x, y) <= nearest + sphereDepth_mm;
+			for (int dy = -core; dy <= core && isFront; dy++) {
+				for (int dx = -core; dx <= core && isFront; dx++) {
+					int cx = x + dx;
+					int cy = y + dy;
+					if (cx < 0 || cy < 0 || cx >= level.width || cy >= level.height) {
+						continue;
+					}
+
+					UINT16 depth = level.nearestAt(cx, cy);
+					isFront = depth >= nearest && depth <= nearest + sphereDepth_mm;
+				}
+			}
+
+			if (!isFront) {
+				continue;
+			}
+
+			// The background: beyond the silhouette, (nearly) all cells are much farther than the sphere, or have no depth
+			float ring_cells = radius_cells * 1.5f + 1;
+			int backgroundDirections = 0;
+			for (int i = 0; i < cDirectionCount && i - backgroundDirections <= cDirectionCount - cMinBackgroundDirections; i++) {
+				int cx = x + (int)std::lround(cDirections[i][0] * ring_cells);
+				int cy = y + (int)std::lround(cDirections[i][1] * ring_cells);
+				if (cx < 0 || cy < 0 || cx >= level.width || cy >= level.height) {
+					backgroundDirections++;
+					continue;
+				}
+
+				UINT16 depth = level.nearestAt(cx, cy);
+				if (depth == 0 || depth > nearest + 2 * sphereDepth_mm) {
+					backgroundDirections++;
+				}
+			}
+
+			if (backgroundDirections >= cMinBackgroundDirections) {
+				candidates.push_back({ { (x + 0.5f) * cellSize, (y + 0.5f) * cellSize }, nearest, radius_px });
+			}
+		}
+	}
+
+	// Keep the nearest candidate of each sphere (neighbouring cells of one sphere can all qualify), as no two spheres
+	// can be closer than their diameter
+	std::sort(candidates.begin(), candidates.end(), [](const SphereCandidate &a, const SphereCandidate &b) {
+		return a.nearest_mm < b.nearest_mm;
+	});
+
+	size_t kept = 0;
+	for (size_t i = 0; i < candidates.size(); i++) {
+		bool isDuplicate = false;
+		for (size_t j = 0; j < kept && !isDuplicate; j++) {
+			cv::Point2f offset = candidates[i].center_px - candidates[j].center_px;
+			isDuplicate = offset.dot(offset) < 4 * candidates[j].radius_px * candidates[j].radius_px;
+		}
+
+		if (!isDuplicate) {
+			candidates[kept++] = candidates[i];
+		}
+	}
+
+	candidates.resize(kept);
+}
@@ -0,0 +1,413 @@
+/*
+ * The module responsible for supplying depth frames to the tracking pipeline,
+ * from a live sensor, a recorded session, or a synthetic scene.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+#include "ClockOffset.h"
+#include "DepthProjection.h"
+
+
+// The number of frame timestamp ticks per second (timestamps use the Kinect's 100 ns units)
+static const int64_t cDepthTicksPerSecond = 10000000;
+
+
+// A single depth frame. The buffer remains valid until the next call to acquireFrame.
+struct DepthFrame {
+	const UINT16 *data = nullptr;
+	int width = 0;
+	int height = 0;
+	int64_t timestamp = 0;
+};
+
+
+// An interface for anything which produces depth frames
+class DepthSource {
+public:
+	virtual ~DepthSource() = default;
+
+	// Fetches the next frame. Returns false if no new frame is available (yet).
+	virtual bool acquireFrame(DepthFrame &frame) = 0;
+
+	// Returns true once no more frames will be produced (eg: at the end of a recording)
+	virtual bool finished() const {
+		return false;
+	}
+};
+
+
+// Converts frame timestamps (from the sensor's clock) to times on the host's steady clock (see ClockOffset)
+class DepthClock {
+public:
+	std::chrono::steady_clock::time_point hostTime(int64_t timestamp, std::chrono::steady_clock::time_point arrival) {
+		std::chrono::steady_clock::duration sensorTime = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<int64_t, std::ratio<1, cDepthTicksPerSecond>>(timestamp));
+		return m_offset.hostTime(sensorTime, arrival);
+	}
+
+	// Forgets the offset (eg: when the source of frames changes)
+	void reset() {
+		m_offset.reset();
+	}
+
+private:
+	ClockOffset m_offset;
+};
+
+
+// Paces the replay of recorded frames to match the rate at which they were recorded
+class ReplayClock {
+public:
+	// Sleeps until the given frame timestamp is due, relative to the first frame
+	void waitUntil(int64_t timestamp) {
+		if (!m_started) {
+			m_started = true;
+			m_firstTimestamp = timestamp;
+			m_startTime = std::chrono::steady_clock::now();
+			return;
+		}
+
+		std::chrono::microseconds offset((timestamp - m_firstTimestamp) / 10);
+		std::this_thread::sleep_until(m_startTime + offset);
+	}
+
+private:
+	bool m_started = false;
+	int64_t m_firstTimestamp = 0;
+	std::chrono::steady_clock::time_point m_startTime;
+};
+
+
+// The header at the start of a raw depth recording, followed by frames made of
+// an int64 timestamp and width * height UINT16 depth values.
+struct RawDepthHeader {
+	char magic[4];
+	uint32_t width;
+	uint32_t height;
+};
+
+static const char cRawDepthMagic[4] = { 'W', 'M', 'D', 'R' };
+
+
+// Writes uncompressed depth frames in the format read by ReplayDepthSource
+class RawDepthWriter {
+public:
+	RawDepthWriter(const std::string &filename, uint width, uint height) : m_outFile(filename, std::ios::binary) {
+		if (!m_outFile) {
+			throw std::runtime_error("Unable to open \"" + filename + "\" for writing");
+		}
+
+		RawDepthHeader header;
+		std::memcpy(header.magic, cRawDepthMagic, sizeof(header.magic));
+		header.width = width;
+		header.height = height;
+		m_outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		m_pixelCount = width * height;
+	}
+
+	void writeFrame(const UINT16 *data, int64_t timestamp) {
+		m_outFile.write(reinterpret_cast<const char*>(&timestamp), sizeof(timestamp));
+		m_outFile.write(reinterpret_cast<const char*>(data), m_pixelCount * sizeof(UINT16));
+	}
+
+private:
+	std::ofstream m_outFile;
+	size_t m_pixelCount;
+};
+
+
+// Replays a raw depth recording, either as fast as frames are requested or paced by their timestamps
+class ReplayDepthSource : public DepthSource {
+public:
+	ReplayDepthSource(const std::string &filename, bool realtime = false) : m_inFile(filename, std::ios::binary), m_realtime(realtime) {
+		RawDepthHeader header;
+		if (!m_inFile.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, cRawDepthMagic, sizeof(header.magic)) != 0) {
+			throw std::runtime_error("\"" + filename + "\" is not a raw depth recording");
+		}
+
+		m_width = header.width;
+		m_height = header.height;
+		m_buffer.resize(m_width * m_height);
+	}
+
+	bool acquireFrame(DepthFrame &frame) override {
+		if (m_finished) {
+			return false;
+		}
+
+		int64_t timestamp;
+		if (!m_inFile.read(reinterpret_cast<char*>(&timestamp), sizeof(timestamp))
+			|| !m_inFile.read(reinterpret_cast<char*>(m_buffer.data()), m_buffer.size() * sizeof(UINT16))) {
+			m_finished = true;
+			return false;
+		}
+
+		if (m_realtime) {
+			m_clock.waitUntil(timestamp);
+		}
+
+		frame.data = m_buffer.data();
+		frame.width = m_width;
+		frame.height = m_height;
+		frame.timestamp = timestamp;
+		return true;
+	}
+
+	bool finished() const override {
+		return m_finished;
+	}
+
+private:
+	std::ifstream m_inFile;
+	bool m_realtime;
+	bool m_finished = false;
+	int m_width;
+	int m_height;
+	std::vector<UINT16> m_buffer;
+	ReplayClock m_clock;
+};
+
+
+// A sphere in a synthetic scene, which moves in straight lines between timed waypoints
+// (camera space, in mm) and rests at the first and last waypoints outside of their times.
+struct SyntheticMarker {
+	std::vector<std::pair<double, cv::Point3f>> waypoints;
+	float radius_mm = 0; // (0: the scene's marker radius)
+
+	cv::Point3f positionAt(double time_s) const {
+		if (time_s <= waypoints.front().first) {
+			return waypoints.front().second;
+		}
+
+		for (size_t i = 1; i < waypoints.size(); i++) {
+			if (time_s <= waypoints[i].first) {
+				const std::pair<double, cv::Point3f> &start = waypoints[i - 1];
+				const std::pair<double, cv::Point3f> &end = waypoints[i];
+				float progress = (float)((time_s - start.first) / (end.first - start.first));
+				return start.second + (end.second - start.second) * progress;
+			}
+		}
+
+		return waypoints.back().second;
+	}
+};
+
+
+// A box (aligned with the camera's axes) in a synthetic scene, eg: furniture in front of the background
+struct SyntheticBox {
+	cv::Point3f min; // (mm, mm, mm) in camera space
+	cv::Point3f max;
+};
+
+
+// The imperfections of a time-of-flight sensor such as the Kinect, added to synthetic frames (none by default)
+struct SyntheticSensorModel {
+	float depthNoise_mm = 0; // the standard deviation of each depth at 1 m (growing with the square of depth)
+	float holeFraction = 0; // the fraction of pixels which (at random) have no depth
+	float edgeHoleFraction = 0; // the fraction of pixels along depth discontinuities (eg: silhouettes) with no depth
+	UINT16 edgeStep_mm = 50; // the difference between neighbouring depths which is a discontinuity
+	uint32_t seed = 1; // (the same seed always gives the same frames)
+};
+
+
+// Renders spherical markers (and boxes) in front of a flat background with an ideal pinhole camera
+class SyntheticDepthSource : public DepthSource {
+public:
+	SyntheticDepthSource(uint width, uint height, double vfov_deg, float markerRadius_mm, std::vector<SyntheticMarker> markers, size_t frameCount, UINT16 backgroundDepth_mm = 2500, double frameRate = 30)
+		: m_width(width), m_height(height), m_markerRadius_mm(markerRadius_mm), m_markers(markers),
+		m_frameCount(frameCount), m_backgroundDepth_mm(backgroundDepth_mm), m_frameRate(frameRate), m_buffer(width * height) {
+		m_projection.setPinhole(width, height, vfov_deg);
+	}
+
+	bool acquireFrame(DepthFrame &frame) override {
+		if (finished()) {
+			return false;
+		}
+
+		double time_s = m_frameIndex / m_frameRate;
+		std::fill(m_buffer.begin(), m_buffer.end(), m_backgroundDepth_mm);
+		for (const SyntheticBox &box : m_boxes) {
+			renderBox(box);
+		}
+		for (const SyntheticMarker &marker : m_markers) {
+			renderSphere(marker.positionAt(time_s), marker.radius_mm > 0 ? marker.radius_mm : m_markerRadius_mm);
+		}
+		applySensorModel();
+
+		frame.data = m_buffer.data();
+		frame.width = m_width;
+		frame.height = m_height;
+		frame.timestamp = (int64_t)(time_s * cDepthTicksPerSecond);
+		m_frameIndex++;
+		return true;
+	}
+
+	bool finished() const override {
+		return m_frameIndex >= m_frameCount;
+	}
+
+	// Adds a static box to the scene
+	void addBox(const SyntheticBox &box) {
+		m_boxes.push_back(box);
+	}
+
+	void setSensorModel(const SyntheticSensorModel &sensor) {
+		m_sensor = sensor;
+		m_random.seed(sensor.seed);
+
+		std::normal_distribution<float> noise(0, sensor.depthNoise_mm);
+		m_noise.resize(cNoiseTableSize);
+		for (float &value : m_noise) {
+			value = noise(m_random);
+		}
+	}
+
+	// The camera model used to render frames
+	const DepthProjection &projection() const {
+		return m_projection;
+	}
+
+	// The position of the given marker (in camera space) in the most recently acquired frame
+	cv::Point3f markerPosition(size_t markerIndex) const {
+		size_t frameIndex = m_frameIndex == 0 ? 0 : m_frameIndex - 1;
+		return m_markers[markerIndex].positionAt(frameIndex / m_frameRate);
+	}
+
+private:
+	int m_width;
+	int m_height;
+	float m_markerRadius_mm;
+	std::vector<SyntheticMarker> m_markers;
+	size_t m_frameCount;
+	UINT16 m_backgroundDepth_mm;
+	double m_frameRate;
+	size_t m_frameIndex = 0;
+	std::vector<UINT16> m_buffer;
+	std::vector<UINT16> m_edgeBuffer; // (a copy of the rendered frame, for finding discontinuities)
+	DepthProjection m_projection;
+	std::vector<SyntheticBox> m_boxes;
+	SyntheticSensorModel m_sensor;
+	std::mt19937 m_random;
+
+	// Noise is drawn from a table of normally distributed values (generating them for every pixel is slow)
+	static const size_t cNoiseTableSize = 1 << 16;
+	std::vector<float> m_noise;
+
+	// Ray casts the front surface of a sphere over the pixels its silhouette may cover
+	void renderSphere(cv::Point3f center, float radius_mm) {
+		if (center.z <= radius_mm) {
+			return;
+		}
+
+		cv::Point2f centerPx = m_projection.pos2Pixel(center);
+		float extent_px = centerPx.x - m_projection.pos2Pixel(center - cv::Point3f{ 2 * radius_mm, 0, 0 }).x;
+		int minX = std::max(0, (int)(centerPx.x - extent_px));
+		int maxX = std::min(m_width - 1, (int)(centerPx.x + extent_px) + 1);
+		int minY = std::max(0, (int)(centerPx.y - extent_px));
+		int maxY = std::min(m_height - 1, (int)(centerPx.y + extent_px) + 1);
+
+		const cv::Point2f *table = m_projection.table();
+		float centerNormSq = center.dot(center) - radius_mm * radius_mm;
+
+		for (int y = minY; y <= maxY; y++) {
+			for (int x = minX; x <= maxX; x++) {
+				size_t index = y * m_width + x;
+				cv::Point3f ray{ table[index].x, table[index].y, 1.0f };
+				float rayNormSq = ray.dot(ray);
+				float rayDotCenter = ray.dot(center);
+				float discriminant = rayDotCenter * rayDotCenter - rayNormSq * centerNormSq;
+				if (discriminant < 0) {
+					continue;
+				}
+
+				float depth = (rayDotCenter - std::sqrt(discriminant)) / rayNormSq;
+				if (depth > 0 && depth < m_buffer[index]) {
+					m_buffer[index] = (UINT16)(depth + 0.5f);
+				}
+			}
+		}
+	}
+
+	// Fills the pixels covered by the front face of a box
+	void renderBox(const SyntheticBox &box) {
+		if (box.min.z <= 0) {
+			return;
+		}
+
+		// The front face's corners (the image's y axis points down, camera space's up)
+		cv::Point2f topLeft = m_projection.pos2Pixel({ box.min.x, box.max.y, box.min.z });
+		cv::Point2f bottomRight = m_projection.pos2Pixel({ box.max.x, box.min.y, box.min.z });
+		int minX = std::max(0, (int)std::ceil(topLeft.x));
+		int maxX = std::min(m_width - 1, (int)std::floor(bottomRight.x));
+		int minY = std::max(0, (int)std::ceil(topLeft.y));
+		int maxY = std::min(m_height - 1, (int)std::floor(bottomRight.y));
+		UINT16 depth = (UINT16)std::min(box.min.z + 0.5f, 65535.0f);
+
+		for (int y = minY; y <= maxY; y++) {
+			for (int x = minX; x <= maxX; x++) {
+				UINT16 &pixel = m_buffer[y * m_width + x];
+				pixel = std::min(pixel, depth);
+			}
+		}
+	}
+
+	// Adds depth noise, and removes the depths of random pixels and of pixels along discontinuities
+	void applySensorModel() {
+		if (m_sensor.depthNoise_mm <= 0 && m_sensor.holeFraction <= 0 && m_sensor.edgeHoleFraction <= 0) {
+			return;
+		}
+
+		// Each pixel's random number chooses whether it is a hole (low bits) and its noise (high bits)
+		uint32_t holeThreshold = (uint32_t)(m_sensor.holeFraction * 65536);
+		uint32_t edgeHoleThreshold = (uint32_t)(m_sensor.edgeHoleFraction * 65536);
+		m_edgeBuffer = m_buffer;
+
+		for (int y = 0; y < m_height; y++) {
+			for (int x = 0; x < m_width; x++) {
+				size_t index = y * m_width + x;
+				UINT16 depth = m_edgeBuffer[index];
+				uint32_t random = m_random();
+
+				if (m_sensor.edgeHoleFraction > 0) {
+					UINT16 right = x + 1 < m_width ? m_edgeBuffer[index + 1] : depth;
+					UINT16 below = y + 1 < m_height ? m_edgeBuffer[index + m_width] : depth;
+					bool isEdge = std::abs(right - depth) > m_sensor.edgeStep_mm || std::abs(below - depth) > m_sensor.edgeStep_mm;
+					if (isEdge && (random & 0xFFFF) < edgeHoleThreshold) {
+						m_buffer[index] = 0;
+						continue;
+					}
+				}
+
+				if ((random & 0xFFFF) < holeThreshold) {
+					m_buffer[index] = 0;
+					continue;
+				}
+
+				if (m_sensor.depthNoise_mm > 0) {
+					float depth_m = depth / 1000.0f;
+					float noisy = depth + m_noise[random >> 16] * depth_m * depth_m;
+					m_buffer[index] = (UINT16)std::min(std::max(noisy + 0.5f, 1.0f), 65535.0f);
+				}
+			}
+		}
+	}
+};
@@ -0,0 +1,592 @@
+/*
+ * The module responsible for recording depth frames to (and reading them from)
+ * a compact, seekable, lossless container.
+ *
+ * Frames are stored as residuals from a prediction (the previous frame, or the
+ * pixel to the left in key frames), which are entropy coded with runs of zero
+ * residuals and adaptive Rice codes. A key frame is written every so often, and
+ * an index of all frames is appended on close, so any frame can be located
+ * directly and decoded from at most one key frame interval of data.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "DepthSource.h"
+
+
+// Appends codes of up to 32 bits to a byte buffer
+class BitWriter {
+public:
+	explicit BitWriter(std::vector<uint8_t> &buffer) : m_buffer(buffer) { }
+
+	void write(uint32_t bits, int count) {
+		m_accumulator = (m_accumulator << count) | bits;
+		m_count += count;
+		while (m_count >= 8) {
+			m_count -= 8;
+			m_buffer.push_back((uint8_t)(m_accumulator >> m_count));
+		}
+	}
+
+	// Writes the given number of 1 bits followed by a 0 bit
+	void writeUnary(uint32_t value) {
+		while (value >= 24) {
+			write(0xFFFFFF, 24);
+			value -= 24;
+		}
+		write(((1u << value) - 1) << 1, value + 1);
+	}
+
+	// Pads the final byte with zeros
+	void flush() {
+		if (m_count > 0) {
+			write(0, 8 - m_count);
+		}
+	}
+
+private:
+	std::vector<uint8_t> &m_buffer;
+	uint64_t m_accumulator = 0;
+	int m_count = 0;
+};
+
+
+// Reads the codes produced by BitWriter. Reading past the end yields zero bits.
+class BitReader {
+public:
+	BitReader(const uint8_t *data, size_t size) : m_data(data), m_end(data + size) { }
+
+	uint32_t read(int count) {
+		refill(count);
+		m_count -= count;
+		return (uint32_t)(m_accumulator >> m_count) & (uint32_t)((1ull << count) - 1);
+	}
+
+	uint32_t readUnary() {
+		uint32_t value = 0;
+		while (read(1)) {
+			value++;
+		}
+		return value;
+	}
+
+private:
+	const uint8_t *m_data;
+	const uint8_t *m_end;
+	uint64_t m_accumulator = 0;
+	int m_count = 0;
+
+	void refill(int count) {
+		while (m_count < count) {
+			m_accumulator = (m_accumulator << 8) | (m_data < m_end ? *m_data++ : 0);
+			m_count += 8;
+		}
+	}
+};
+
+
+// Tracks the mean magnitude of recent residuals to choose a Rice parameter (as in LOCO-I)
+class RiceContext {
+public:
+	int parameter() const {
+		int k = 0;
+		while ((m_count << k) < m_total && k < 15) {
+			k++;
+		}
+		return k;
+	}
+
+	void update(uint32_t value) {
+		m_total += value;
+		m_count++;
+		if (m_count >= 64) {
+			m_total >>= 1;
+			m_count >>= 1;
+		}
+	}
+
+private:
+	uint32_t m_total = 4;
+	uint32_t m_count = 1;
+};
+
+
+// The losslessly compressed representation of depth frames
+class DepthCodec {
+public:
+	// Encodes the given frame, predicting from the previous frame if one is given
+	// (otherwise, from neighbouring pixels). Appends the result to output.
+	static void encode(const UINT16 *frame, const UINT16 *previous, size_t width, size_t height, std::vector<uint8_t> &output) {
+		BitWriter writer(output);
+		RiceContext context;
+		size_t pixelCount = width * height;
+
+		size_t i = 0;
+		while (i < pixelCount) {
+			uint32_t residual = zigzag(frame[i] - predict(frame, previous, i, width));
+
+			if (residual == 0) {
+				size_t runLength = 1;
+				while (i + runLength < pixelCount && frame[i + runLength] == predict(frame, previous, i + runLength, width)) {
+					runLength++;
+				}
+
+				writer.write(0, 1);
+				writeExpGolomb(writer, (uint32_t)(runLength - 1));
+				i += runLength;
+			} else {
+				int k = context.parameter();
+				uint32_t value = residual - 1;
+				uint32_t quotient = value >> k;
+
+				writer.write(1, 1);
+				if (quotient < cEscapeQuotient) {
+					writer.writeUnary(quotient);
+					writer.write(value & ((1u << k) - 1), k);
+				} else {
+					writer.writeUnary(cEscapeQuotient);
+					writer.write(value, 17);
+				}
+
+				context.update(value);
+				i++;
+			}
+		}
+
+		writer.flush();
+	}
+
+	// Decodes a frame produced by encode, given the same previous frame (or null)
+	static void decode(const uint8_t *data, size_t size, const UINT16 *previous, size_t width, size_t height, UINT16 *frame) {
+		BitReader reader(data, size);
+		RiceContext context;
+		size_t pixelCount = width * height;
+
+		size_t i = 0;
+		while (i < pixelCount) {
+			if (reader.read(1) == 0) {
+				size_t runEnd = std::min(pixelCount, i + readExpGolomb(reader) + 1);
+				for (; i < runEnd; i++) {
+					frame[i] = predict(frame, previous, i, width);
+				}
+			} else {
+				int k = context.parameter();
+				uint32_t quotient = reader.readUnary();
+				uint32_t value;
+				if (quotient < cEscapeQuotient) {
+					value = (quotient << k) | reader.read(k);
+				} else {
+					value = reader.read(17);
+				}
+
+				context.update(value);
+				frame[i] = (UINT16)(predict(frame, previous, i, width) + unzigzag(value + 1));
+				i++;
+			}
+		}
+	}
+
+private:
+	static const uint32_t cEscapeQuotient = 24;
+
+	static UINT16 predict(const UINT16 *frame, const UINT16 *previous, size_t index, size_t width) {
+		if (previous) {
+			return previous[index];
+		}
+
+		if (index % width != 0) {
+			return frame[index - 1];
+		}
+
+		return index >= width ? frame[index - width] : 0;
+	}
+
+	static uint32_t zigzag(int value) {
+		return value >= 0 ? (uint32_t)value << 1 : ((uint32_t)(-value) << 1) - 1;
+	}
+
+	static int unzigzag(uint32_t value) {
+		return (value & 1) ? -(int)((value + 1) >> 1) : (int)(value >> 1);
+	}
+
+	static void writeExpGolomb(BitWriter &writer, uint32_t value) {
+		uint32_t shifted = value + 1;
+		int bitCount = 0;
+		while ((shifted >> bitCount) > 1) {
+			bitCount++;
+		}
+
+		writer.writeUnary(bitCount);
+		writer.write(shifted & ((1u << bitCount) - 1), bitCount);
+	}
+
+	static uint32_t readExpGolomb(BitReader &reader) {
+		int bitCount = reader.readUnary();
+		return ((1u << bitCount) | reader.read(bitCount)) - 1;
+	}
+};
+
+
+// The layout of a depth stream file:
+//   DepthStreamHeader
+//   per frame: DepthStreamRecord followed by the encoded frame
+//   per frame: DepthStreamIndexEntry
+//   DepthStreamTrailer
+struct DepthStreamHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t keyFrameInterval;
+};
+
+#pragma pack(push, 1)
+struct DepthStreamRecord {
+	uint32_t size;
+	uint8_t isKeyFrame;
+	int64_t timestamp;
+};
+
+struct DepthStreamIndexEntry {
+	uint64_t offset;
+	int64_t timestamp;
+	uint8_t isKeyFrame;
+};
+
+struct DepthStreamTrailer {
+	uint64_t indexOffset;
+	uint64_t frameCount;
+	char magic[4];
+};
+#pragma pack(pop)
+
+static const char cDepthStreamMagic[4] = { 'W', 'M', 'D', 'S' };
+static const char cDepthStreamIndexMagic[4] = { 'W', 'M', 'D', 'I' };
+static const uint32_t cDepthStreamVersion = 1;
+
+
+// Records depth frames to a depth stream file
+class DepthStreamWriter {
+public:
+	DepthStreamWriter(const std::string &filename, uint width, uint height, uint keyFrameInterval = 30)
+		: m_outFile(filename, std::ios::binary), m_width(width), m_height(height), m_keyFrameInterval(keyFrameInterval), m_previous(width * height) {
+		if (!m_outFile) {
+			throw std::runtime_error("Unable to open \"" + filename + "\" for writing");
+		}
+
+		DepthStreamHeader header;
+		std::memcpy(header.magic, cDepthStreamMagic, sizeof(header.magic));
+		header.version = cDepthStreamVersion;
+		header.width = width;
+		header.height = height;
+		header.keyFrameInterval = keyFrameInterval;
+		if (!m_outFile.write(reinterpret_cast<const char*>(&header), sizeof(header))) {
+			throw std::runtime_error("Unable to write to \"" + filename + "\"");
+		}
+		m_bytesWritten = sizeof(header);
+
+		m_encoded.reserve(width * height * sizeof(UINT16));
+	}
+
+	~DepthStreamWriter() {
+		close();
+	}
+
+	// Compresses and appends a frame. If the frame cannot be written, the recording stops (without an index, so the
+	// frames written before it are found by scanning the file when it is read).
+	void writeFrame(const UINT16 *data, int64_t timestamp) {
+		if (m_closed) {
+			return;
+		}
+
+		bool isKeyFrame = m_index.size() % m_keyFrameInterval == 0;
+
+		m_encoded.clear();
+		DepthCodec::encode(data, isKeyFrame ? nullptr : m_previous.data(), m_width, m_height, m_encoded);
+		std::memcpy(m_previous.data(), data, m_previous.size() * sizeof(UINT16));
+
+		DepthStreamRecord record{ (uint32_t)m_encoded.size(), (uint8_t)isKeyFrame, timestamp };
+		m_outFile.write(reinterpret_cast<const char*>(&record), sizeof(record));
+		m_outFile.write(reinterpret_cast<const char*>(m_encoded.data()), m_encoded.size());
+
+		// (each frame reaches the operating system before the next, so a full disk is noticed at the frame it cut short)
+		if (!m_outFile.flush()) {
+			// (the recording ends with this frame, or part of it, which is ignored when the file is read)
+			m_failed = true;
+			m_closed = true;
+			m_outFile.close();
+			std::cerr << "Unable to write to the depth recording, later frames will not be recorded\n";
+			return;
+		}
+
+		m_index.push_back({ m_bytesWritten, timestamp, (uint8_t)isKeyFrame });
+		m_bytesWritten += sizeof(record) + m_encoded.size();
+	}
+
+	// Writes the frame index, completing the file
+	void close() {
+		if (m_closed) {
+			return;
+		}
+
+		DepthStreamTrailer trailer;
+		trailer.indexOffset = m_bytesWritten;
+		trailer.frameCount = m_index.size();
+		std::memcpy(trailer.magic, cDepthStreamIndexMagic, sizeof(trailer.magic));
+
+		m_outFile.write(reinterpret_cast<const char*>(m_index.data()), m_index.size() * sizeof(DepthStreamIndexEntry));
+		m_outFile.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+		m_outFile.close();
+		m_closed = true;
+
+		if (!m_outFile) {
+			// (the frames are still found by scanning the file when it is read)
+			m_failed = true;
+			std::cerr << "Unable to write the depth recording's index\n";
+		}
+	}
+
+	// The number of frames written so far
+	size_t frameCount() const {
+		return m_index.size();
+	}
+
+	// True if the recording could not be written (it holds the frames counted by frameCount)
+	bool failed() const {
+		return m_failed;
+	}
+
+	// The size of the frame data written so far (in bytes)
+	uint64_t bytesWritten() const {
+		return m_bytesWritten;
+	}
+
+private:
+	std::ofstream m_outFile;
+	uint m_width;
+	uint m_height;
+	uint m_keyFrameInterval;
+	bool m_closed = false;
+	bool m_failed = false;
+	uint64_t m_bytesWritten;
+	std::vector<UINT16> m_previous;
+	std::vector<uint8_t> m_encoded;
+	std::vector<DepthStreamIndexEntry> m_index;
+};
+
+
+// Reads frames, in order or by index, from a depth stream file
+class DepthStreamReader {
+public:
+	explicit DepthStreamReader(const std::string &filename) : m_inFile(filename, std::ios::binary) {
+		DepthStreamHeader header;
+		if (!m_inFile.read(reinterpret_cast<char*>(&header), sizeof(header))
+			|| std::memcmp(header.magic, cDepthStreamMagic, sizeof(header.magic)) != 0
+			|| header.version != cDepthStreamVersion) {
+			throw std::runtime_error("\"" + filename + "\" is not a depth stream");
+		}
+
+		m_width = header.width;
+		m_height = header.height;
+		m_decoded.resize(m_width * m_height);
+
+		if (!readIndex()) {
+			rebuildIndex();
+		}
+	}
+
+	uint width() const {
+		return m_width;
+	}
+
+	uint height() const {
+		return m_height;
+	}
+
+	size_t frameCount() const {
+		return m_index.size();
+	}
+
+	int64_t timestamp(size_t frameIndex) const {
+		return m_index[frameIndex].timestamp;
+	}
+
+	// Decodes the given frame into a buffer which remains valid until the next read
+	const UINT16 *readFrame(size_t frameIndex) {
+		if (frameIndex >= m_index.size()) {
+			return nullptr;
+		}
+
+		if (m_hasDecoded && m_decodedIndex == frameIndex) {
+			return m_decoded.data();
+		}
+
+		// Frames after the last decoded one (up to the next key frame) can be decoded from it
+		size_t start = frameIndex;
+		while (!m_index[start].isKeyFrame && !(m_hasDecoded && start == m_decodedIndex + 1)) {
+			start--;
+		}
+
+		for (size_t i = start; i <= frameIndex; i++) {
+			if (!decodeFrame(i)) {
+				m_hasDecoded = false;
+				return nullptr;
+			}
+		}
+
+		return m_decoded.data();
+	}
+
+private:
+	std::ifstream m_inFile;
+	uint m_width;
+	uint m_height;
+	std::vector<DepthStreamIndexEntry> m_index;
+	std::vector<uint8_t> m_encoded;
+	std::vector<UINT16> m_decoded;
+	std::vector<UINT16> m_previous;
+	bool m_hasDecoded = false;
+	size_t m_decodedIndex = 0;
+
+	bool decodeFrame(size_t frameIndex) {
+		const DepthStreamIndexEntry &entry = m_index[frameIndex];
+		DepthStreamRecord record;
+
+		m_inFile.clear();
+		m_inFile.seekg(entry.offset);
+		if (!m_inFile.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+			return false;
+		}
+
+		m_encoded.resize(record.size);
+		if (!m_inFile.read(reinterpret_cast<char*>(m_encoded.data()), record.size)) {
+			return false;
+		}
+
+		const UINT16 *previous = nullptr;
+		if (!record.isKeyFrame) {
+			m_previous.swap(m_decoded);
+			m_decoded.resize(m_previous.size());
+			previous = m_previous.data();
+		}
+
+		DepthCodec::decode(m_encoded.data(), m_encoded.size(), previous, m_width, m_height, m_decoded.data());
+		m_hasDecoded = true;
+		m_decodedIndex = frameIndex;
+		return true;
+	}
+
+	// Loads the index written on close
+	bool readIndex() {
+		DepthStreamTrailer trailer;
+
+		m_inFile.seekg(0, std::ios::end);
+		std::streamoff fileSize = m_inFile.tellg();
+		if (fileSize < (std::streamoff)(sizeof(DepthStreamHeader) + sizeof(trailer))) {
+			return false;
+		}
+
+		m_inFile.seekg(fileSize - (std::streamoff)sizeof(trailer));
+		if (!m_inFile.read(reinterpret_cast<char*>(&trailer), sizeof(trailer))
+			|| std::memcmp(trailer.magic, cDepthStreamIndexMagic, sizeof(trailer.magic)) != 0
+			|| trailer.indexOffset + trailer.frameCount * sizeof(DepthStreamIndexEntry) + sizeof(trailer) != (uint64_t)fileSize) {
+			return false;
+		}
+
+		m_index.resize(trailer.frameCount);
+		m_inFile.seekg(trailer.indexOffset);
+		return (bool)m_inFile.read(reinterpret_cast<char*>(m_index.data()), m_index.size() * sizeof(DepthStreamIndexEntry));
+	}
+
+	// Scans the frame records of a file which was not closed (eg: after a crash)
+	void rebuildIndex() {
+		m_index.clear();
+		m_inFile.clear();
+
+		uint64_t offset = sizeof(DepthStreamHeader);
+		DepthStreamRecord record;
+		while (m_inFile.seekg(offset) && m_inFile.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+			uint64_t next = offset + sizeof(record) + record.size;
+			char lastByte;
+			m_inFile.seekg(next - 1);
+			if (!m_inFile.get(lastByte)) {
+				break; // truncated final frame
+			}
+
+			m_index.push_back({ offset, record.timestamp, record.isKeyFrame });
+			offset = next;
+		}
+
+		if (!m_index.empty() && !m_index.front().isKeyFrame) {
+			m_index.clear();
+		}
+		m_inFile.clear();
+	}
+};
+
+
+// Replays a depth stream file, either as fast as frames are requested or paced by their timestamps
+class DepthStreamSource : public DepthSource {
+public:
+	DepthStreamSource(const std::string &filename, bool realtime = false) : m_reader(filename), m_realtime(realtime) { }
+
+	bool acquireFrame(DepthFrame &frame) override {
+		if (finished()) {
+			return false;
+		}
+
+		const UINT16 *data = m_reader.readFrame(m_frameIndex);
+		if (!data) {
+			m_frameIndex = m_reader.frameCount();
+			return false;
+		}
+
+		frame.data = data;
+		frame.width = m_reader.width();
+		frame.height = m_reader.height();
+		frame.timestamp = m_reader.timestamp(m_frameIndex);
+		m_frameIndex++;
+
+		if (m_realtime) {
+			m_clock.waitUntil(frame.timestamp);
+		}
+
+		return true;
+	}
+
+	bool finished() const override {
+		return m_frameIndex >= m_reader.frameCount();
+	}
+
+private:
+	DepthStreamReader m_reader;
+	bool m_realtime;
+	ReplayClock m_clock;
+	size_t m_frameIndex = 0;
+};
+
+
+// Opens a depth recording of either format (a depth stream, or raw frames)
+inline DepthSource *openDepthRecording(const std::string &filename, bool realtime = false) {
+	char magic[4] = { 0 };
+	std::ifstream inFile(filename, std::ios::binary);
+	inFile.read(magic, sizeof(magic));
+
+	if (std::memcmp(magic, cDepthStreamMagic, sizeof(magic)) == 0) {
+		return new DepthStreamSource(filename, realtime);
+	}
+
+	return new ReplayDepthSource(filename, realtime);
+}
@@ -0,0 +1,400 @@
+/*
+ * The module responsible for forming a coloured point cloud of the environment
+ * from a depth frame and a colour frame (deprojecting the depth frame with SIMD
+ * instructions where available, and splitting its rows across a pool of threads),
+ * or from many frames fused into a sparse grid of voxels.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ENVIRONMENT_CLOUD_SSE2
+#endif
+
+#include "opencv2/core.hpp"
+
+#include "DepthProjection.h"
+#include "PointCloud.h"
+#include "TaskPool.h"
+
+
+// A pixel of a colour frame, with the layout of the Kinect's RGBQUAD (as given for ColorImageFormat_Bgra)
+struct ColorPixel {
+	UINT8 b;
+	UINT8 g;
+	UINT8 r;
+	UINT8 a;
+};
+
+
+// Sets positions[x] to the camera space position of each depth pixel of a row (with the row's
+// (x, y) factors from a DepthProjection's table). Pixels without a depth are placed at the origin.
+inline void deprojectRow(const UINT16 *depth, const cv::Point2f *factors, cv::Point3f *positions, int width) {
+	int x = 0;
+
+#if defined(ENVIRONMENT_CLOUD_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	float *out = reinterpret_cast<float*>(positions);
+	const float *in = reinterpret_cast<const float*>(factors);
+	for (; x + 4 <= width; x += 4) {
+		__m128 z = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(depth + x)), zero));
+		__m128 xy01 = _mm_mul_ps(_mm_loadu_ps(in + 2 * x), _mm_unpacklo_ps(z, z)); // (x0, y0, x1, y1)
+		__m128 xy23 = _mm_mul_ps(_mm_loadu_ps(in + 2 * x + 4), _mm_unpackhi_ps(z, z)); // (x2, y2, x3, y3)
+
+		// Interleave into (x0, y0, z0, x1), (y1, z1, x2, y2), (z2, x3, y3, z3)
+		__m128 z0x1 = _mm_shuffle_ps(z, xy01, _MM_SHUFFLE(2, 2, 0, 0));
+		__m128 y1z1 = _mm_shuffle_ps(xy01, z, _MM_SHUFFLE(1, 1, 3, 3));
+		__m128 z2z3x3y3 = _mm_shuffle_ps(z, xy23, _MM_SHUFFLE(3, 2, 3, 2));
+		_mm_storeu_ps(out + 3 * x, _mm_shuffle_ps(xy01, z0x1, _MM_SHUFFLE(2, 0, 1, 0)));
+		_mm_storeu_ps(out + 3 * x + 4, _mm_shuffle_ps(y1z1, xy23, _MM_SHUFFLE(1, 0, 2, 0)));
+		_mm_storeu_ps(out + 3 * x + 8, _mm_shuffle_ps(z2z3x3y3, z2z3x3y3, _MM_SHUFFLE(1, 3, 2, 0)));
+	}
+#endif
+
+	for (; x < width; x++) {
+		float z = depth[x];
+		positions[x] = { factors[x].x * z, factors[x].y * z, z };
+	}
+}
+
+
+// Forms a point cloud from the given depth frame (of the projection's size), coloured by the given colour frame.
+// colorPoints holds the position of each depth pixel in the colour frame (eg: from MapDepthFrameToColorSpace).
+// Pixels without a depth, or outside the colour frame, are left out. Rows are shared between the pool's threads
+// (nullptr: formed on the calling thread), and the points are in the same (row-major) order either way.
+inline PointCloud formEnvironmentCloud(const UINT16 *depth, const cv::Point2f *colorPoints, const ColorPixel *color, int colorWidth, int colorHeight, const DepthProjection &projection, TaskPool *pool = nullptr) {
+	const int depthWidth = projection.width();
+	const int depthHeight = projection.height();
+	const int rowsPerTask = 16;
+	const size_t taskCount = (depthHeight + rowsPerTask - 1) / rowsPerTask;
+
+	// Each task writes its points from the start of its own rows' share of the storage, then the shares are joined
+	std::vector<ColoredPoint> points(depthWidth * depthHeight);
+	std::vector<size_t> taskPointCounts(taskCount);
+
+	auto formRows = [&](size_t task) {
+		std::vector<cv::Point3f> positions(depthWidth);
+		int firstRow = (int)task * rowsPerTask;
+		int lastRow = std::min(firstRow + rowsPerTask, depthHeight);
+		ColoredPoint *out = points.data() + firstRow * depthWidth;
+		size_t count = 0;
+
+		for (int y = firstRow; y < lastRow; y++) {
+			size_t rowStart = y * depthWidth;
+			deprojectRow(depth + rowStart, projection.table() + rowStart, positions.data(), depthWidth);
+
+			for (int x = 0; x < depthWidth; x++) {
+				cv::Point2f csp = colorPoints[rowStart + x];
+
+				// (unmapped pixels are given infinite colour positions, which fail these comparisons)
+				if (depth[rowStart + x] == 0 || !(csp.x > -1 && csp.x < colorWidth && csp.y > -1 && csp.y < colorHeight)) {
+					continue;
+				}
+
+				ColorPixel pixel = color[(int)csp.y * colorWidth + (int)csp.x];
+				cv::Point3f position = positions[x];
+				out[count++] = { position.x, position.y, position.z, pixel.r, pixel.g, pixel.b };
+			}
+		}
+
+		taskPointCounts[task] = count;
+	};
+
+	if (pool) {
+		pool->run(taskCount, formRows);
+	} else {
+		for (size_t i = 0; i < taskCount; i++) {
+			formRows(i);
+		}
+	}
+
+	// Each share starts at or after the end of the previous one (once moved), so they can be moved forwards in turn
+	size_t total = 0;
+	for (size_t task = 0; task < taskCount; task++) {
+		ColoredPoint *share = points.data() + task * rowsPerTask * depthWidth;
+		std::copy(share, share + taskPointCounts[task], points.data() + total);
+		total += taskPointCounts[task];
+	}
+	points.resize(total);
+
+	return PointCloud(std::move(points));
+}
+
+
+// The sums of the points which fell within a single voxel (with positions relative to the voxel's corner,
+// so that they remain precise however many points are added)
+struct Voxel {
+	float x = 0;
+	float y = 0;
+	float z = 0;
+	uint32_t r = 0;
+	uint32_t g = 0;
+	uint32_t b = 0;
+	uint32_t count = 0;
+};
+
+
+// A sparse grid of cubic voxels, which merges the points added to it into one point per voxel (at their average
+// position and colour). The voxels are held in a flat, open-addressed hash table, which only allocates when it grows.
+class VoxelGrid {
+public:
+	explicit VoxelGrid(float voxelSize_mm, size_t expectedVoxels = 1 << 16) : m_voxelSize_mm(voxelSize_mm) {
+		size_t capacity = 16;
+		while (capacity < 2 * expectedVoxels) {
+			capacity *= 2;
+		}
+		allocate(capacity);
+	}
+
+	// Adds a point, with its colour, to the voxel containing it
+	void addPoint(cv::Point3f point, UINT8 r, UINT8 g, UINT8 b) {
+		int64_t ix = (int64_t)std::floor(point.x / m_voxelSize_mm);
+		int64_t iy = (int64_t)std::floor(point.y / m_voxelSize_mm);
+		int64_t iz = (int64_t)std::floor(point.z / m_voxelSize_mm);
+
+		Voxel &voxel = findVoxel(packKey(ix, iy, iz));
+		voxel.x += point.x - ix * m_voxelSize_mm;
+		voxel.y += point.y - iy * m_voxelSize_mm;
+		voxel.z += point.z - iz * m_voxelSize_mm;
+		voxel.r += r;
+		voxel.g += g;
+		voxel.b += b;
+		voxel.count++;
+	}
+
+	// Forms a point cloud with a point at the average position and colour of each voxel
+	PointCloud toPointCloud() const {
+		std::vector<ColoredPoint> points;
+		points.reserve(m_voxelCount);
+
+		for (size_t i = 0; i < m_keys.size(); i++) {
+			if (m_keys[i] == cEmptyKey) {
+				continue;
+			}
+
+			const Voxel &voxel = m_voxels[i];
+			int64_t ix, iy, iz;
+			unpackKey(m_keys[i], ix, iy, iz);
+			float scale = 1.0f / voxel.count;
+			points.push_back({ ix * m_voxelSize_mm + voxel.x * scale, iy * m_voxelSize_mm + voxel.y * scale, iz * m_voxelSize_mm + voxel.z * scale,
+				(UINT8)(voxel.r / voxel.count), (UINT8)(voxel.g / voxel.count), (UINT8)(voxel.b / voxel.count) });
+		}
+
+		return PointCloud(std::move(points));
+	}
+
+	size_t voxelCount() const {
+		return m_voxelCount;
+	}
+
+private:
+	float m_voxelSize_mm;
+
+	// The hash table (a power of two in size, kept at most half full)
+	std::vector<uint64_t> m_keys;
+	std::vector<Voxel> m_voxels;
+	size_t m_voxelCount = 0;
+
+	// (no voxel has this key, as each of its indices would have to be -2^20 - 1)
+	const uint64_t cEmptyKey = ~(uint64_t)0;
+
+	// Packs the voxel's (x, y, z) indices into 21 bits each (enough for +-10 km with 10 mm voxels)
+	static uint64_t packKey(int64_t ix, int64_t iy, int64_t iz) {
+		const int64_t offset = 1 << 20;
+		return (((uint64_t)(ix + offset) & 0x1FFFFF) << 42) | (((uint64_t)(iy + offset) & 0x1FFFFF) << 21) | ((uint64_t)(iz + offset) & 0x1FFFFF);
+	}
+
+	static void unpackKey(uint64_t key, int64_t &ix, int64_t &iy, int64_t &iz) {
+		const int64_t offset = 1 << 20;
+		ix = (int64_t)((key >> 42) & 0x1FFFFF) - offset;
+		iy = (int64_t)((key >> 21) & 0x1FFFFF) - offset;
+		iz = (int64_t)(key & 0x1FFFFF) - offset;
+	}
+
+	void allocate(size_t capacity) {
+		m_keys.assign(capacity, cEmptyKey);
+		m_voxels.assign(capacity, Voxel());
+		m_voxelCount = 0;
+	}
+
+	size_t slot(uint64_t key) const {
+		return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (m_keys.size() - 1);
+	}
+
+	// Returns the voxel with the given key, adding it if there is none
+	Voxel &findVoxel(uint64_t key) {
+		size_t i = slot(key);
+		while (m_keys[i] != key) {
+			if (m_keys[i] == cEmptyKey) {
+				if (2 * (m_voxelCount + 1) > m_keys.size()) {
+					grow();
+					return findVoxel(key);
+				}
+
+				m_keys[i] = key;
+				m_voxelCount++;
+				break;
+			}
+			i = (i + 1) & (m_keys.size() - 1);
+		}
+
+		return m_voxels[i];
+	}
+
+	void grow() {
+		std::vector<uint64_t> keys;
+		std::vector<Voxel> voxels;
+		keys.swap(m_keys);
+		voxels.swap(m_voxels);
+		allocate(2 * keys.size());
+
+		for (size_t i = 0; i < keys.size(); i++) {
+			if (keys[i] == cEmptyKey) {
+				continue;
+			}
+
+			size_t j = slot(keys[i]);
+			while (m_keys[j] != cEmptyKey) {
+				j = (j + 1) & (m_keys.size() - 1);
+			}
+			m_keys[j] = keys[i];
+			m_voxels[j] = voxels[i];
+			m_voxelCount++;
+		}
+	}
+};
+
+
+// Fuses any number of coloured depth frames from a fixed sensor into one cloud of the environment. The Kinect's
+// depth noise lies along each pixel's ray, so each pixel's depth (and colour) is averaged over the frames, ignoring
+// depths far from its average (eg: of people passing through), before the averaged frame is merged into voxels
+// (so that surfaces near the sensor, seen by many pixels, are not much denser than those far away). Depth frames
+// without a colour frame may be fused too, so that the cloud can be refined over a whole session (without losing
+// the colour of any surface).
+class EnvironmentFusion {
+public:
+	// The projection must outlive the fusion
+	EnvironmentFusion(const DepthProjection *projection, float voxelSize_mm) : m_projection(projection), m_voxelSize_mm(voxelSize_mm),
+		m_pixels(projection->width() * projection->height()) {}
+
+	// Adds a depth frame (of the projection's size), coloured by the given colour frame, as for formEnvironmentCloud.
+	// Takes the same (short) time for every frame, so frames may be fused as they arrive.
+	void fuseFrame(const UINT16 *depth, const cv::Point2f *colorPoints, const ColorPixel *color, int colorWidth, int colorHeight) {
+		for (size_t i = 0; i < m_pixels.size(); i++) {
+			cv::Point2f csp = colorPoints[i];
+			if (depth[i] == 0 || !(csp.x > -1 && csp.x < colorWidth && csp.y > -1 && csp.y < colorHeight)) {
+				continue;
+			}
+
+			FusedPixel &pixel = m_pixels[i];
+			if (!fuseDepth(pixel, depth[i], true)) {
+				continue;
+			}
+
+			ColorPixel colorPixel = color[(int)csp.y * colorWidth + (int)csp.x];
+			pixel.r += colorPixel.r;
+			pixel.g += colorPixel.g;
+			pixel.b += colorPixel.b;
+			pixel.colorCount++;
+		}
+
+		m_frameCount++;
+		m_colorFrameCount++;
+	}
+
+	// Adds a depth frame without a colour frame (eg: one used for tracking), which refines the depths of the pixels
+	// it agrees with. It never replaces a coloured pixel (whose colour it could not replace), so it only adds surfaces
+	// which no coloured frame has seen (eg: outside the colour frame), which are given cUncolored.
+	void fuseDepthFrame(const UINT16 *depth) {
+		for (size_t i = 0; i < m_pixels.size(); i++) {
+			if (depth[i] != 0) {
+				fuseDepth(m_pixels[i], depth[i], m_pixels[i].colorCount == 0);
+			}
+		}
+
+		m_frameCount++;
+	}
+
+	// Forms the cloud of the frames fused so far, from the pixels with a depth in at least minFrames of them
+	PointCloud toPointCloud(uint32_t minFrames = 1) const {
+		VoxelGrid voxels(m_voxelSize_mm, m_pixels.size() / 4);
+		uint width = m_projection->width();
+
+		for (size_t i = 0; i < m_pixels.size(); i++) {
+			const FusedPixel &pixel = m_pixels[i];
+			if (pixel.count < std::max(minFrames, 1u)) {
+				continue;
+			}
+
+			cv::Point3f desc = { (float)(i % width), (float)(i / width), (float)pixel.depth / pixel.count };
+			if (pixel.colorCount > 0) {
+				voxels.addPoint(m_projection->desc2Pos(desc), (UINT8)(pixel.r / pixel.colorCount), (UINT8)(pixel.g / pixel.colorCount), (UINT8)(pixel.b / pixel.colorCount));
+			} else {
+				voxels.addPoint(m_projection->desc2Pos(desc), cUncolored.r, cUncolored.g, cUncolored.b);
+			}
+		}
+
+		return voxels.toPointCloud();
+	}
+
+	// The number of frames fused so far (of either kind), and of coloured frames
+	size_t frameCount() const {
+		return m_frameCount;
+	}
+
+	size_t colorFrameCount() const {
+		return m_colorFrameCount;
+	}
+
+private:
+	// The sums of a pixel's depths and colours, over the frames which agreed with them (colours only over the coloured frames)
+	struct FusedPixel {
+		uint32_t depth = 0;
+		uint32_t r = 0;
+		uint32_t g = 0;
+		uint32_t b = 0;
+		uint32_t count = 0;
+		uint32_t colorCount = 0;
+		uint32_t disagreements = 0; // in a row, since the last depth which agreed
+	};
+
+	const DepthProjection *m_projection;
+	float m_voxelSize_mm;
+	std::vector<FusedPixel> m_pixels;
+	size_t m_frameCount = 0;
+	size_t m_colorFrameCount = 0;
+
+	// Depths differing from a pixel's average by more than the larger of these (absolute and proportional) are not averaged
+	const float cMinTolerance_mm = 30;
+	const float cTolerance = 0.03f;
+
+	// The colour of pixels which have only been seen in depth frames (grey)
+	const ColorPixel cUncolored = { 128, 128, 128, 0 };
+
+	// Adds a depth to the pixel's average, returning false if it disagrees with the average instead. A depth which
+	// has disagreed with the pixel's average for more frames in a row than have agreed with it replaces the pixel
+	// (something has moved), if replacing it is allowed.
+	bool fuseDepth(FusedPixel &pixel, UINT16 depth, bool mayReplace) {
+		float z = depth;
+		if (pixel.count > 0 && std::abs(z - (float)pixel.depth / pixel.count) > std::max(cMinTolerance_mm, cTolerance * z)) {
+			if (!mayReplace || ++pixel.disagreements <= pixel.count) {
+				return false;
+			}
+			pixel = FusedPixel();
+		}
+
+		pixel.depth += depth;
+		pixel.count++;
+		pixel.disagreements = 0;
+		return true;
+	}
+};
@@ -0,0 +1,331 @@
+/*
+ * A stand-in for any number of ESP8266 modules running SignalStrengthServer, each
+ * served on its own local port, for testing the receiver modules without hardware.
+ *
+ * Written by Marc Katzef
+ */
+
+#include "EspEmulator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "WiFiReceiver.h"
+
+using namespace std;
+
+// As recorded by SignalStrengthServer
+static const chrono::microseconds cSampleInterval(2000);
+static const uint32_t cSampleBufferLength = 256;
+static const uint32_t cMaxBatchSamples = 64;
+
+// The longest time to wait in poll, so that stop is handled promptly
+static const chrono::milliseconds cMaxPollTime(50);
+
+static const double PI = 3.14159265358979323846;
+
+
+EspEmulator::EspEmulator(const EspEmulatorConfig &config) :
+	m_config(config),
+	m_random(config.seed) {
+
+	initSockets();
+}
+
+
+EspEmulator::~EspEmulator() {
+	stop();
+}
+
+
+bool EspEmulator::start() {
+	if (m_running) {
+		return true;
+	}
+
+	for (size_t i = 0; i < m_config.moduleCount; i++) {
+		socket_t listener = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listener == cInvalidSocket) {
+			printf("Unable to create a socket (error %d)\n", lastSocketError());
+			closeAll();
+			return false;
+		}
+
+		int reuse = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons((uint16_t)(m_config.firstPort + i));
+
+		m_listeners.push_back(listener);
+		if (::bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0
+			|| !setSocketNonBlocking(listener)) {
+			printf("Unable to listen on port %d (error %d)\n", (int)(m_config.firstPort + i), lastSocketError());
+			closeAll();
+			return false;
+		}
+	}
+
+	m_startTime = chrono::steady_clock::now();
+	m_running = true;
+	m_thread = thread(&EspEmulator::run, this);
+	return true;
+}
+
+
+void EspEmulator::stop() {
+	m_running = false;
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+
+	closeAll();
+}
+
+
+int EspEmulator::rssiAt(size_t module, time_point time) const {
+	double time_s = chrono::duration<double>(time - m_startTime).count();
+	double phase = time_s / m_config.period_s + (double)module / max<size_t>(m_config.moduleCount, 1);
+
+	double value = 0;
+	switch (m_config.waveform) {
+	case WAVEFORMS::CONSTANT: {
+		break;
+	}
+	case WAVEFORMS::SINE: {
+		value = sin(2 * PI * phase);
+		break;
+	}
+	case WAVEFORMS::SQUARE: {
+		value = phase - floor(phase) < 0.5 ? 1 : -1;
+		break;
+	}
+	case WAVEFORMS::NOISE: {
+		// A hash of the module and sample number, so that repeated queries agree
+		uint64_t hash = (uint64_t)(time_s * 1e6 / cSampleInterval.count()) * 0x9E3779B97F4A7C15ull ^ (module + 1) * 0xC2B2AE3D27D4EB4Full;
+		hash ^= hash >> 29;
+		hash *= 0xBF58476D1CE4E5B9ull;
+		hash ^= hash >> 32;
+		value = (double)(hash % 20001) / 10000 - 1;
+		break;
+	}
+	}
+
+	return (int)lround(m_config.meanRssi + m_config.amplitude * value);
+}
+
+
+void EspEmulator::run() {
+	vector<pollfd> pollSet;
+
+	while (m_running) {
+		time_point now = chrono::steady_clock::now();
+		time_point deadline = now + cMaxPollTime;
+
+		// Listeners first, then connections (in order)
+		pollSet.clear();
+		for (socket_t listener : m_listeners) {
+			pollfd entry;
+			entry.fd = listener;
+			entry.events = POLLIN;
+			entry.revents = 0;
+			pollSet.push_back(entry);
+		}
+
+		for (unique_ptr<Connection> &connection : m_connections) {
+			pollfd entry;
+			entry.fd = connection->socket;
+			entry.events = connection->output.empty() ? POLLIN : POLLIN | POLLOUT;
+			entry.revents = 0;
+			pollSet.push_back(entry);
+
+			if (!connection->pending.empty()) {
+				deadline = min(deadline, connection->pending.front().due);
+			}
+		}
+
+		int timeout_ms = (int)max<int64_t>(0, chrono::duration_cast<chrono::milliseconds>(deadline - now).count());
+		if (pollSockets(pollSet.data(), pollSet.size(), timeout_ms) < 0) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+			continue;
+		}
+
+		now = chrono::steady_clock::now();
+		for (size_t i = 0; i < m_listeners.size(); i++) {
+			if (pollSet[i].revents & POLLIN) {
+				accept(i);
+			}
+		}
+
+		// Connections accepted above are handled by the next poll
+		size_t connectionCount = pollSet.size() - m_listeners.size();
+		for (size_t i = 0; i < connectionCount; i++) {
+			Connection &connection = *m_connections[i];
+			short revents = pollSet[m_listeners.size() + i].revents;
+
+			bool open = true;
+			if (revents & (POLLIN | POLLHUP | POLLERR)) {
+				open = receive(connection, now);
+			}
+
+			if (open) {
+				open = send(connection, now);
+			}
+
+			if (!open) {
+				closeSocket(connection.socket);
+				connection.socket = cInvalidSocket;
+			}
+		}
+
+		m_connections.erase(remove_if(m_connections.begin(), m_connections.end(),
+			[](const unique_ptr<Connection> &connection) { return connection->socket == cInvalidSocket; }), m_connections.end());
+	}
+}
+
+
+void EspEmulator::accept(size_t module) {
+	while (true) {
+		socket_t socket = ::accept(m_listeners[module], NULL, NULL);
+		if (socket == cInvalidSocket) {
+			return;
+		}
+
+		setSocketNonBlocking(socket);
+		setSocketNoDelay(socket);
+
+		unique_ptr<Connection> connection(new Connection());
+		connection->module = module;
+		connection->socket = socket;
+		m_connections.push_back(move(connection));
+	}
+}
+
+
+bool EspEmulator::receive(Connection &connection, time_point now) {
+	char buffer[4096];
+	int received = recv(connection.socket, buffer, sizeof(buffer), 0);
+	if (received == 0 || (received < 0 && !isInProgressError(lastSocketError()))) {
+		return false;
+	}
+
+	if (received > 0) {
+		connection.input.append(buffer, received);
+	}
+
+	uniform_real_distribution<double> unit(0, 1);
+	size_t requestEnd;
+	while ((requestEnd = connection.input.find("\r\n\r\n")) != string::npos) {
+		// Request line (eg: "GET /rssi HTTP/1.1")
+		size_t pathStart = connection.input.find(' ') + 1;
+		size_t pathEnd = connection.input.find(' ', pathStart);
+		string path = connection.input.substr(pathStart, pathEnd - pathStart);
+		connection.input.erase(0, requestEnd + 4);
+
+		if (unit(m_random) < m_config.dropRate) {
+			m_dropCount++;
+			return false;
+		}
+
+		// Responses are sent in order, as HTTP requires
+		double delay_ms = max(0.0, m_config.latency_ms + m_config.jitter_ms * (2 * unit(m_random) - 1));
+		PendingRequest request;
+		request.due = now + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, milli>(delay_ms));
+		if (!connection.pending.empty()) {
+			request.due = max(request.due, connection.pending.back().due);
+		}
+		request.path = path;
+		connection.pending.push_back(request);
+	}
+
+	return true;
+}
+
+
+bool EspEmulator::send(Connection &connection, time_point now) {
+	while (!connection.pending.empty() && connection.pending.front().due <= now) {
+		connection.output += respond(connection.module, connection.pending.front().path, now);
+		connection.pending.pop_front();
+		m_responseCount++;
+	}
+
+	while (!connection.output.empty()) {
+		int sent = ::send(connection.socket, connection.output.data(), (int)connection.output.size(), cSendFlags);
+		if (sent < 0) {
+			return isInProgressError(lastSocketError());
+		}
+
+		connection.output.erase(0, sent);
+	}
+
+	return true;
+}
+
+
+string EspEmulator::respond(size_t module, const string &path, time_point now) const {
+	string contentType = "text/html";
+	string body;
+
+	if (path == "/rssi") {
+		body = to_string(rssiAt(module, now));
+	} else if (path.compare(0, 17, "/rssi/batch?since") == 0 && m_config.serveBatches) {
+		// The samples recorded since the module started, as SignalStrengthServer records them
+		uint32_t sampleCount = (uint32_t)((now - m_startTime) / cSampleInterval) + 1;
+		uint32_t since = strtoul(path.c_str() + 18, NULL, 10);
+		if (since > sampleCount) {
+			since = 0;
+		}
+
+		uint32_t oldest = sampleCount > cSampleBufferLength ? sampleCount - cSampleBufferLength : 0;
+		uint32_t first = max(since, oldest) + 1;
+		uint32_t count = min(cMaxBatchSamples, sampleCount + 1 - first);
+
+		body.resize(cBatchHeaderLength + count * cBatchSampleLength);
+		uint8_t *data = reinterpret_cast<uint8_t*>(&body[0]);
+		data[0] = 'W';
+		data[1] = 'B';
+		data[2] = cBatchVersion;
+		data[3] = (uint8_t)count;
+		for (int i = 0; i < 4; i++) {
+			data[4 + i] = (first >> (8 * i)) & 0xFF;
+		}
+
+		for (uint32_t i = 0; i < count; i++) {
+			chrono::microseconds sampleTime = cSampleInterval * (first - 1 + i);
+			uint32_t timestamp_us = (uint32_t)sampleTime.count();
+			int16_t rssi = (int16_t)rssiAt(module, m_startTime + sampleTime);
+
+			uint8_t *sample = data + cBatchHeaderLength + i * cBatchSampleLength;
+			for (int j = 0; j < 4; j++) {
+				sample[j] = (timestamp_us >> (8 * j)) & 0xFF;
+			}
+			sample[4] = rssi & 0xFF;
+			sample[5] = (rssi >> 8) & 0xFF;
+		}
+
+		contentType = "application/octet-stream";
+	} else {
+		return "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+	}
+
+	return "HTTP/1.1 200 OK\r\nContent-Type: " + contentType + "\r\nContent-Length: " + to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+
+void EspEmulator::closeAll() {
+	for (socket_t listener : m_listeners) {
+		closeSocket(listener);
+	}
+	m_listeners.clear();
+
+	for (unique_ptr<Connection> &connection : m_connections) {
+		closeSocket(connection->socket);
+	}
+	m_connections.clear();
+}
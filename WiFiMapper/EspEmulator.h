@@ -0,0 +1,99 @@
+/*
+ * A stand-in for any number of ESP8266 modules running SignalStrengthServer, each
+ * served on its own local port, for testing the receiver modules without hardware.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Sockets.h"
+
+
+enum class WAVEFORMS { CONSTANT, SINE, SQUARE, NOISE };
+
+struct EspEmulatorConfig {
+	uint16_t firstPort = 18000; // module i is served on firstPort + i
+	size_t moduleCount = 5;
+	double latency_ms = 5; // before each response is sent
+	double jitter_ms = 2; // latency varies uniformly by up to this much either way
+	double dropRate = 0; // the proportion of requests for which the connection is closed instead
+	WAVEFORMS waveform = WAVEFORMS::SINE;
+	double meanRssi = -55; // dBm
+	double amplitude = 10; // dBm
+	double period_s = 2; // of SINE and SQUARE (each module's phase differs)
+	bool serveBatches = true; // false: answer /rssi/batch with 404, as firmware from before batches does
+	unsigned seed = 1;
+};
+
+
+// Serves /rssi and /rssi/batch (as SignalStrengthServer does) for every emulated
+// module, on a single thread which polls all of their sockets
+class EspEmulator {
+public:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	explicit EspEmulator(const EspEmulatorConfig &config);
+	~EspEmulator();
+
+	EspEmulator(const EspEmulator &) = delete;
+	EspEmulator &operator=(const EspEmulator &) = delete;
+
+	// Opens every module's port and begins serving. Returns false if a port is unavailable.
+	bool start();
+
+	void stop();
+
+	// The RSSI of the given module at the given time
+	int rssiAt(size_t module, time_point time) const;
+
+	// The number of requests answered and dropped (so far)
+	uint64_t responseCount() const {
+		return m_responseCount;
+	}
+
+	uint64_t dropCount() const {
+		return m_dropCount;
+	}
+
+private:
+	struct PendingRequest {
+		time_point due; // when it is answered
+		std::string path;
+	};
+
+	struct Connection {
+		size_t module;
+		socket_t socket;
+		std::string input;
+		std::string output; // being sent
+		std::deque<PendingRequest> pending; // in order of arrival (and so due time)
+	};
+
+	EspEmulatorConfig m_config;
+	std::vector<socket_t> m_listeners; // by module
+	std::vector<std::unique_ptr<Connection>> m_connections;
+	time_point m_startTime;
+	std::mt19937 m_random;
+	std::atomic<bool> m_running{ false };
+	std::atomic<uint64_t> m_responseCount{ 0 };
+	std::atomic<uint64_t> m_dropCount{ 0 };
+	std::thread m_thread;
+
+	void run();
+	void accept(size_t module);
+	bool receive(Connection &connection, time_point now);
+	bool send(Connection &connection, time_point now);
+	std::string respond(size_t module, const std::string &path, time_point now) const;
+	void closeAll();
+};
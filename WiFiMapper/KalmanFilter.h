@@ -0,0 +1,226 @@
+/*
+ * A Kalman filter with dimensions fixed at compile time, so that its matrices are held
+ * in place (rather than on the heap) and its loops can be unrolled by the compiler.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+
+// A row-major matrix with dimensions fixed at compile time
+template <int ROWS, int COLS, typename T = float>
+struct FixedMatrix {
+	T data[ROWS][COLS];
+
+	T &operator()(int row, int col) {
+		return data[row][col];
+	}
+
+	const T &operator()(int row, int col) const {
+		return data[row][col];
+	}
+
+	// Elements by their (row-major) index, like cv::Mat::at
+	T &operator[](int index) {
+		return data[index / COLS][index % COLS];
+	}
+
+	const T &operator[](int index) const {
+		return data[index / COLS][index % COLS];
+	}
+
+	static FixedMatrix zeros() {
+		FixedMatrix result;
+		for (int r = 0; r < ROWS; r++) {
+			for (int c = 0; c < COLS; c++) {
+				result.data[r][c] = 0;
+			}
+		}
+		return result;
+	}
+
+	// A matrix with the given value along its diagonal (and zeros elsewhere)
+	static FixedMatrix identity(T value = 1) {
+		FixedMatrix result = zeros();
+		for (int i = 0; i < ROWS && i < COLS; i++) {
+			result.data[i][i] = value;
+		}
+		return result;
+	}
+
+	FixedMatrix<COLS, ROWS, T> t() const {
+		FixedMatrix<COLS, ROWS, T> result;
+		for (int r = 0; r < ROWS; r++) {
+			for (int c = 0; c < COLS; c++) {
+				result.data[c][r] = data[r][c];
+			}
+		}
+		return result;
+	}
+
+	template <int N>
+	FixedMatrix<ROWS, N, T> operator*(const FixedMatrix<COLS, N, T> &other) const {
+		return multiplyAdd(*this, other, FixedMatrix<ROWS, N, T>::zeros());
+	}
+
+	FixedMatrix operator+(const FixedMatrix &other) const {
+		FixedMatrix result;
+		for (int r = 0; r < ROWS; r++) {
+			for (int c = 0; c < COLS; c++) {
+				result.data[r][c] = data[r][c] + other.data[r][c];
+			}
+		}
+		return result;
+	}
+
+	FixedMatrix operator-(const FixedMatrix &other) const {
+		FixedMatrix result;
+		for (int r = 0; r < ROWS; r++) {
+			for (int c = 0; c < COLS; c++) {
+				result.data[r][c] = data[r][c] - other.data[r][c];
+			}
+		}
+		return result;
+	}
+};
+
+
+// Returns C + sign*AB, accumulated in double precision before rounding (as cv::gemm does), which
+// keeps the differences of nearly equal products (eg: the corrected error covariance) accurate
+template <int ROWS, int N, int COLS, typename T>
+FixedMatrix<ROWS, COLS, T> multiplyAdd(const FixedMatrix<ROWS, N, T> &a, const FixedMatrix<N, COLS, T> &b, const FixedMatrix<ROWS, COLS, T> &c, double sign = 1) {
+	FixedMatrix<ROWS, COLS, T> result;
+	for (int r = 0; r < ROWS; r++) {
+		for (int col = 0; col < COLS; col++) {
+			double sum = 0;
+			for (int i = 0; i < N; i++) {
+				sum += (double)a.data[r][i] * b.data[i][col];
+			}
+			result.data[r][col] = (T)(c.data[r][col] + sign * sum);
+		}
+	}
+	return result;
+}
+
+
+// Returns X such that AX = B, for a non-singular A (by Gaussian elimination with partial pivoting,
+// in double precision). A need not be exactly symmetric: rounding leaves covariances slightly
+// asymmetric, and solving with only half of them (eg: by Cholesky decomposition) loses accuracy.
+template <int N, int COLS, typename T>
+FixedMatrix<N, COLS, T> solve(const FixedMatrix<N, N, T> &a, const FixedMatrix<N, COLS, T> &b) {
+	double lhs[N][N];
+	double rhs[N][COLS];
+	for (int r = 0; r < N; r++) {
+		for (int c = 0; c < N; c++) {
+			lhs[r][c] = a.data[r][c];
+		}
+		for (int c = 0; c < COLS; c++) {
+			rhs[r][c] = b.data[r][c];
+		}
+	}
+
+	for (int pivot = 0; pivot < N; pivot++) {
+		int pivotRow = pivot;
+		for (int r = pivot + 1; r < N; r++) {
+			if (std::abs(lhs[r][pivot]) > std::abs(lhs[pivotRow][pivot])) {
+				pivotRow = r;
+			}
+		}
+
+		if (pivotRow != pivot) {
+			for (int c = 0; c < N; c++) {
+				std::swap(lhs[pivot][c], lhs[pivotRow][c]);
+			}
+			for (int c = 0; c < COLS; c++) {
+				std::swap(rhs[pivot][c], rhs[pivotRow][c]);
+			}
+		}
+
+		for (int r = pivot + 1; r < N; r++) {
+			double factor = lhs[r][pivot] / lhs[pivot][pivot];
+			for (int c = pivot; c < N; c++) {
+				lhs[r][c] -= factor * lhs[pivot][c];
+			}
+			for (int c = 0; c < COLS; c++) {
+				rhs[r][c] -= factor * rhs[pivot][c];
+			}
+		}
+	}
+
+	FixedMatrix<N, COLS, T> result;
+	for (int c = 0; c < COLS; c++) {
+		for (int r = N - 1; r >= 0; r--) {
+			double sum = rhs[r][c];
+			for (int i = r + 1; i < N; i++) {
+				sum -= lhs[r][i] * result.data[i][c];
+			}
+			result.data[r][c] = (T)(sum / lhs[r][r]);
+		}
+	}
+
+	return result;
+}
+
+
+// A linear Kalman filter (without control inputs) with the same members and behaviour as
+// cv::KalmanFilter, but with the numbers of state and measurement variables fixed at compile time.
+template <int STATES, int MEASUREMENTS, typename T = float>
+class FixedKalmanFilter {
+public:
+	typedef FixedMatrix<STATES, 1, T> State;
+	typedef FixedMatrix<MEASUREMENTS, 1, T> Measurement;
+
+	State statePre; // predicted state: x'(k) = A*x(k-1)
+	State statePost; // corrected state: x(k) = x'(k) + K(k)*(z(k) - H*x'(k))
+	FixedMatrix<STATES, STATES, T> transitionMatrix; // A
+	FixedMatrix<MEASUREMENTS, STATES, T> measurementMatrix; // H
+	FixedMatrix<STATES, STATES, T> processNoiseCov; // Q
+	FixedMatrix<MEASUREMENTS, MEASUREMENTS, T> measurementNoiseCov; // R
+	FixedMatrix<STATES, STATES, T> errorCovPre; // P'(k) = A*P(k-1)*At + Q
+	FixedMatrix<STATES, MEASUREMENTS, T> gain; // K(k) = P'(k)*Ht*inv(H*P'(k)*Ht + R)
+	FixedMatrix<STATES, STATES, T> errorCovPost; // P(k) = P'(k) - K(k)*H*P'(k)
+
+	FixedKalmanFilter() {
+		init();
+	}
+
+	// Resets every matrix to its initial value (as cv::KalmanFilter::init does)
+	void init() {
+		statePre = State::zeros();
+		statePost = State::zeros();
+		transitionMatrix = transitionMatrix.identity();
+		measurementMatrix = measurementMatrix.zeros();
+		processNoiseCov = processNoiseCov.identity();
+		measurementNoiseCov = measurementNoiseCov.identity();
+		errorCovPre = errorCovPre.zeros();
+		gain = gain.zeros();
+		errorCovPost = errorCovPost.zeros();
+	}
+
+	// Computes the predicted state, which is also taken as the corrected state until correct is called
+	const State &predict() {
+		statePre = transitionMatrix * statePost;
+		errorCovPre = multiplyAdd(transitionMatrix * errorCovPost, transitionMatrix.t(), processNoiseCov);
+
+		statePost = statePre;
+		errorCovPost = errorCovPre;
+		return statePre;
+	}
+
+	// Updates the predicted state with the given measurement
+	const State &correct(const Measurement &measurement) {
+		FixedMatrix<MEASUREMENTS, STATES, T> measuredErrorCov = measurementMatrix * errorCovPre; // H*P'(k)
+		FixedMatrix<MEASUREMENTS, MEASUREMENTS, T> innovationCov = multiplyAdd(measuredErrorCov, measurementMatrix.t(), measurementNoiseCov);
+
+		// K(k) = (inv(S)*H*P'(k))t, as S and P'(k) are symmetric
+		gain = solve(innovationCov, measuredErrorCov).t();
+
+		statePost = multiplyAdd(gain, multiplyAdd(measurementMatrix, statePre, measurement, -1), statePre);
+		errorCovPost = multiplyAdd(gain, measuredErrorCov, errorCovPre, -1);
+		return statePost;
+	}
+};
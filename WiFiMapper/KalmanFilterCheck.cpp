@@ -0,0 +1,208 @@
+/*
+ * A program which checks that FixedKalmanFilter tracks identically to cv::KalmanFilter,
+ * by running both side by side (each set up by MarkerTracker's own filter set-up) over
+ * reproducible marker trajectories with missed detections and resets.
+ *
+ * Written by Marc Katzef
+ */
+
+#include "Portability.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "opencv2/video/tracking.hpp"
+
+#include "KalmanFilter.h"
+#include "MarkerTracker.h"
+
+using namespace std;
+
+typedef FixedKalmanFilter<6, 4> MarkerFilter;
+
+// The largest accepted difference between the filters' positions and radii (px)
+static const double cTolerance_px = 1e-4;
+
+// The marker is detected in this proportion of frames, and is reset after this many consecutive misses
+static const double cDetectionRate = 0.92;
+static const int cMaxMisses = 5;
+
+// The marker is also hidden (eg: behind the person scanning) for this many frames in every interval
+static const size_t cOcclusionInterval = 400;
+static const size_t cOcclusionLength = 12;
+
+// The number of detections taken to initialise the marker before it is tracked
+static const int cInitFrames = 5;
+
+
+// Prints command line usage
+void printUsage(const char *programName) {
+	cerr << "Usage: " << programName << " [options]\n"
+		"Options:\n"
+		"  --frames <count>      the length of each trajectory (default 3000)\n"
+		"  --trajectories <count> the number of trajectories, each with its own seed (default 3)\n";
+}
+
+
+// Lets MarkerTracker's filter set-up be applied to OpenCV's filter
+template <>
+struct KalmanFilterAccess<cv::KalmanFilter> {
+	static void reset(cv::KalmanFilter &filter) {
+		filter.init(6, 4, 0, CV_32F);
+	}
+
+	static float &at(cv::Mat &matrix, int row, int col) {
+		return matrix.at<float>(row, col);
+	}
+};
+
+
+// Sets up both filters (as MarkerTracker does) at the given detection
+void initFilters(MarkerFilter &fixed, cv::KalmanFilter &reference, float x, float y, float radius) {
+	initMarkerFilter(fixed, { { x, y }, radius });
+	initMarkerFilter(reference, { { x, y }, radius });
+}
+
+
+// Advances both filters by the given time (as MarkerTracker::predictFilter does)
+void predictFilters(MarkerFilter &fixed, cv::KalmanFilter &reference, double timeDiff) {
+	setMarkerFilterTimeStep(fixed, timeDiff);
+	fixed.predict();
+
+	setMarkerFilterTimeStep(reference, timeDiff);
+	reference.predict();
+}
+
+
+void correctFilters(MarkerFilter &fixed, cv::KalmanFilter &reference, float x, float y, float radius) {
+	MarkerFilter::Measurement measurement;
+	measurement[0] = x;
+	measurement[1] = y;
+	measurement[2] = radius;
+	measurement[3] = 0;
+	fixed.correct(measurement);
+
+	cv::Mat referenceMeasurement = cv::Mat::zeros(4, 1, CV_32F);
+	referenceMeasurement.at<float>(0) = x;
+	referenceMeasurement.at<float>(1) = y;
+	referenceMeasurement.at<float>(2) = radius;
+	reference.correct(referenceMeasurement);
+}
+
+
+// The largest difference between the filters' corrected positions and radii (the state MarkerTracker uses)
+double stateDifference(const MarkerFilter &fixed, const cv::KalmanFilter &reference) {
+	double difference = 0;
+	for (int i : { 0, 1, 4 }) {
+		difference = max(difference, (double)abs(fixed.statePost[i] - reference.statePost.at<float>(i)));
+	}
+	return difference;
+}
+
+
+// Runs both filters over a marker swept along a Lissajous path (with detection noise, jittered frame times,
+// missed detections and occlusions), initialising and resetting them as MarkerTracker does. Returns the largest difference.
+double checkTrajectory(size_t frameCount, unsigned seed, size_t &updateCount, size_t &resetCount) {
+	mt19937 random(seed);
+	uniform_real_distribution<double> jitter(-0.004, 0.004);
+	uniform_real_distribution<double> detection(0, 1);
+	normal_distribution<double> positionNoise(0, 0.7);
+	normal_distribution<double> radiusNoise(0, 0.5);
+
+	MarkerFilter fixed;
+	cv::KalmanFilter reference;
+
+	bool tracking = false;
+	int initCount = 0;
+	int missCount = 0;
+	double time = 0;
+	double worst = 0;
+
+	for (size_t frame = 0; frame < frameCount; frame++) {
+		double timeDiff = 1 / 30.0 + jitter(random);
+		time += timeDiff;
+
+		float x = (float)(256 + 150 * sin(time * 0.7) + positionNoise(random));
+		float y = (float)(212 + 100 * sin(time * 1.1) + positionNoise(random));
+		float radius = (float)(20 + 5 * sin(time * 0.3) + radiusNoise(random));
+		bool occluded = frame % cOcclusionInterval >= cOcclusionInterval - cOcclusionLength;
+		bool found = detection(random) < cDetectionRate && !occluded;
+
+		if (tracking) {
+			predictFilters(fixed, reference, timeDiff);
+			updateCount++;
+		}
+
+		if (!found) {
+			if (!tracking) {
+				initCount = 0;
+			} else if (++missCount >= cMaxMisses) {
+				tracking = false;
+				initCount = 0;
+				resetCount++;
+			}
+		} else if (!tracking) {
+			if (initCount == 0) {
+				initFilters(fixed, reference, x, y, radius);
+			} else {
+				predictFilters(fixed, reference, timeDiff);
+				correctFilters(fixed, reference, x, y, radius);
+				updateCount++;
+			}
+
+			if (++initCount >= cInitFrames) {
+				tracking = true;
+				missCount = 0;
+			}
+		} else {
+			missCount = 0;
+			correctFilters(fixed, reference, x, y, radius);
+		}
+
+		worst = max(worst, stateDifference(fixed, reference));
+	}
+
+	return worst;
+}
+
+
+int main(int argc, char **argv) {
+	size_t frameCount = 3000;
+	unsigned trajectoryCount = 3;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--frames" && hasValue) {
+			frameCount = strtoul(argv[++i], NULL, 10);
+		} else if (arg == "--trajectories" && hasValue) {
+			trajectoryCount = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	bool passed = true;
+	for (unsigned seed = 1; seed <= trajectoryCount; seed++) {
+		size_t updateCount = 0;
+		size_t resetCount = 0;
+		double difference = checkTrajectory(frameCount, seed, updateCount, resetCount);
+		bool trajectoryPassed = difference <= cTolerance_px;
+		passed = passed && trajectoryPassed;
+
+		cout << "Trajectory " << seed << ": " << updateCount << " predictions, " << resetCount << " resets, largest difference "
+			<< difference << " px" << (trajectoryPassed ? "\n" : " (FAILED)\n");
+	}
+
+	if (!passed) {
+		cerr << "FixedKalmanFilter differs from cv::KalmanFilter by more than " << cTolerance_px << " px\n";
+		return 2;
+	}
+
+	return 0;
+}
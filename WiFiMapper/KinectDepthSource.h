@@ -0,0 +1,78 @@
+/*
+ * The DepthSource which supplies frames from the Kinect Sensor v2 (Windows only).
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "stdafx.h"
+#include <strsafe.h>
+
+#include "DepthSource.h"
+
+
+// Supplies the latest frames from an open depth frame reader (which must outlive this object)
+class KinectDepthSource : public DepthSource {
+public:
+	KinectDepthSource(IDepthFrameReader *pDepthFrameReader) : m_pDepthFrameReader(pDepthFrameReader) { }
+
+	~KinectDepthSource() {
+		SafeRelease(m_pDepthFrame);
+	}
+
+	bool acquireFrame(DepthFrame &frame) override {
+		if (!m_pDepthFrameReader) {
+			return false;
+		}
+
+		// The sensor only delivers new frames once the previous one has been released
+		SafeRelease(m_pDepthFrame);
+
+		HRESULT hr = m_pDepthFrameReader->AcquireLatestFrame(&m_pDepthFrame);
+
+		UINT nBufferSize = 0;
+		UINT16 *pBuffer = NULL;
+		TIMESPAN relativeTime = 0;
+		IFrameDescription *pFrameDescription = NULL;
+		int width = 0;
+		int height = 0;
+
+		if (SUCCEEDED(hr)) {
+			hr = m_pDepthFrame->get_RelativeTime(&relativeTime);
+		}
+
+		if (SUCCEEDED(hr)) {
+			hr = m_pDepthFrame->get_FrameDescription(&pFrameDescription);
+		}
+
+		if (SUCCEEDED(hr)) {
+			hr = pFrameDescription->get_Width(&width);
+		}
+
+		if (SUCCEEDED(hr)) {
+			hr = pFrameDescription->get_Height(&height);
+		}
+
+		if (SUCCEEDED(hr)) {
+			hr = m_pDepthFrame->AccessUnderlyingBuffer(&nBufferSize, &pBuffer);
+		}
+
+		SafeRelease(pFrameDescription);
+
+		if (FAILED(hr)) {
+			SafeRelease(m_pDepthFrame);
+			return false;
+		}
+
+		frame.data = pBuffer;
+		frame.width = width;
+		frame.height = height;
+		frame.timestamp = relativeTime;
+		return true;
+	}
+
+private:
+	IDepthFrameReader *m_pDepthFrameReader;
+	IDepthFrame *m_pDepthFrame = NULL;
+};
@@ -0,0 +1,168 @@
+/*
+ * The module responsible for compressing a stream of bytes in the LZF format (as used by
+ * binary_compressed PCD files), while holding only a small window of it in memory.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <vector>
+
+
+// Compresses the bytes given to write (in any number of calls) into a single LZF block, written to the given
+// stream as it is formed. The block is complete once finish has been called, and may be decompressed by any
+// LZF decoder (eg: liblzf's lzf_decompress) into the concatenation of the bytes written.
+class LzfCompressor {
+public:
+	explicit LzfCompressor(std::ostream &out) : m_out(out), m_hashTable(cHashSize, 0) {
+		m_output.reserve(cFlushSize + 2 * cMaxLiterals);
+	}
+
+	void write(const void *data, size_t size) {
+		const uint8_t *bytes = static_cast<const uint8_t*>(data);
+		m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+		m_uncompressedSize += size;
+
+		// Compress all but the last (longest match's) bytes, which may be part of a match with the bytes still to come
+		if (m_buffer.size() - m_position >= cCompressSize + cMaxMatch) {
+			compress(m_buffer.size() - cMaxMatch);
+		}
+	}
+
+	// Compresses the remaining bytes, and writes the rest of the block
+	void finish() {
+		compress(m_buffer.size());
+		flushLiterals();
+		flushOutput();
+	}
+
+	uint64_t uncompressedSize() const {
+		return m_uncompressedSize;
+	}
+
+	uint64_t compressedSize() const {
+		return m_compressedSize;
+	}
+
+private:
+	static const size_t cMaxOffset = 1 << 13; // (back references are 13-bit distances, minus one)
+	static const size_t cMinMatch = 3;
+	static const size_t cMaxMatch = 2 + 7 + 255; // (the length is stored less two, in 3 bits and an optional byte)
+	static const size_t cMaxLiterals = 32;
+	static const size_t cHashBits = 14;
+	static const size_t cHashSize = 1 << cHashBits;
+	static const size_t cCompressSize = 1 << 16; // the number of bytes buffered between calls to compress
+	static const size_t cFlushSize = 1 << 16; // the number of output bytes buffered between writes to the stream
+
+	std::ostream &m_out;
+	uint64_t m_uncompressedSize = 0;
+	uint64_t m_compressedSize = 0;
+
+	// The bytes still to be compressed, after the window of history which matches may refer to
+	std::vector<uint8_t> m_buffer;
+	size_t m_position = 0; // the next byte of m_buffer to compress
+	uint64_t m_bufferStart = 0; // the position of m_buffer[0] in the whole stream
+
+	// The position in the whole stream (plus one) of the latest occurrence of each hash of three bytes
+	std::vector<uint64_t> m_hashTable;
+
+	uint8_t m_literals[cMaxLiterals];
+	size_t m_literalCount = 0;
+	std::vector<uint8_t> m_output;
+
+	static size_t hash(const uint8_t *bytes) {
+		uint32_t value = ((uint32_t)bytes[0] << 16) | ((uint32_t)bytes[1] << 8) | bytes[2];
+		return (value * 2654435761u) >> (32 - cHashBits);
+	}
+
+	// Compresses the buffered bytes before end (which no match may extend beyond)
+	void compress(size_t end) {
+		const uint8_t *bytes = m_buffer.data();
+
+		while (m_position < end) {
+			size_t matchLength = 0;
+			size_t offset = 0;
+
+			if (m_position + cMinMatch <= end) {
+				uint64_t &entry = m_hashTable[hash(bytes + m_position)];
+				uint64_t position = m_bufferStart + m_position;
+				uint64_t reference = entry;
+				entry = position + 1;
+
+				if (reference > m_bufferStart && position - (reference - 1) <= cMaxOffset) {
+					size_t candidate = (size_t)(reference - 1 - m_bufferStart);
+					size_t maxLength = end - m_position < cMaxMatch ? end - m_position : cMaxMatch;
+					while (matchLength < maxLength && bytes[candidate + matchLength] == bytes[m_position + matchLength]) {
+						matchLength++;
+					}
+					offset = m_position - candidate;
+				}
+			}
+
+			if (matchLength < cMinMatch) {
+				m_literals[m_literalCount++] = bytes[m_position++];
+				if (m_literalCount == cMaxLiterals) {
+					flushLiterals();
+				}
+				continue;
+			}
+
+			flushLiterals();
+
+			// (control byte: 3 bits of length and the top 5 bits of the offset, less one)
+			size_t length = matchLength - 2;
+			size_t distance = offset - 1;
+			if (length < 7) {
+				m_output.push_back((uint8_t)((length << 5) | (distance >> 8)));
+			} else {
+				m_output.push_back((uint8_t)((7 << 5) | (distance >> 8)));
+				m_output.push_back((uint8_t)(length - 7));
+			}
+			m_output.push_back((uint8_t)(distance & 0xFF));
+
+			// The bytes within the match are also hashed, so that later matches can refer to them
+			for (size_t i = m_position + 1; i < m_position + matchLength && i + cMinMatch <= end; i++) {
+				m_hashTable[hash(bytes + i)] = m_bufferStart + i + 1;
+			}
+			m_position += matchLength;
+
+			if (m_output.size() >= cFlushSize) {
+				flushOutput();
+			}
+		}
+
+		// Keep only the window of history which later matches may refer to
+		if (m_position > cMaxOffset) {
+			size_t discard = m_position - cMaxOffset;
+			m_buffer.erase(m_buffer.begin(), m_buffer.begin() + discard);
+			m_bufferStart += discard;
+			m_position -= discard;
+		}
+	}
+
+	// (control byte: the number of literals, less one)
+	void flushLiterals() {
+		if (m_literalCount == 0) {
+			return;
+		}
+
+		m_output.push_back((uint8_t)(m_literalCount - 1));
+		m_output.insert(m_output.end(), m_literals, m_literals + m_literalCount);
+		m_literalCount = 0;
+
+		if (m_output.size() >= cFlushSize) {
+			flushOutput();
+		}
+	}
+
+	void flushOutput() {
+		m_out.write(reinterpret_cast<const char*>(m_output.data()), m_output.size());
+		m_compressedSize += m_output.size();
+		m_output.clear();
+	}
+};
@@ -7,20 +7,94 @@
 
 #pragma once
 
-#include "stdafx.h"
-#include <strsafe.h>
+#include "Portability.h"
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 
 #include "opencv2/imgcodecs.hpp"
 #include "opencv2/highgui.hpp"
 #include "opencv2/imgproc.hpp"
-#include "opencv2/video/tracking.hpp"
+
+#include "DepthBlobs.h"
+#include "DepthMask.h"
+#include "DepthProjection.h"
+#include "DepthPyramid.h"
+#include "KalmanFilter.h"
 
 #define PI 3.14159265358979
 
 
+// How the marker filter set-up below resets a Kalman filter and reaches the elements of its matrices. Specialised
+// for each filter type it is applied to (eg: cv::KalmanFilter, when checking FixedKalmanFilter against it).
+template <typename Filter>
+struct KalmanFilterAccess;
+
+template <int STATES, int MEASUREMENTS>
+struct KalmanFilterAccess<FixedKalmanFilter<STATES, MEASUREMENTS>> {
+	static void reset(FixedKalmanFilter<STATES, MEASUREMENTS> &filter) {
+		filter.init();
+	}
+
+	template <typename Matrix>
+	static float &at(Matrix &matrix, int row, int col) {
+		return matrix(row, col);
+	}
+};
+
+
+// Sets the initial values of a marker's Kalman filter, from its first detection (position and radius, in pixels).
+// State: x, y (px), their velocities, radius (px), and its velocity. Measurement: x, y, radius, and 0.
+template <typename Filter, typename Access = KalmanFilterAccess<Filter>>
+void initMarkerFilter(Filter &filter, std::pair<cv::Point2f, float> firstDescription) {
+	Access::reset(filter);
+
+	Access::at(filter.measurementMatrix, 0, 0) = 1.0f;
+	Access::at(filter.measurementMatrix, 1, 1) = 1.0f;
+	Access::at(filter.measurementMatrix, 2, 4) = 1.0f;
+	Access::at(filter.measurementMatrix, 3, 5) = 1.0f;
+
+	Access::at(filter.processNoiseCov, 0, 0) = 0.01f;
+	Access::at(filter.processNoiseCov, 1, 1) = 0.01f;
+	Access::at(filter.processNoiseCov, 2, 2) = 3.0f;
+	Access::at(filter.processNoiseCov, 3, 3) = 3.0f;
+	Access::at(filter.processNoiseCov, 4, 4) = 0.01f;
+	Access::at(filter.processNoiseCov, 5, 5) = 3.0f;
+
+	// (the reset leaves the measurement noise an identity matrix)
+	for (int i = 0; i < 4; i++) {
+		Access::at(filter.measurementNoiseCov, i, i) = 1e-1f;
+	}
+
+	Access::at(filter.errorCovPre, 0, 0) = 1; // px
+	Access::at(filter.errorCovPre, 1, 1) = 1; // px
+	Access::at(filter.errorCovPre, 2, 2) = 1;
+	Access::at(filter.errorCovPre, 3, 3) = 1;
+	Access::at(filter.errorCovPre, 4, 4) = 1; // px
+	Access::at(filter.errorCovPre, 5, 5) = 1; // px
+
+	Access::at(filter.statePost, 0, 0) = firstDescription.first.x;
+	Access::at(filter.statePost, 1, 0) = firstDescription.first.y;
+	Access::at(filter.statePost, 2, 0) = 0;
+	Access::at(filter.statePost, 3, 0) = 0;
+	Access::at(filter.statePost, 4, 0) = firstDescription.second;
+	Access::at(filter.statePost, 5, 0) = 0;
+}
+
+
+// Sets the time (in seconds) by which a marker's Kalman filter is advanced by its next prediction
+template <typename Filter, typename Access = KalmanFilterAccess<Filter>>
+void setMarkerFilterTimeStep(Filter &filter, double timeDiff) {
+	Access::at(filter.transitionMatrix, 0, 2) = (float)timeDiff;
+	Access::at(filter.transitionMatrix, 1, 3) = (float)timeDiff;
+	// (deliberately (5, 0), which couples x into the radius velocity, as the flat index 30 of the original filter did)
+	Access::at(filter.transitionMatrix, 5, 0) = (float)timeDiff;
+}
+
+
 // Calculates the height (in pixels) of an object in a frame
-double getObjectHeight_px(double verticalFov_rad, double objectHeight_mm, double distance_mm, uint imageHeight_px) {
+inline double getObjectHeight_px(double verticalFov_rad, double objectHeight_mm, double distance_mm, uint imageHeight_px) {
 	double imageHeight_mm = 2 * distance_mm * std::tan(verticalFov_rad / 2);
 	double imageProportion = objectHeight_mm / imageHeight_mm;
 
@@ -29,7 +103,7 @@ double getObjectHeight_px(double verticalFov_rad, double objectHeight_mm, double
 
 // Returns a rectangle centred around the given point, with the given dimensions
 // The rectangle is cropped not to exceed the given limits.
-cv::Rect getCenteredRect(const cv::Point center, uint width, uint height, int minX = -1, int maxX = -1, int minY = -1, int maxY = -1) {
+inline cv::Rect getCenteredRect(const cv::Point center, uint width, uint height, int minX = -1, int maxX = -1, int minY = -1, int maxY = -1) {
 	cv::Point bottomLeft = center - cv::Point{ (int)(width / 2), (int)(height / 2) };
 	cv::Point topRight = bottomLeft + cv::Point{ (int)width, (int)height };
 
@@ -56,7 +130,7 @@ cv::Rect getCenteredRect(const cv::Point center, uint width, uint height, int mi
 
 
 // Returns the mean of the values in the given single-channel matrix
-float getMatMean(const cv::Mat img) {
+inline float getMatMean(const cv::Mat img) {
 	double total = 0;
 	int rowCount = img.rows;
 	int colCount = img.cols;
@@ -75,33 +149,77 @@ float getMatMean(const cv::Mat img) {
 }
 
 
-// Returns the median of the values in the given single-channel matrix
-float getMatMedian(const cv::Mat img) {
-	double total = 0;
+// Scratch space for finding the median of 16-bit values (a histogram of one byte of each value)
+struct DepthHistogram {
+	uint32_t counts[256];
+};
+
+
+// Returns the median of the non-zero (valid) values in the given UINT16 matrix, or 0 if there are none.
+// The values are counted by their high byte, then by their low byte within the bucket containing the median.
+inline float getMatMedian(const cv::Mat &img, DepthHistogram &histogram) {
 	int rowCount = img.rows;
 	int colCount = img.cols;
 
-	if (rowCount == -1 || colCount == -1) {
+	std::fill(histogram.counts, histogram.counts + 256, 0);
+	uint32_t zeroCount = 0;
+	for (int y = 0; y < rowCount; y++) {
+		const UINT16 *row = img.ptr<UINT16>(y);
+		for (int x = 0; x < colCount; x++) {
+			histogram.counts[row[x] >> 8]++;
+			zeroCount += row[x] == 0;
+		}
+	}
+
+	// Exclude zeros (invalid depth readings)
+	histogram.counts[0] -= zeroCount;
+	uint32_t validCount = (uint32_t)(rowCount * colCount) - zeroCount;
+
+	if (validCount == 0) {
 		return 0;
 	}
 
-	std::vector<UINT16> data(rowCount * colCount);
-	for (size_t y = 0; y < rowCount; y++) {
-		for (size_t x = 0; x < colCount; x++) {
-			int index = y * colCount + x;
-			data[index] = img.at<UINT16>(index);
+	// The index of the median among the sorted valid values (the upper median if there are two)
+	uint32_t rank = validCount / 2;
+	int highByte = 0;
+	while (rank >= histogram.counts[highByte]) {
+		rank -= histogram.counts[highByte];
+		highByte++;
+	}
+
+	std::fill(histogram.counts, histogram.counts + 256, 0);
+	for (int y = 0; y < rowCount; y++) {
+		const UINT16 *row = img.ptr<UINT16>(y);
+		for (int x = 0; x < colCount; x++) {
+			if ((row[x] >> 8) == highByte && row[x] != 0) {
+				histogram.counts[row[x] & 0xFF]++;
+			}
 		}
 	}
 
-	std::sort(data.begin(), data.end());
+	int lowByte = 0;
+	while (rank >= histogram.counts[lowByte]) {
+		rank -= histogram.counts[lowByte];
+		lowByte++;
+	}
+
+	return (float)((highByte << 8) | lowByte);
+}
+
 
-	return data[data.size() / 2];
+// Returns the median of the non-zero (valid) values in the given UINT16 matrix, or 0 if there are none
+inline float getMatMedian(const cv::Mat &img) {
+	DepthHistogram histogram;
+	return getMatMedian(img, histogram);
 }
 
 
-// A comparison functor for two contours based on their size
-bool contourPredicate(std::vector<cv::Point> i, std::vector<cv::Point> j) {
-	return i.size() > j.size();
+// Returns the area of the intersection of the given rectangles over the area of their union
+inline float getRectOverlap(const cv::Rect &a, const cv::Rect &b) {
+	int intersection = (a & b).area();
+	int unionArea = a.area() + b.area() - intersection;
+
+	return unionArea > 0 ? (float)intersection / unionArea : 0;
 }
 
 
@@ -112,14 +230,19 @@ struct SearchDescription {
 	float minRadius;
 	float maxRadius;
 	cv::Point2f origin;
+	uint originTolerance; // the side of the square (centred on the origin) in which the marker's centre must be found
+	uint searchSize; // the side of the square region of the image which is searched
 };
 
 
 // An object responsible for tracking a single spherical marker
 class MarkerTracker {
 public:
-	enum class STATES { INITIALIZING, TRACKING };
+	enum class STATES { INITIALIZING, TRACKING, REACQUIRING };
 	enum class RET_TYPE { EMPTY, INITIALIZING, TRACKING, TRACKING_EMPTY };
+
+	// The pyramid level (with cells of 2^level pixels) searched for the marker after losing it
+	static const int cReacquisitionLevel = 2;
 	
 	// Indicators of current state (for debugging and visualisation)
 	cv::Mat deb_mask;
@@ -141,19 +264,58 @@ public:
 		m_initOrigin = initOrigin;
 	}
 
+	// Prevents the marker being reacquired within twice the given radius of the given position (both in
+	// pixels) in the next update, eg: where another marker is being tracked (may be called for several regions)
+	void excludeRegion(cv::Point2f center_px, float radius_px) {
+		m_excludedRegions.push_back({ center_px, radius_px });
+	}
+
+	// Requires the marker found in the next update to be between the given distances (mm) from the given camera space
+	// position (eg: the other end of a rigid bar), placing it in camera space with the given projection. This is ignored
+	// while waiting for the marker at its initial position, where it is placed by hand.
+	void constrainDistance(const DepthProjection *projection, cv::Point3f anchor_mm, float minDistance_mm, float maxDistance_mm) {
+		m_shellProjection = projection;
+		m_shellAnchor = anchor_mm;
+		m_shellMinDistance_mm = minDistance_mm;
+		m_shellMaxDistance_mm = maxDistance_mm;
+	}
+
+	// The position (x and y in pixels) and radius of the marker being tracked, or a radius of -1 if it is not being tracked
+	std::pair<cv::Point2f, float> markerEstimate() const {
+		if (m_state != STATES::TRACKING) {
+			return { { -1, -1 }, -1 };
+		}
+
+		return { { m_filter.statePost[0], m_filter.statePost[1] }, m_filter.statePost[4] };
+	}
+
+	// True if the marker has been lost, and the next update will search the whole frame for it
+	bool isReacquiring() const {
+		return m_state == STATES::REACQUIRING;
+	}
+
 	// Uses the given depth frame and the time since the previous was given to approximate marker position.
 	// Returns a status code and a point containing x and y (in pixels) and the depth of the identified marker.
-	std::pair<RET_TYPE, cv::Point3f> update(const cv::Mat &depthFrame, double timeDiff) {
+	// A pyramid of the frame (of at least cReacquisitionLevel levels) may be given, to be shared between trackers.
+	std::pair<RET_TYPE, cv::Point3f> update(const cv::Mat &depthFrame, double timeDiff, const DepthPyramid *pyramid = nullptr) {
 		RET_TYPE resultType = RET_TYPE::EMPTY;
 		cv::Point3f markerPosition;
 
-		// Get search region
-		SearchDescription sd = getSearchDescription(depthFrame, timeDiff);
-		deb_sd = sd;
+		SearchDescription sd;
+		std::pair<cv::Point2f, float> ball;
+		if (m_state == STATES::REACQUIRING) {
+			ball = reacquire(depthFrame, pyramid, sd);
+		} else {
+			// Get search region
+			sd = getSearchDescription(depthFrame, timeDiff);
 
-		// Search for ball
-		std::pair<cv::Point2f, float> ball = findBall(depthFrame, sd.minDepth, sd.maxDepth, sd.minRadius, sd.maxRadius, sd.origin, m_originTolerance_px);
+			// Search for ball
+			ball = findBall(depthFrame, sd.minDepth, sd.maxDepth, sd.minRadius, sd.maxRadius, sd.origin, sd.originTolerance, sd.searchSize);
+		}
+		deb_sd = sd;
 		deb_ball = ball;
+		m_excludedRegions.clear();
+		m_shellProjection = nullptr;
 
 		// Update filter
 		processResults(ball, timeDiff);
@@ -165,13 +327,23 @@ public:
 			}
 		} else {
 			switch (m_state) {
+			case STATES::REACQUIRING:
 			case STATES::INITIALIZING: {
 				resultType = RET_TYPE::INITIALIZING;
 				break;
 			}
 			case STATES::TRACKING: {
 				resultType = RET_TYPE::TRACKING;
-				float depth = (int)getMatMedian(depthFrame(getCenteredRect({ (int)ball.first.x, (int)ball.first.y }, std::max((int)(ball.second / 2), 1), std::max((int)(ball.second / 2), 1), 0, depthFrame.cols, 0, depthFrame.rows)));
+				cv::Rect depthRect = getCenteredRect({ (int)ball.first.x, (int)ball.first.y }, std::max((int)(ball.second / 2), 1), std::max((int)(ball.second / 2), 1), 0, depthFrame.cols, 0, depthFrame.rows);
+
+				// The marker is usually found (almost) where it was predicted, in which case the depth is already known
+				float depth;
+				if (m_predictionDepthValid && getRectOverlap(depthRect, m_predictionRect) >= cMedianReuseOverlap) {
+					depth = m_predictionDepth;
+				} else {
+					depth = (int)getMatMedian(depthFrame(depthRect), m_histogram);
+				}
+
 				markerPosition = cv::Point3f(ball.first.x, ball.first.y, depth);
 				break;
 			}
@@ -183,75 +355,88 @@ public:
 
 
 private:
+	friend struct MarkerTrackerBenchmarks; // (which measures the search functions directly)
+
 	uint m_depthImageWidth;
 	uint m_depthImageHeight;
 	uint m_initDepth_mm;
 	uint m_radius_mm;
 	float m_radiusTolerance;
-	uint m_originTolerance_px;
+	uint m_originTolerance_px; // while initializing (see getSearchDescription for tracking)
 	double m_vfov_rad;
 	cv::Point2f m_initOrigin;
 
 	STATES m_state = STATES::INITIALIZING;
-	cv::KalmanFilter m_filter;
-	uint m_stateCount = 6;
-	uint m_measurementCount = 4;
-	cv::Mat m_markerState;
-	cv::Mat m_markerMeasurement;
+
+	// While initializing after reacquisition, the search follows the marker (rather than waiting at m_initOrigin)
+	bool m_reacquired = false;
+	cv::Point2f m_searchOrigin; // the last known position of the marker (px)
+	float m_searchRadius_px = 0;
+	std::vector<std::pair<cv::Point2f, float>> m_excludedRegions; // (centre, radius) in pixels
+	DepthPyramid m_pyramid;
+	// The shell (around m_shellAnchor) in which the marker must be found in the next update, if m_shellProjection is set
+	const DepthProjection *m_shellProjection = nullptr;
+	cv::Point3f m_shellAnchor;
+	float m_shellMinDistance_mm = 0;
+	float m_shellMaxDistance_mm = 0;
+	std::vector<SphereCandidate> m_candidates;
+	// (set up by initMarkerFilter, which describes its state and measurement)
+	typedef FixedKalmanFilter<6, 4> MarkerFilter;
+	MarkerFilter m_filter;
+	float m_innovationScale = 1; // the recent mean of the squared position errors of predictions, relative to their variance
 	uint m_initCounter = 0;
 	uint m_missCounter = 0;
 
+	// Median scratch space, and the median depth of the predicted marker region in the current frame
+	DepthHistogram m_histogram;
+	cv::Rect m_predictionRect;
+	float m_predictionDepth = 0;
+	bool m_predictionDepthValid = false;
+
+	// The search region's mask and its connected regions, and the scratch space used to form them
+	cv::Mat m_mask;
+	DepthMaskScratch m_maskScratch;
+	BlobLabeller m_blobLabeller;
+	std::vector<DepthBlob> m_blobs;
+
+	// The fraction of its enclosing circle which a region must cover to be considered (a half-hidden marker covers 0.5)
+	const float cMinBlobCircularity = 0.4f;
+
+	// The number of candidates checked for the marker in each frame after losing it
+	const size_t cMaxReacquisitionCandidates = 4;
+
+	// The region searched while initializing, and the limit of the region searched while tracking
+	const uint cInitSearchSize_px = 100;
+	const uint cMaxSearchSize_px = 200;
+
+	// While tracking, the marker's centre is accepted within cGateDeviations standard deviations of the prediction,
+	// but never less than cMinGateRadii of its predicted radius (px). The search region adds cSearchMargin_px to this.
+	const float cGateDeviations = 3.0f;
+	const float cMinGateRadii = 0.5f;
+	const float cSearchMargin_px = 4.0f;
+	const float cInnovationSmoothing = 0.2f; // the weight of each new prediction error in m_innovationScale
+
+	// The overlap (intersection over union) at which the predicted region's median depth is used as the result's
+	const float cMedianReuseOverlap = 0.9f;
+
 	// Sets the initial values of the Kalman filter used for prediction.
 	void initMarkerKalmanFilter(std::pair<cv::Point2f, float> firstDescription) {
-		m_filter.init(m_stateCount, m_measurementCount, 0, CV_32F);
-		m_markerState = cv::Mat::zeros(m_stateCount, 1, CV_32F);
-		m_markerMeasurement = cv::Mat::zeros(m_measurementCount, 1, CV_32F);
-
-		cv::setIdentity(m_filter.transitionMatrix);
-
-		m_filter.measurementMatrix = cv::Mat::zeros(m_measurementCount, m_stateCount, CV_32F);
-		m_filter.measurementMatrix.at<float>(0) = 1.0f;
-		m_filter.measurementMatrix.at<float>(7) = 1.0f;
-		m_filter.measurementMatrix.at<float>(16) = 1.0f;
-		m_filter.measurementMatrix.at<float>(23) = 1.0f;
-
-		m_filter.processNoiseCov.at<float>(0) = 0.01f;
-		m_filter.processNoiseCov.at<float>(7) = 0.01f;
-		m_filter.processNoiseCov.at<float>(14) = 3.0f;
-		m_filter.processNoiseCov.at<float>(21) = 3.0f;
-		m_filter.processNoiseCov.at<float>(28) = 0.01f;
-		m_filter.processNoiseCov.at<float>(35) = 3.0f;
-
-		cv::setIdentity(m_filter.measurementNoiseCov, cv::Scalar(1e-1));
-
-		m_filter.errorCovPre.at<float>(0) = 1; // px
-		m_filter.errorCovPre.at<float>(7) = 1; // px
-		m_filter.errorCovPre.at<float>(14) = 1;
-		m_filter.errorCovPre.at<float>(21) = 1;
-		m_filter.errorCovPre.at<float>(28) = 1; // px
-		m_filter.errorCovPre.at<float>(35) = 1; // px
-
-		m_markerState.at<float>(0) = firstDescription.first.x;
-		m_markerState.at<float>(1) = firstDescription.first.y;
-		m_markerState.at<float>(2) = 0;
-		m_markerState.at<float>(3) = 0;
-		m_markerState.at<float>(4) = firstDescription.second;
-		m_markerState.at<float>(5) = 0;
-
-		m_filter.statePost = m_markerState;
+		initMarkerFilter(m_filter, firstDescription);
+		m_innovationScale = 1;
 	}
 
 	// Searches for a circle in the given single-channel frame.
 	// The found circle must:
-	//   - have an origin within the bounding box specified by bottomLeft and topRight (both in pixels).
+	//   - have an origin within the square of side originTolerance centred on origin (both in pixels).
 	//   - have a radius in [minRadius, maxRadius] 
+	//   - be round (see cMinBlobCircularity)
 	// Returns the position (x and y in pixels) of the centre of the marker in the depth image, and the identified marker's radius
-	std::pair<cv::Point2f, float> findBall(const cv::Mat &img, UINT16 minDepth_mm, UINT16 maxDepth_mm, float minRadius_px, float maxRadius_px, cv::Point2f origin_px, uint originTolerance_px) {
+	std::pair<cv::Point2f, float> findBall(const cv::Mat &img, UINT16 minDepth_mm, UINT16 maxDepth_mm, float minRadius_px, float maxRadius_px, cv::Point2f origin_px, uint originTolerance_px, uint searchSize_px) {
 		std::pair<cv::Point2f, float> invalidRet{ { -1, -1 }, -1 };
 
 		// Get subsection of the given frame which has to contain the ball + padding to avoid false positives
-		int searchWidth = 100;
-		int searchHeight = 100;
+		int searchWidth = searchSize_px;
+		int searchHeight = searchSize_px;
 		int rows = img.rows;
 		int cols = img.cols;
 		int originX = (int)(origin_px.x + 0.5);
@@ -265,43 +450,32 @@ private:
 		cv::Rect searchRect = cv::Rect(cv::Point{ minCol, minRow }, cv::Point{ maxCol, maxRow });
 		cv::Mat searchRegion = img(searchRect);
 
-		// Use thresholding to only consider objects in expected depth range
-		cv::Mat mask{ searchRegion.size(), searchRegion.type() };
-		inRange(searchRegion, minDepth_mm, maxDepth_mm, mask);
-
-		// Morphology to reduce noise
-		cv::Mat mask1{ mask.size(), mask.type() };
-		cv::erode(mask, mask1, cv::Mat::ones(3, 3, CV_16UC1), cv::Point(-1, -1), 1);
-		cv::dilate(mask1, mask, cv::Mat::ones(3, 3, CV_16UC1), cv::Point(-1, -1), 1);
+		// Use thresholding to only consider objects in expected depth range, with morphology to reduce noise
+		cv::Mat &mask = m_mask;
+		thresholdAndOpen(searchRegion, minDepth_mm, maxDepth_mm, m_maskScratch, mask);
 		deb_mask = mask;
 
-		// Find a series of points which outline the shapes in the mask.
-		std::vector<std::vector<cv::Point>> contours;
-		std::vector<cv::Vec4i> hierarchy;
-		findContours(mask, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
-
-		if (contours.empty()) {
-			return invalidRet;
-		}
+		// Find the connected regions of the mask
+		m_blobLabeller.label(mask, searchRegion, m_blobs);
 
-		// Consider contours in order of decreasing point count
-		sort(contours.begin(), contours.end(), contourPredicate);
-
-		// Fit a circle to the points of the contour enclosing features which could be the ball.
-		// Record the first one to have a radius and origin in the expected ranges.
+		// Record the largest region which could be the ball: with a radius and origin in the expected ranges, and round
 		std::pair<cv::Point2f, float> result = invalidRet;
-		std::vector<std::vector<cv::Point>> validContours;
+		uint resultArea = 0;
 		cv::Rect originRegion = getCenteredRect(origin_px, originTolerance_px, originTolerance_px);
 
-		for (auto contour = contours.begin(); contour != contours.end(); contour++) {
-			float radius;
-			cv::Point2f center;
-			cv::minEnclosingCircle(*contour, center, radius);
+		for (const DepthBlob &blob : m_blobs) {
+			if (blob.area <= resultArea) {
+				continue;
+			}
+
+			float radius = blob.radius();
+			cv::Point2f center = blob.centroid();
 			cv::Point2f absCenter{ center.x + searchRect.x, center.y + searchRect.y };
 
-			if (originRegion.contains(absCenter) && radius >= minRadius_px && radius <= maxRadius_px) {
+			if (originRegion.contains(absCenter) && radius >= minRadius_px && radius <= maxRadius_px && blob.circularity() >= cMinBlobCircularity
+				&& isInShell(absCenter, blob.meanDepth())) {
 				result = { absCenter, radius };
-				break;
+				resultArea = blob.area;
 			}
 		}
 
@@ -309,37 +483,60 @@ private:
 	}
 
 
+	// Returns true if a marker at the given position (px) and depth (mm) satisfies the distance constraint (if any)
+	bool isInShell(cv::Point2f center_px, float depth_mm) const {
+		if (!m_shellProjection || (m_state == STATES::INITIALIZING && !m_reacquired)) {
+			return true;
+		}
+
+		cv::Point3f offset = m_shellProjection->desc2Pos({ center_px.x, center_px.y, depth_mm }) - m_shellAnchor;
+		float distanceSq = offset.dot(offset);
+		return distanceSq >= m_shellMinDistance_mm * m_shellMinDistance_mm && distanceSq <= m_shellMaxDistance_mm * m_shellMaxDistance_mm;
+	}
+
 	// Use the current state and the given depth image and time since last
 	// frame to estimate the region in which the marker will be found.
 	SearchDescription getSearchDescription(cv::Mat depthData, double timeDiff) {
-		UINT16 minDepth;
-		UINT16 maxDepth;
-		float minRadius;
-		float maxRadius;
+		UINT16 minDepth = 0;
+		UINT16 maxDepth = 0;
+		float minRadius = 0;
+		float maxRadius = 0;
 		cv::Point2f origin;
+		uint originTolerance = 0;
+		uint searchSize = 0;
+
+		m_predictionDepthValid = false;
 
 		switch (m_state) {
+		case STATES::REACQUIRING: // (searched by reacquire instead)
 		case STATES::INITIALIZING: {
+			if (m_reacquired) {
+				float radius_px = std::max(m_searchRadius_px / 2, 1.0f);
+				cv::Rect depthRect = getCenteredRect(m_searchOrigin, (uint)radius_px, (uint)radius_px, 0, depthData.cols, 0, depthData.rows);
+				return getSphereSearch(m_searchOrigin, getMatMedian(depthData(depthRect), m_histogram), m_originTolerance_px, depthData.rows);
+			}
+
 			minDepth = m_initDepth_mm - m_radius_mm;
 			maxDepth = m_initDepth_mm + m_radius_mm;
 			minRadius = getObjectHeight_px(m_vfov_rad, m_radius_mm, maxDepth, depthData.rows) / (1 + m_radiusTolerance);
 			maxRadius = getObjectHeight_px(m_vfov_rad, m_radius_mm, minDepth, depthData.rows) * (1 + m_radiusTolerance);
 			origin = m_initOrigin;
+			originTolerance = m_originTolerance_px;
+			searchSize = cInitSearchSize_px;
 			break;
 		}
 		case STATES::TRACKING: {
-			m_filter.transitionMatrix.at<float>(2) = timeDiff;
-			m_filter.transitionMatrix.at<float>(9) = timeDiff;
-			m_filter.transitionMatrix.at<float>(30) = timeDiff;
-
-			cv::Mat prediction = m_filter.predict();
+			const MarkerFilter::State &prediction = predictFilter(timeDiff);
 
-			float predX = prediction.at<float>(0);
-			float predY = prediction.at<float>(1);
-			float predRad = prediction.at<float>(4);
+			float predX = prediction[0];
+			float predY = prediction[1];
+			float predRad = prediction[4];
 
 			// Get the depth readings for the area which should contain the ball
-			int predictionDepth = (int)getMatMedian(depthData(getCenteredRect({ (int)predX, (int)predY }, std::max((int)predRad / 2, 1), std::max((int)predRad / 2, 1), 0, depthData.cols, 0, depthData.rows)));
+			m_predictionRect = getCenteredRect({ (int)predX, (int)predY }, std::max((int)predRad / 2, 1), std::max((int)predRad / 2, 1), 0, depthData.cols, 0, depthData.rows);
+			int predictionDepth = (int)getMatMedian(depthData(m_predictionRect), m_histogram);
+			m_predictionDepth = (float)predictionDepth;
+			m_predictionDepthValid = true;
 
 			deb_point = cv::Point((int)predX, (int)predY);
 
@@ -349,6 +546,17 @@ private:
 			maxRadius = predRad * (1 + m_radiusTolerance);
 			origin = cv::Point2f(predX, predY);
 
+			// The marker's centre should be within a few standard deviations of the prediction (in each axis), given
+			// the filter's uncertainty (scaled by how well it has matched recent measurements). This is small while
+			// tracking steadily, and grows with each frame in which the marker is not found.
+			float variance_px = std::max(m_filter.errorCovPre(0, 0), m_filter.errorCovPre(1, 1)) + m_filter.measurementNoiseCov(0, 0);
+			float deviation_px = std::sqrt(variance_px * std::max(m_innovationScale, 1.0f));
+			float halfTolerance_px = std::max(cGateDeviations * deviation_px, cMinGateRadii * predRad);
+			originTolerance = (uint)std::min(2 * halfTolerance_px + 1, (float)cMaxSearchSize_px);
+
+			// Search far enough around the tolerance region to contain any marker centred within it
+			searchSize = (uint)std::min(originTolerance + 2 * maxRadius + cSearchMargin_px, (float)cMaxSearchSize_px);
+
 			break;
 		}
 		}
@@ -357,18 +565,101 @@ private:
 			maxDepth,
 			minRadius,
 			maxRadius,
-			origin };
+			origin,
+			originTolerance,
+			searchSize };
 	}
 
 
 	// Adds observations to the Kalman filter
 	void correctFilter(std::pair<cv::Point2f, float> ball) {
-		m_markerMeasurement.at<float>(0) = ball.first.x;
-		m_markerMeasurement.at<float>(1) = ball.first.y;
-		m_markerMeasurement.at<float>(2) = ball.second;
-		m_markerMeasurement.at<float>(3) = 0;
+		// Compare the error in the predicted position with the filter's expectation of it
+		float innovationX = ball.first.x - m_filter.statePre[0];
+		float innovationY = ball.first.y - m_filter.statePre[1];
+		float varianceX = m_filter.errorCovPre(0, 0) + m_filter.measurementNoiseCov(0, 0);
+		float varianceY = m_filter.errorCovPre(1, 1) + m_filter.measurementNoiseCov(1, 1);
+		float normalisedInnovation = (innovationX * innovationX / varianceX + innovationY * innovationY / varianceY) / 2;
+		m_innovationScale += cInnovationSmoothing * (normalisedInnovation - m_innovationScale);
+
+		MarkerFilter::Measurement measurement;
+		measurement[0] = ball.first.x;
+		measurement[1] = ball.first.y;
+		measurement[2] = ball.second;
+		measurement[3] = 0;
+
+		m_filter.correct(measurement);
+	}
+
+	// Advances the Kalman filter by the given time (in seconds), returning the predicted state
+	const MarkerFilter::State &predictFilter(double timeDiff) {
+		setMarkerFilterTimeStep(m_filter, timeDiff);
+		return m_filter.predict();
+	}
 
-		m_filter.correct(m_markerMeasurement);
+	// Describes the search for a marker around the given origin (px), whose nearest point is near the given depth (mm)
+	SearchDescription getSphereSearch(cv::Point2f origin, float depth_mm, uint originTolerance, uint imageHeight_px) {
+		UINT16 minDepth = (UINT16)std::max(depth_mm - m_radius_mm, 1.0f);
+		UINT16 maxDepth = (UINT16)(depth_mm + m_radius_mm);
+		float minRadius = (float)getObjectHeight_px(m_vfov_rad, m_radius_mm, maxDepth, imageHeight_px) / (1 + m_radiusTolerance);
+		float maxRadius = (float)getObjectHeight_px(m_vfov_rad, m_radius_mm, minDepth, imageHeight_px) * (1 + m_radiusTolerance);
+		uint searchSize = (uint)std::min(originTolerance + 2 * maxRadius + cSearchMargin_px, (float)cMaxSearchSize_px);
+
+		return{ minDepth,
+			maxDepth,
+			minRadius,
+			maxRadius,
+			origin,
+			originTolerance,
+			searchSize };
+	}
+
+	// Searches the whole frame for the marker (after losing track of it). The sphere-like objects in a downsampled
+	// copy of the frame are found, then the few nearest to where the marker was last seen are searched for it.
+	// The description of the last search is written to sd. The frame's pyramid is built if not given.
+	std::pair<cv::Point2f, float> reacquire(const cv::Mat &depthFrame, const DepthPyramid *pyramid, SearchDescription &sd) {
+		std::pair<cv::Point2f, float> invalidRet{ { -1, -1 }, -1 };
+		sd = SearchDescription{};
+		sd.origin = m_searchOrigin;
+
+		// (the focal length for which a sphere's radius matches getObjectHeight_px)
+		float focalLength_px = (float)(depthFrame.rows / (2 * std::tan(m_vfov_rad / 2)));
+		if (!pyramid) {
+			m_pyramid.build(depthFrame, cReacquisitionLevel);
+			pyramid = &m_pyramid;
+		}
+		const DepthLevel &level = pyramid->level(cReacquisitionLevel);
+		findSphereCandidates(level, (float)m_radius_mm, focalLength_px, m_candidates);
+
+		// Ignore candidates in the excluded regions, or outside the distance constraint (which usually leaves only a few)
+		auto isExcluded = [&](const SphereCandidate &candidate) {
+			for (const std::pair<cv::Point2f, float> &region : m_excludedRegions) {
+				cv::Point2f offset = candidate.center_px - region.first;
+				if (offset.dot(offset) < 4 * region.second * region.second) {
+					return true;
+				}
+			}
+			return !isInShell(candidate.center_px, candidate.nearest_mm);
+		};
+		m_candidates.erase(std::remove_if(m_candidates.begin(), m_candidates.end(), isExcluded), m_candidates.end());
+
+		std::sort(m_candidates.begin(), m_candidates.end(), [&](const SphereCandidate &a, const SphereCandidate &b) {
+			cv::Point2f offsetA = a.center_px - m_searchOrigin;
+			cv::Point2f offsetB = b.center_px - m_searchOrigin;
+			return offsetA.dot(offsetA) < offsetB.dot(offsetB);
+		});
+
+		for (size_t i = 0; i < m_candidates.size() && i < cMaxReacquisitionCandidates; i++) {
+			const SphereCandidate &candidate = m_candidates[i];
+			uint originTolerance = std::max(m_originTolerance_px, (uint)(2 * level.cellSize));
+			sd = getSphereSearch(candidate.center_px, candidate.nearest_mm, originTolerance, depthFrame.rows);
+
+			std::pair<cv::Point2f, float> ball = findBall(depthFrame, sd.minDepth, sd.maxDepth, sd.minRadius, sd.maxRadius, sd.origin, sd.originTolerance, sd.searchSize);
+			if (ball.second != -1) {
+				return ball;
+			}
+		}
+
+		return invalidRet;
 	}
 
 	// Uses the identified marker position and the time since the previous
@@ -378,6 +669,9 @@ private:
 			switch (m_state) {
 			case STATES::INITIALIZING: {
 				m_initCounter = 0;
+				if (m_reacquired) {
+					m_state = STATES::REACQUIRING;
+				}
 				break;
 			}
 			case STATES::TRACKING: {
@@ -387,34 +681,44 @@ private:
 					//correctFilter({ {prediction.at<float>(0), prediction.at<float>(1)}, prediction.at<float>(4) });
 					//std::cout << "NOT FOUND, GUESSING!\n";
 				} else {
-					//std::cout << "Resetting\n";
-					m_state = STATES::INITIALIZING;
+					// Search the whole frame, starting where the marker was last seen
+					m_state = STATES::REACQUIRING;
+					m_searchOrigin = { m_filter.statePost[0], m_filter.statePost[1] };
 					m_initCounter = 0;
 				}
 				break;
 			}
+			case STATES::REACQUIRING: {
+				break;
+			}
 			}
 
 			return;
 		}
 
+		if (m_state == STATES::REACQUIRING) {
+			m_state = STATES::INITIALIZING;
+			m_reacquired = true;
+			m_initCounter = 0;
+		}
+
 		switch (m_state) {
 		case STATES::INITIALIZING: {
 			if (m_initCounter == 0) {
 				initMarkerKalmanFilter(ball);
 			} else {
-				m_filter.transitionMatrix.at<float>(2) = timeDiff;
-				m_filter.transitionMatrix.at<float>(9) = timeDiff;
-				m_filter.transitionMatrix.at<float>(30) = timeDiff;
-
-				cv::Mat prediction = m_filter.predict();
+				predictFilter(timeDiff);
 				correctFilter(ball);
 			}
 
+			m_searchOrigin = ball.first;
+			m_searchRadius_px = ball.second;
+
 			m_initCounter++;
 			if (m_initCounter >= 5) {
 				m_state = STATES::TRACKING;
 				m_missCounter = 0;
+				m_reacquired = false;
 			}
 			break;
 		}
@@ -424,6 +728,9 @@ private:
 			correctFilter(ball);
 			break;
 		}
+		case STATES::REACQUIRING: {
+			break;
+		}
 		}
 	}
 };
@@ -0,0 +1,271 @@
+/*
+ * Microbenchmarks (using Google Benchmark) of the functions which dominate tracking
+ * and point cloud building, at the sizes they are used with. Run with
+ * --benchmark_out=<file> to save the results as JSON.
+ *
+ * Written by Marc Katzef
+ */
+
+#include "Portability.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "DepthProjection.h"
+#include "DepthSource.h"
+#include "EnvironmentCloud.h"
+#include "MarkerTracker.h"
+#include "PointCloud.h"
+#include "ScannerTracker.h"
+#include "TaskPool.h"
+
+using namespace std;
+
+static const int cDepthWidth = 512;
+static const int cDepthHeight = 424;
+static const int cColorWidth = 1920;
+static const int cColorHeight = 1080;
+static const double cDepthVFov_deg = 60.0;
+
+
+// A depth frame of both markers (at their initialisation positions) in front of a box and a noisy background
+struct BenchmarkFrame {
+	ScannerTrackerConfig config;
+	vector<UINT16> depth;
+	cv::Mat mat;
+	DepthProjection projection;
+
+	BenchmarkFrame() {
+		projection.setPinhole(cDepthWidth, cDepthHeight, cDepthVFov_deg);
+
+		SyntheticMarker markerA;
+		markerA.waypoints = { { 0.0, projection.desc2Pos({ config.initOriginA.x, config.initOriginA.y, (float)config.initDistance_mm }) } };
+		SyntheticMarker markerB;
+		markerB.waypoints = { { 0.0, projection.desc2Pos({ config.initOriginB.x, config.initOriginB.y, (float)config.initDistance_mm }) } };
+
+		SyntheticSensorModel sensor;
+		sensor.depthNoise_mm = 1.5f;
+		sensor.holeFraction = 0.005f;
+		sensor.edgeHoleFraction = 0.3f;
+
+		SyntheticDepthSource source(cDepthWidth, cDepthHeight, cDepthVFov_deg, (float)config.markerRadius_mm, { markerA, markerB }, 1);
+		source.addBox({ { -600, -800, 1800 }, { 0, 200, 2200 } });
+		source.setSensorModel(sensor);
+
+		DepthFrame frame;
+		source.acquireFrame(frame);
+		depth.assign(frame.data, frame.data + cDepthWidth * cDepthHeight);
+		mat = cv::Mat(cDepthHeight, cDepthWidth, CV_16UC1, depth.data());
+	}
+
+	// A square region of the given side, centred on marker A
+	cv::Mat region(int side) const {
+		return mat(getCenteredRect({ (int)config.initOriginA.x, (int)config.initOriginA.y }, side, side, 0, cDepthWidth, 0, cDepthHeight));
+	}
+};
+
+
+static const BenchmarkFrame &benchmarkFrame() {
+	static BenchmarkFrame frame;
+	return frame;
+}
+
+
+// Calls MarkerTracker's search functions (which are private)
+struct MarkerTrackerBenchmarks {
+	static std::pair<cv::Point2f, float> findBall(MarkerTracker &tracker, const cv::Mat &frame, const SearchDescription &sd) {
+		return tracker.findBall(frame, sd.minDepth, sd.maxDepth, sd.minRadius, sd.maxRadius, sd.origin, sd.originTolerance, sd.searchSize);
+	}
+
+	static SearchDescription getSearchDescription(MarkerTracker &tracker, const cv::Mat &frame, double timeDiff) {
+		return tracker.getSearchDescription(frame, timeDiff);
+	}
+};
+
+
+// A tracker of marker A, which has been tracking it for the given number of frames (or is still initialising)
+static void initTracker(MarkerTracker &tracker, int frameCount) {
+	const BenchmarkFrame &frame = benchmarkFrame();
+	const ScannerTrackerConfig &config = frame.config;
+	tracker.init(config.depthWidth, config.depthHeight, config.depthVFov_deg, config.initOriginA, config.initDistance_mm, config.markerRadius_mm, config.markerRadiusTolerance, config.centerTolerance_px);
+	for (int i = 0; i < frameCount; i++) {
+		tracker.update(frame.mat, 1 / 30.0);
+	}
+}
+
+
+// The median depth of a square region (100 px: a search region, 16 px: a marker's centre)
+static void BM_GetMatMedian(benchmark::State &state) {
+	cv::Mat region = benchmarkFrame().region((int)state.range(0));
+	DepthHistogram histogram;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(getMatMedian(region, histogram));
+	}
+	state.SetItemsProcessed(state.iterations() * region.total());
+}
+BENCHMARK(BM_GetMatMedian)->Arg(16)->Arg(100)->Arg(200);
+
+
+static void BM_GetMatMean(benchmark::State &state) {
+	cv::Mat region = benchmarkFrame().region((int)state.range(0)).clone(); // (getMatMean assumes continuous rows)
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(getMatMean(region));
+	}
+	state.SetItemsProcessed(state.iterations() * region.total());
+}
+BENCHMARK(BM_GetMatMean)->Arg(16)->Arg(100)->Arg(200);
+
+
+// Searching while initialising (a 100 px region) and while tracking (the region sized by the filter)
+static void BM_FindBall(benchmark::State &state) {
+	const BenchmarkFrame &frame = benchmarkFrame();
+	MarkerTracker tracker;
+	initTracker(tracker, (int)state.range(0));
+	SearchDescription sd = MarkerTrackerBenchmarks::getSearchDescription(tracker, frame.mat, 1 / 30.0);
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(MarkerTrackerBenchmarks::findBall(tracker, frame.mat, sd));
+	}
+	state.SetItemsProcessed(state.iterations() * sd.searchSize * sd.searchSize);
+	state.SetLabel(std::to_string(sd.searchSize) + " px region");
+}
+BENCHMARK(BM_FindBall)->ArgName("trackedFrames")->Arg(0)->Arg(10);
+
+
+static void BM_GetSearchDescription(benchmark::State &state) {
+	const BenchmarkFrame &frame = benchmarkFrame();
+	MarkerTracker tracker;
+	initTracker(tracker, (int)state.range(0));
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(MarkerTrackerBenchmarks::getSearchDescription(tracker, frame.mat, 1 / 30.0));
+	}
+}
+BENCHMARK(BM_GetSearchDescription)->ArgName("trackedFrames")->Arg(0)->Arg(10);
+
+
+// Converting every pixel of a depth frame to camera space
+static void BM_Desc2Pos(benchmark::State &state) {
+	const BenchmarkFrame &frame = benchmarkFrame();
+	for (auto _ : state) {
+		for (int y = 0; y < cDepthHeight; y++) {
+			const UINT16 *row = frame.mat.ptr<UINT16>(y);
+			for (int x = 0; x < cDepthWidth; x++) {
+				benchmark::DoNotOptimize(frame.projection.desc2Pos({ (float)x, (float)y, (float)row[x] }));
+			}
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * cDepthWidth * cDepthHeight);
+}
+BENCHMARK(BM_Desc2Pos);
+
+
+// A colour frame, and the position of each depth pixel within it
+struct BenchmarkColorFrame {
+	vector<cv::Point2f> colorPoints;
+	vector<ColorPixel> color;
+
+	BenchmarkColorFrame() : colorPoints(cDepthWidth * cDepthHeight), color(cColorWidth * cColorHeight) {
+		// The colour camera's wider view, roughly aligned with the depth camera's
+		for (int y = 0; y < cDepthHeight; y++) {
+			for (int x = 0; x < cDepthWidth; x++) {
+				colorPoints[y * cDepthWidth + x] = { 160 + x * 3.1f, 30 + y * 2.4f };
+			}
+		}
+
+		for (size_t i = 0; i < color.size(); i++) {
+			color[i] = { (UINT8)i, (UINT8)(i >> 8), (UINT8)(i >> 16), 255 };
+		}
+	}
+};
+
+
+static const BenchmarkColorFrame &benchmarkColorFrame() {
+	static BenchmarkColorFrame frame;
+	return frame;
+}
+
+
+// Forming the environment's point cloud from a full depth frame and colour frame (on the given number of threads)
+static void BM_FormEnvironmentCloud(benchmark::State &state) {
+	const BenchmarkFrame &frame = benchmarkFrame();
+	const BenchmarkColorFrame &colorFrame = benchmarkColorFrame();
+	TaskPool pool((size_t)state.range(0));
+
+	for (auto _ : state) {
+		PointCloud cloud = formEnvironmentCloud(frame.depth.data(), colorFrame.colorPoints.data(), colorFrame.color.data(), cColorWidth, cColorHeight, frame.projection, &pool);
+		benchmark::DoNotOptimize(cloud);
+	}
+	state.SetItemsProcessed(state.iterations() * cDepthWidth * cDepthHeight);
+}
+BENCHMARK(BM_FormEnvironmentCloud)->ArgName("threads")->Arg(1)->Arg(2)->Arg(4)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+
+// Fusing a frame into the environment cloud (done for each of its frames), and forming the fused cloud (done once)
+static void BM_FuseEnvironmentFrame(benchmark::State &state) {
+	const BenchmarkFrame &frame = benchmarkFrame();
+	const BenchmarkColorFrame &colorFrame = benchmarkColorFrame();
+	EnvironmentFusion fusion(&frame.projection, 20);
+
+	for (auto _ : state) {
+		fusion.fuseFrame(frame.depth.data(), colorFrame.colorPoints.data(), colorFrame.color.data(), cColorWidth, cColorHeight);
+	}
+	state.SetItemsProcessed(state.iterations() * cDepthWidth * cDepthHeight);
+}
+BENCHMARK(BM_FuseEnvironmentFrame)->Unit(benchmark::kMillisecond);
+
+
+// Fusing a depth frame without colour (done for every cEnvironmentFusionInterval'th frame while tracking)
+static void BM_FuseEnvironmentDepthFrame(benchmark::State &state) {
+	const BenchmarkFrame &frame = benchmarkFrame();
+	EnvironmentFusion fusion(&frame.projection, 20);
+
+	for (auto _ : state) {
+		fusion.fuseDepthFrame(frame.depth.data());
+	}
+	state.SetItemsProcessed(state.iterations() * cDepthWidth * cDepthHeight);
+}
+BENCHMARK(BM_FuseEnvironmentDepthFrame)->Unit(benchmark::kMillisecond);
+
+
+static void BM_FusedEnvironmentCloud(benchmark::State &state) {
+	const BenchmarkFrame &frame = benchmarkFrame();
+	const BenchmarkColorFrame &colorFrame = benchmarkColorFrame();
+	EnvironmentFusion fusion(&frame.projection, 20);
+	fusion.fuseFrame(frame.depth.data(), colorFrame.colorPoints.data(), colorFrame.color.data(), cColorWidth, cColorHeight);
+
+	for (auto _ : state) {
+		PointCloud cloud = fusion.toPointCloud();
+		benchmark::DoNotOptimize(cloud);
+	}
+}
+BENCHMARK(BM_FusedEnvironmentCloud)->Unit(benchmark::kMillisecond);
+
+
+// Writing clouds of the sizes of a room's environment cloud, and of long sessions' accumulated clouds (in each encoding)
+static void BM_PointCloudWriteToFile(benchmark::State &state) {
+	PcdFormat format = (PcdFormat)state.range(1);
+	PointCloud cloud;
+	mt19937 random(1);
+	uniform_real_distribution<float> position(-3000, 3000);
+	for (int64_t i = 0; i < state.range(0); i++) {
+		cloud.AddPoint({ position(random), position(random), position(random) + 3000 }, (UINT8)i, (UINT8)(i >> 8), (UINT8)(i >> 16));
+	}
+
+	string filename = "microbenchmark_cloud.pcd";
+	for (auto _ : state) {
+		cloud.WriteToFile(filename, format);
+	}
+	remove(filename.c_str());
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PointCloudWriteToFile)->ArgNames({ "points", "format" })
+	->ArgsProduct({ { 200000, 1000000, 4000000 }, { (int)PcdFormat::ASCII, (int)PcdFormat::BINARY, (int)PcdFormat::BINARY_COMPRESSED } })
+	->Unit(benchmark::kMillisecond);
+
+
+BENCHMARK_MAIN();
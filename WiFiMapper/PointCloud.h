@@ -11,12 +11,19 @@
 #include "opencv2/highgui.hpp"
 #include "opencv2/imgproc.hpp"
 
-#include "stdafx.h"
-#include <strsafe.h>
+#include "Portability.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+#include "LzfCompressor.h"
 
 
 // A container for position and colour channels
@@ -30,24 +37,208 @@ struct ColoredPoint {
 };
 
 
+// The encodings of a PCD file's points (as given by its DATA line)
+enum class PcdFormat { ASCII, BINARY, BINARY_COMPRESSED };
+
+
+// Passes every point of a cloud, in order, to the given function as a series of arrays. May be called
+// more than once (each call passing the same points), so that the points need not all be held in memory.
+typedef std::function<void(const ColoredPoint*, size_t)> PointChunkHandler;
+typedef std::function<void(const PointChunkHandler&)> PointChunkSource;
+
+
+// Writes the formatting of points to a PCD file, a chunk at a time
+class PcdWriter {
+public:
+	// Writes the given number of points (supplied by forEachChunk) to a PCD file. The points are written to a temporary
+	// file, which then replaces the given file (so that it is never left partly written). Throws if it cannot be written.
+	static void write(const std::string &filename, size_t count, PcdFormat format, const PointChunkSource &forEachChunk) {
+		std::string tempFilename = filename + ".tmp";
+		std::ofstream outFile(tempFilename, std::ios::binary);
+		if (!outFile) {
+			throw std::runtime_error("Unable to open \"" + tempFilename + "\" for writing");
+		}
+
+		outFile << "VERSION .7\n"
+			"FIELDS x y z rgb\n"
+			"SIZE 4 4 4 4\n"
+			"TYPE F F F U\n"
+			"COUNT 1 1 1 1\n"
+			"WIDTH " << count << "\n"
+			"HEIGHT 1\n"
+			"VIEWPOINT 0 0 0 1 0 0 0\n"
+			"POINTS " << count << "\n";
+
+		size_t written;
+		if (format == PcdFormat::ASCII) {
+			outFile << "DATA ascii\n";
+			written = writeAscii(outFile, forEachChunk);
+		} else if (format == PcdFormat::BINARY) {
+			outFile << "DATA binary\n";
+			written = writeBinary(outFile, forEachChunk);
+		} else {
+			outFile << "DATA binary_compressed\n";
+			written = writeBinaryCompressed(outFile, count, forEachChunk);
+		}
+
+		outFile.close();
+		if (!outFile || written != count) {
+			std::remove(tempFilename.c_str());
+			throw std::runtime_error("Unable to write to \"" + tempFilename + "\"");
+		}
+
+#ifdef _WIN32
+		bool replaced = MoveFileExA(tempFilename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		bool replaced = std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+#endif
+		if (!replaced) {
+			std::remove(tempFilename.c_str());
+			throw std::runtime_error("Unable to replace \"" + filename + "\"");
+		}
+	}
+
+private:
+	// The number of points formatted at a time (bounding the memory used while writing)
+	static const size_t cWriteChunkSize = 1 << 14;
+
+	static uint32_t packColor(const ColoredPoint &p) {
+		return ((uint32_t)p.r << 16) | ((uint32_t)p.g << 8) | p.b;
+	}
+
+	// Each of the following returns the number of points written
+
+	static size_t writeAscii(std::ofstream &outFile, const PointChunkSource &forEachChunk) {
+		std::string chunk;
+		char line[96];
+		size_t written = 0;
+
+		forEachChunk([&](const ColoredPoint *points, size_t chunkSize) {
+			for (size_t i = 0; i < chunkSize; i++) {
+				const ColoredPoint &p = points[i];
+
+				// (%g gives the same digits as the default formatting of a stream)
+				int length = std::snprintf(line, sizeof(line), "%g %g %g %u\n", p.x, p.y, p.z, packColor(p));
+				chunk.append(line, length);
+
+				if (++written % cWriteChunkSize == 0) {
+					outFile.write(chunk.data(), chunk.size());
+					chunk.clear();
+				}
+			}
+		});
+
+		outFile.write(chunk.data(), chunk.size());
+		return written;
+	}
+
+	// Points are stored in turn, each as its (x, y, z, rgb) fields
+	static size_t writeBinary(std::ofstream &outFile, const PointChunkSource &forEachChunk) {
+		std::vector<uint32_t> chunk;
+		chunk.reserve(4 * cWriteChunkSize);
+		size_t written = 0;
+
+		forEachChunk([&](const ColoredPoint *points, size_t chunkSize) {
+			for (size_t i = 0; i < chunkSize; i++) {
+				const ColoredPoint &p = points[i];
+				uint32_t fields[4] = { 0, 0, 0, packColor(p) };
+				std::memcpy(fields, &p.x, 3 * sizeof(float));
+				chunk.insert(chunk.end(), fields, fields + 4);
+
+				if (++written % cWriteChunkSize == 0) {
+					outFile.write(reinterpret_cast<const char*>(chunk.data()), chunk.size() * sizeof(uint32_t));
+					chunk.clear();
+				}
+			}
+		});
+
+		outFile.write(reinterpret_cast<const char*>(chunk.data()), chunk.size() * sizeof(uint32_t));
+		return written;
+	}
+
+	// Every point's x is stored, then every y, z and rgb (one pass over the points each), compressed
+	// as a single LZF block after its sizes
+	static size_t writeBinaryCompressed(std::ofstream &outFile, size_t count, const PointChunkSource &forEachChunk) {
+		std::streampos sizesPosition = outFile.tellp();
+		uint32_t sizes[2] = { 0, 0 }; // (compressed, then uncompressed, written once known)
+		outFile.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+
+		LzfCompressor compressor(outFile);
+		std::vector<uint32_t> chunk;
+		chunk.reserve(cWriteChunkSize);
+		size_t written = 0;
+
+		for (int field = 0; field < 4; field++) {
+			written = 0;
+			forEachChunk([&](const ColoredPoint *points, size_t chunkSize) {
+				for (size_t i = 0; i < chunkSize; i++) {
+					const ColoredPoint &p = points[i];
+					uint32_t value = packColor(p);
+					if (field < 3) {
+						std::memcpy(&value, &p.x + field, sizeof(float));
+					}
+					chunk.push_back(value);
+
+					if (++written % cWriteChunkSize == 0) {
+						compressor.write(chunk.data(), chunk.size() * sizeof(uint32_t));
+						chunk.clear();
+					}
+				}
+			});
+
+			compressor.write(chunk.data(), chunk.size() * sizeof(uint32_t));
+			chunk.clear();
+
+			if (written != count) {
+				return written;
+			}
+		}
+		compressor.finish();
+
+		if (compressor.compressedSize() > UINT32_MAX || compressor.uncompressedSize() > UINT32_MAX) {
+			throw std::runtime_error("Too many points for a binary_compressed PCD file");
+		}
+
+		sizes[0] = (uint32_t)compressor.compressedSize();
+		sizes[1] = (uint32_t)compressor.uncompressedSize();
+		outFile.seekp(sizesPosition);
+		outFile.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+		outFile.seekp(0, std::ios::end);
+		return written;
+	}
+};
+
+
 // An object containing many ColoredPoints, capable of writing them to file
 class PointCloud {
 public:
 	PointCloud() = default;
 
+	// Takes the given points (eg: formed in place, to avoid adding them one at a time)
+	explicit PointCloud(std::vector<ColoredPoint> &&points) : m_points(std::move(points)) {}
+
 	// Adds a point at the given position, with the given colour values
 	void AddPoint(cv::Point3f point, UINT8 r, UINT8 g, UINT8 b) {
 		ColoredPoint newPoint{ point.x, point.y, point.z, r, g, b };
 		m_points.emplace_back(newPoint);
 	}
 
+	// Adds every point of the given cloud (after those already added)
+	void Append(const PointCloud &other) {
+		m_points.insert(m_points.end(), other.m_points.begin(), other.m_points.end());
+	}
+
+	size_t Size() const {
+		return m_points.size();
+	}
+
 	// Writes to PCD file (using WriteToFile). Keeps trying until it is performed
 	// successfully (a workaraound to prevent dropbox from interfering mid-write).
-	void WriteToFileSafe(std::string filename) {
+	void WriteToFileSafe(std::string filename, PcdFormat format = PcdFormat::ASCII) {
 		bool written = false;
 		while (!written) {
 			try {
-				WriteToFile(filename);
+				WriteToFile(filename, format);
 				written = true;
 			} catch (const std::exception &e) {
 				std::cerr << "Failed to write to: \"" << filename << "\"\nDetails:\n";
@@ -59,37 +250,13 @@ public:
 		}
 	}
 
-	// Writes point cloud contents to an ASCII PCD file.
-	void WriteToFile(std::string filename) {
-		// make an enormous string (bad practise, but allows for atomic write)
-		std::stringstream outSStream;
-		size_t count = m_points.size();
-
-		outSStream << "VERSION .7\n"
-			"FIELDS x y z rgb\n"
-			"SIZE 4 4 4 4\n"
-			"TYPE F F F U\n"
-			"COUNT 1 1 1 1\n"
-			"WIDTH " << count << "\n"
-			"HEIGHT 1\n"
-			"VIEWPOINT 0 0 0 1 0 0 0\n"
-			"POINTS " << count << "\n"
-			"DATA ascii\n";
-
-		for (size_t i = 0; i < count; i++) {
-			ColoredPoint p = m_points[i];
-			uint color = p.r;
-			color = (color << 8) + p.g;
-			color = (color << 8) + p.b;
-
-			outSStream << p.x << " " << p.y << " " << p.z << " " << color << "\n";
-		}
-
-		std::ofstream outFile(filename);
-		outFile << outSStream.str();
-		outFile.close();
+	// Writes point cloud contents to a PCD file (using PcdWriter). Throws if it cannot be written.
+	void WriteToFile(std::string filename, PcdFormat format = PcdFormat::ASCII) {
+		PcdWriter::write(filename, m_points.size(), format, [this](const PointChunkHandler &handleChunk) {
+			handleChunk(m_points.data(), m_points.size());
+		});
 	}
 
 private:
 	std::vector<ColoredPoint> m_points;
-};
\ No newline at end of file
+};
@@ -0,0 +1,20 @@
+/*
+ * Platform shims which allow the tracking and point cloud modules to be
+ * built without the Windows and Kinect SDK headers (see CMakeLists.txt).
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include "stdafx.h"
+#include <strsafe.h>
+#else
+#include <cstdint>
+#include <sys/types.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT;
+#endif
@@ -0,0 +1,155 @@
+/*
+ * The module which collects RSSI values from every ESP8266 module on a single
+ * thread, by polling a non-blocking connection to each (or a single socket on
+ * which they all stream).
+ *
+ * Written by Marc Katzef
+ */
+
+#include "ReceiverPoller.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+// The longest time to wait in poll, so that stop is handled promptly
+static const chrono::milliseconds cMaxPollTime(50);
+
+
+ReceiverPoller::~ReceiverPoller() {
+	stop();
+}
+
+
+void ReceiverPoller::addReceiver(WiFiReceiver *receiver) {
+	Module module;
+	module.receiver = receiver;
+	m_modules.push_back(move(module));
+}
+
+
+void ReceiverPoller::setStreaming(uint32_t interval_us) {
+	m_streamInterval_us = interval_us;
+}
+
+
+void ReceiverPoller::setBatching(bool batching) {
+	m_batching = batching;
+}
+
+
+RssiStreamStats ReceiverPoller::streamStats(size_t i) const {
+	return m_stream ? m_stream->stats(i) : RssiStreamStats();
+}
+
+
+void ReceiverPoller::start() {
+	if (m_running) {
+		return;
+	}
+
+	if (m_streamInterval_us > 0) {
+		if (!m_stream) {
+			m_stream.reset(new RssiStreamReceiver(m_streamInterval_us));
+			for (Module &module : m_modules) {
+				m_stream->addReceiver(module.receiver);
+			}
+		}
+	} else {
+		for (Module &module : m_modules) {
+			if (!module.connection) {
+				RssiConnection::REQUESTS requests = m_batching ? RssiConnection::REQUESTS::BATCH : RssiConnection::REQUESTS::LATEST;
+				module.connection.reset(new RssiConnection(module.receiver, requests));
+			}
+		}
+	}
+
+	m_running = true;
+	m_thread = thread(&ReceiverPoller::run, this);
+}
+
+
+void ReceiverPoller::stop() {
+	m_running = false;
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+
+void ReceiverPoller::run() {
+	vector<pollfd> pollSet;
+	vector<Module*> pollModules;
+
+	while (m_running) {
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		chrono::steady_clock::time_point deadline = now + cMaxPollTime;
+
+		pollSet.clear();
+		pollModules.clear();
+
+		// All streamed samples arrive on one socket (with no module)
+		if (m_stream && m_stream->socket() != cInvalidSocket) {
+			m_stream->update(now);
+			deadline = min(deadline, m_stream->deadline());
+
+			pollfd entry;
+			entry.fd = m_stream->socket();
+			entry.events = POLLIN;
+			entry.revents = 0;
+			pollSet.push_back(entry);
+			pollModules.push_back(NULL);
+		}
+
+		for (Module &module : m_modules) {
+			if (!module.connection) {
+				continue;
+			}
+
+			module.connection->update(now);
+
+			deadline = min(deadline, module.connection->deadline());
+
+			if (module.connection->socket() != cInvalidSocket) {
+				pollfd entry;
+				entry.fd = module.connection->socket();
+				entry.events = module.connection->events();
+				entry.revents = 0;
+				pollSet.push_back(entry);
+				pollModules.push_back(&module);
+			}
+		}
+
+		int timeout_ms = (int)max<int64_t>(0, chrono::duration_cast<chrono::milliseconds>(deadline - now).count() + 1);
+		if (pollSet.empty()) {
+			this_thread::sleep_for(chrono::milliseconds(timeout_ms));
+		} else if (pollSockets(pollSet.data(), pollSet.size(), timeout_ms) < 0) {
+			this_thread::sleep_for(chrono::milliseconds(timeout_ms));
+			continue;
+		}
+
+		now = chrono::steady_clock::now();
+		for (size_t i = 0; i < pollSet.size(); i++) {
+			if (!pollModules[i]) {
+				if (pollSet[i].revents) {
+					m_stream->service(now);
+				}
+				continue;
+			}
+
+			Module &module = *pollModules[i];
+			module.connection->service(pollSet[i].revents, now);
+		}
+	}
+
+	if (m_stream) {
+		m_stream->unsubscribe();
+	}
+
+	for (Module &module : m_modules) {
+		if (module.connection) {
+			module.connection->disconnect();
+		}
+	}
+}
@@ -0,0 +1,64 @@
+/*
+ * The module which collects RSSI values from every ESP8266 module on a single
+ * thread, by polling a non-blocking connection to each (or a single socket on
+ * which they all stream).
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "RssiConnection.h"
+#include "RssiStream.h"
+#include "WiFiReceiver.h"
+
+
+// Each module is sampled as fast as it responds, independently of the others
+class ReceiverPoller {
+public:
+	ReceiverPoller() = default;
+	~ReceiverPoller();
+
+	ReceiverPoller(const ReceiverPoller &) = delete;
+	ReceiverPoller &operator=(const ReceiverPoller &) = delete;
+
+	// Adds a module to collect values for (before start is called)
+	void addReceiver(WiFiReceiver *receiver);
+
+	// (Optional) Have the modules stream samples over UDP at the given interval, rather
+	// than requesting each one over HTTP (0, the default). Must be set before start.
+	void setStreaming(uint32_t interval_us);
+
+	// (Optional) Request every sample recorded by each module since the last request,
+	// rather than only its current value. Must be set before start.
+	void setBatching(bool batching);
+
+	// The packet statistics of the i'th added module, when streaming
+	RssiStreamStats streamStats(size_t i) const;
+
+	// Begin collecting samples
+	void start();
+
+	// Stop collecting samples and close all connections
+	void stop();
+
+private:
+	struct Module {
+		WiFiReceiver *receiver;
+		std::unique_ptr<RssiConnection> connection;
+	};
+
+	std::vector<Module> m_modules;
+	uint32_t m_streamInterval_us = 0;
+	bool m_batching = false;
+	std::unique_ptr<RssiStreamReceiver> m_stream;
+	std::atomic<bool> m_running{ false };
+	std::thread m_thread;
+
+	void run();
+};
@@ -0,0 +1,383 @@
+/*
+ * The module responsible for requesting RSSI values from a single ESP8266 module
+ * over a persistent (keep-alive) HTTP connection.
+ *
+ * Written by Marc Katzef
+ */
+
+#include "RssiConnection.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+static const chrono::milliseconds cMinBackoff(50);
+static const chrono::milliseconds cMaxBackoff(2000);
+
+
+// Returns true if the header line starting at line begins with the given (lower case) name
+static bool headerIs(const char *line, const char *lineEnd, const char *name) {
+	size_t nameLength = strlen(name);
+	if ((size_t)(lineEnd - line) < nameLength) {
+		return false;
+	}
+
+	for (size_t i = 0; i < nameLength; i++) {
+		if (tolower((unsigned char)line[i]) != name[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+// Returns true if the given (lower case) token appears in the given range
+static bool containsToken(const char *begin, const char *end, const char *token) {
+	size_t tokenLength = strlen(token);
+	for (const char *p = begin; p + tokenLength <= end; p++) {
+		if (headerIs(p, end, token)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+RssiResponseParser::RESULT RssiResponseParser::next(Response &response) {
+	static const char cHeaderEnd[] = "\r\n\r\n";
+
+	// Keep any further (pipelined) responses
+	if (m_consumed > 0) {
+		m_length -= m_consumed;
+		memmove(m_buffer, m_buffer + m_consumed, m_length);
+		m_consumed = 0;
+	}
+
+	char *end = m_buffer + m_length;
+	char *headerEnd = search(m_buffer, end, cHeaderEnd, cHeaderEnd + 4);
+
+	if (headerEnd == end) {
+		return m_length == sizeof(m_buffer) ? RESULT::INVALID : RESULT::INCOMPLETE;
+	}
+
+	// Status line (eg: "HTTP/1.1 200 OK")
+	char *lineEnd = search(m_buffer, headerEnd + 2, cHeaderEnd, cHeaderEnd + 2);
+	if (!headerIs(m_buffer, lineEnd, "http/1.")) {
+		return RESULT::INVALID;
+	}
+
+	bool isHttp10 = m_buffer[7] == '0';
+	int status = atoi(m_buffer + 9);
+
+	// Headers
+	long contentLength = -1;
+	bool connectionClose = isHttp10;
+	for (char *line = lineEnd + 2; line < headerEnd; line = lineEnd + 2) {
+		lineEnd = search(line, headerEnd + 2, cHeaderEnd, cHeaderEnd + 2);
+
+		if (headerIs(line, lineEnd, "content-length:")) {
+			contentLength = strtol(line + 15, NULL, 10);
+		} else if (headerIs(line, lineEnd, "connection:")) {
+			connectionClose = containsToken(line + 11, lineEnd, "close");
+		}
+	}
+
+	if (contentLength < 0) {
+		return RESULT::INVALID;
+	}
+
+	char *body = headerEnd + 4;
+	if (body + contentLength > end) {
+		return body + contentLength > m_buffer + sizeof(m_buffer) ? RESULT::INVALID : RESULT::INCOMPLETE;
+	}
+
+	response.status = status;
+	response.body = body;
+	response.bodyLength = contentLength;
+	response.connectionClose = connectionClose;
+	m_consumed = body + contentLength - m_buffer;
+
+	return RESULT::COMPLETE;
+}
+
+
+RssiConnection::RssiConnection(WiFiReceiver *receiver, REQUESTS requests, int pipelineDepth, int timeout_ms) :
+	m_receiver(receiver),
+	m_requests(requests),
+	m_pipelineDepth(max(pipelineDepth, 1)),
+	m_timeout(timeout_ms),
+	m_backoff(cMinBackoff),
+	m_nextAttempt(chrono::steady_clock::now()) {
+
+	formRequest();
+	initSockets();
+}
+
+
+RssiConnection::~RssiConnection() {
+	disconnect();
+}
+
+
+void RssiConnection::update(time_point now) {
+	switch (m_state) {
+	case STATES::WAITING: {
+		if (now >= m_nextAttempt) {
+			connect(now);
+		}
+		break;
+	}
+	case STATES::CONNECTING:
+	case STATES::CONNECTED: {
+		if ((m_state == STATES::CONNECTING || m_outstandingRequests > 0) && now - m_lastProgress > m_timeout) {
+			printf("Timed out waiting for %s\n", ipAddress().c_str());
+			failed(now);
+		}
+		break;
+	}
+	}
+}
+
+
+short RssiConnection::events() const {
+	if (m_state == STATES::CONNECTING || m_unsentRequests > 0) {
+		return POLLIN | POLLOUT;
+	}
+
+	return POLLIN;
+}
+
+
+size_t RssiConnection::service(short revents, time_point now) {
+	if (m_socket == cInvalidSocket || revents == 0) {
+		return 0;
+	}
+
+	if (m_state == STATES::CONNECTING) {
+		if (!(revents & (POLLOUT | POLLERR | POLLHUP))) {
+			return 0;
+		}
+
+		int error = takeSocketError(m_socket);
+		if (error != 0) {
+			printf("Error %d connecting to %s\n", error, ipAddress().c_str());
+			failed(now);
+			return 0;
+		}
+
+		m_state = STATES::CONNECTED;
+		m_lastProgress = now;
+		queueRequests(now);
+	}
+
+	if ((revents & (POLLERR | POLLNVAL)) || ((revents & POLLOUT) && !sendRequests())) {
+		failed(now);
+		return 0;
+	}
+
+	if (!(revents & (POLLIN | POLLHUP))) {
+		return 0;
+	}
+
+	bool closed = false;
+	int received = recv(m_socket, m_parser.writePointer(), (int)m_parser.writeCapacity(), 0);
+	if (received > 0) {
+		m_parser.commit(received);
+	} else if (received == 0 || !isInProgressError(lastSocketError())) {
+		closed = true;
+	}
+
+	// Several (pipelined) responses may have arrived together
+	size_t sampleCount = 0;
+	while (true) {
+		RssiResponseParser::Response response;
+		RssiResponseParser::RESULT result = m_parser.next(response);
+
+		if (result == RssiResponseParser::RESULT::INCOMPLETE) {
+			break;
+		}
+
+		int added = -1;
+		if (result == RssiResponseParser::RESULT::COMPLETE && response.status == 404 && m_requests == REQUESTS::BATCH) {
+			printf("%s does not serve batches (its firmware predates them), requesting single values instead\n", ipAddress().c_str());
+			m_requests = REQUESTS::LATEST;
+			formRequest();
+			added = 0;
+		} else if (result == RssiResponseParser::RESULT::COMPLETE && response.status == 200) {
+			if (m_requests == REQUESTS::BATCH) {
+				added = m_receiver->addBatch(response.body, response.bodyLength, now);
+			} else {
+				char digits[16] = { 0 };
+				memcpy(digits, response.body, min(response.bodyLength, sizeof(digits) - 1));
+				m_receiver->addSample(atoi(digits), now);
+				added = 1;
+			}
+		}
+
+		if (added < 0) {
+			printf("Invalid response from %s\n", ipAddress().c_str());
+			failed(now);
+			return sampleCount;
+		}
+
+		sampleCount += added;
+		m_outstandingRequests--;
+		m_lastProgress = now;
+		m_backoff = cMinBackoff;
+
+		// Requests sent after this response will not be answered, so reconnect straight away
+		if (response.connectionClose) {
+			if (!m_reportedClose) {
+				printf("%s closes its connection after each response (its firmware was built with an ESP8266 core older than 3.0.0), "
+					"so each request needs a new connection\n", ipAddress().c_str());
+				m_reportedClose = true;
+			}
+
+			disconnect();
+			m_nextAttempt = now;
+			return sampleCount;
+		}
+	}
+
+	if (closed) {
+		failed(now);
+		return sampleCount;
+	}
+
+	queueRequests(now);
+	return sampleCount;
+}
+
+
+RssiConnection::time_point RssiConnection::deadline() const {
+	if (m_state == STATES::WAITING) {
+		return m_nextAttempt;
+	}
+
+	if (m_state == STATES::CONNECTING || m_outstandingRequests > 0) {
+		return m_lastProgress + m_timeout;
+	}
+
+	return time_point::max();
+}
+
+
+void RssiConnection::disconnect() {
+	if (m_socket != cInvalidSocket) {
+		closeSocket(m_socket);
+		m_socket = cInvalidSocket;
+	}
+
+	m_state = STATES::WAITING;
+	m_parser.reset();
+	m_outstandingRequests = 0;
+	m_unsentRequests = 0;
+	m_sendOffset = 0;
+}
+
+
+void RssiConnection::connect(time_point now) {
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo *address = NULL;
+	string port = to_string(m_receiver->port());
+	if (getaddrinfo(ipAddress().c_str(), port.c_str(), &hints, &address) != 0 || !address) {
+		printf("Unable to resolve %s\n", ipAddress().c_str());
+		failed(now);
+		return;
+	}
+
+	m_socket = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+	if (m_socket != cInvalidSocket) {
+		setSocketNoDelay(m_socket);
+
+		if (!setSocketNonBlocking(m_socket)
+			|| (::connect(m_socket, address->ai_addr, (int)address->ai_addrlen) != 0 && !isInProgressError(lastSocketError()))) {
+			printf("Error %d connecting to %s\n", lastSocketError(), ipAddress().c_str());
+			closeSocket(m_socket);
+			m_socket = cInvalidSocket;
+		}
+	}
+
+	freeaddrinfo(address);
+
+	if (m_socket == cInvalidSocket) {
+		failed(now);
+		return;
+	}
+
+	// Completion is reported by the socket becoming writable
+	m_state = STATES::CONNECTING;
+	m_lastProgress = now;
+}
+
+
+void RssiConnection::queueRequests(time_point now) {
+	// Keep the pipeline full, so the module always has a request waiting
+	int pipelineDepth = m_requests == REQUESTS::BATCH ? 1 : m_pipelineDepth;
+	while (m_outstandingRequests < pipelineDepth) {
+		if (m_outstandingRequests == 0) {
+			m_lastProgress = now;
+		}
+
+		if (m_requests == REQUESTS::BATCH) {
+			formRequest(); // continue from the last batch received
+		}
+
+		m_outstandingRequests++;
+		m_unsentRequests++;
+	}
+
+	if (!sendRequests()) {
+		failed(now);
+	}
+}
+
+
+void RssiConnection::formRequest() {
+	string path = "/rssi";
+	if (m_requests == REQUESTS::BATCH) {
+		path += "/batch?since=" + to_string(m_receiver->batchSequence());
+	}
+
+	m_request = "GET " + path + " HTTP/1.1\r\nHost: " + ipAddress() + "\r\nConnection: keep-alive\r\n\r\n";
+}
+
+
+bool RssiConnection::sendRequests() {
+	while (m_unsentRequests > 0) {
+		const char *data = m_request.c_str() + m_sendOffset;
+		int remaining = (int)(m_request.size() - m_sendOffset);
+
+		int sent = send(m_socket, data, remaining, cSendFlags);
+		if (sent < 0) {
+			// The rest is sent once the socket is writable again
+			return isInProgressError(lastSocketError());
+		}
+
+		m_sendOffset += sent;
+		if (m_sendOffset == m_request.size()) {
+			m_sendOffset = 0;
+			m_unsentRequests--;
+		}
+	}
+
+	return true;
+}
+
+
+void RssiConnection::failed(time_point now) {
+	disconnect();
+
+	m_nextAttempt = now + m_backoff;
+	m_backoff = min(m_backoff * 2, cMaxBackoff);
+}
@@ -0,0 +1,131 @@
+/*
+ * The module responsible for requesting RSSI values from a single ESP8266 module
+ * over a persistent (keep-alive) HTTP connection.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "Sockets.h"
+#include "WiFiReceiver.h"
+
+
+// Extracts the bodies of a stream of HTTP responses, using a fixed-size buffer
+class RssiResponseParser {
+public:
+	enum class RESULT { INCOMPLETE, COMPLETE, INVALID };
+
+	struct Response {
+		int status; // eg: 200 (OK) or 404 (Not Found)
+		const char *body;
+		size_t bodyLength;
+		bool connectionClose; // the server will close the connection after this response
+	};
+
+	// The space into which received bytes should be written (then passed to commit)
+	char *writePointer() {
+		return m_buffer + m_length;
+	}
+
+	size_t writeCapacity() const {
+		return sizeof(m_buffer) - m_length;
+	}
+
+	void commit(size_t byteCount) {
+		m_length += byteCount;
+	}
+
+	// Consumes the next complete response from the buffer, if there is one. The response's
+	// body remains valid until the next call to next (which discards it) or reset.
+	RESULT next(Response &response);
+
+	// Discards any partially-received responses (eg: after reconnecting)
+	void reset() {
+		m_length = 0;
+		m_consumed = 0;
+	}
+
+private:
+	char m_buffer[2048];
+	size_t m_length = 0;
+	size_t m_consumed = 0; // the length of the last response returned
+};
+
+
+// A persistent, non-blocking connection to one ESP8266 module which keeps several
+// requests for its RSSI in flight, and reconnects (with increasing delays) when it
+// is lost. It is driven by polling its socket (see ReceiverPoller).
+class RssiConnection {
+public:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	enum class STATES { WAITING, CONNECTING, CONNECTED };
+
+	// LATEST: request the module's current RSSI (/rssi)
+	// BATCH: request every sample recorded by the module since the last request (/rssi/batch)
+	enum class REQUESTS { LATEST, BATCH };
+
+	// Received values are added to the given receiver (which also supplies the module's address).
+	// Batch requests are not pipelined, as each depends on the response to the last. Modules which do
+	// not serve batches (ie: running older firmware) are sent requests for their current RSSI instead.
+	RssiConnection(WiFiReceiver *receiver, REQUESTS requests = REQUESTS::LATEST, int pipelineDepth = 2, int timeout_ms = 1000);
+	~RssiConnection();
+
+	RssiConnection(const RssiConnection &) = delete;
+	RssiConnection &operator=(const RssiConnection &) = delete;
+
+	// Opens the connection when it is due to be (re)opened, and abandons it if the
+	// module has not responded in time. Must be called before each poll.
+	void update(time_point now);
+
+	// The socket to poll (or cInvalidSocket while waiting to reconnect) and the events to poll for
+	socket_t socket() const {
+		return m_socket;
+	}
+
+	short events() const;
+
+	// Handles the events reported by poll. Returns the number of samples added to the receiver.
+	size_t service(short revents, time_point now);
+
+	// The time by which update must next be called
+	time_point deadline() const;
+
+	const std::string &ipAddress() const {
+		return m_receiver->ipAddress();
+	}
+
+	// Closes the connection (it is reopened by the next update)
+	void disconnect();
+
+private:
+	WiFiReceiver *m_receiver;
+	REQUESTS m_requests;
+	int m_pipelineDepth;
+	std::chrono::milliseconds m_timeout;
+	std::string m_request; // the next request to send
+
+	STATES m_state = STATES::WAITING;
+	socket_t m_socket = cInvalidSocket;
+	RssiResponseParser m_parser;
+	int m_outstandingRequests = 0; // sent, or waiting to be sent
+	int m_unsentRequests = 0;
+	size_t m_sendOffset = 0; // the progress through sending the first unsent request
+	time_point m_lastProgress;
+	bool m_reportedClose = false; // true once the module has been reported to close connections after responding
+
+	std::chrono::milliseconds m_backoff;
+	time_point m_nextAttempt;
+
+	void connect(time_point now);
+	void queueRequests(time_point now);
+	void formRequest();
+	bool sendRequests();
+	void failed(time_point now);
+};
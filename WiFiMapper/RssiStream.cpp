@@ -0,0 +1,210 @@
+/*
+ * The module responsible for receiving RSSI values streamed (over UDP) by the
+ * ESP8266 modules, as an alternative to requesting each value over HTTP.
+ *
+ * Written by Marc Katzef
+ */
+
+#include "RssiStream.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+// The period at which subscriptions are renewed (the modules stop streaming after 5 s)
+static const chrono::milliseconds cSubscriptionPeriod(1000);
+
+// A late packet was sampled before the latest packet by at most this long (the longest a packet is delayed), so
+// an earlier packet sampled longer before it (or after it) means that the module has restarted
+static const uint32_t cMaxLateness_us = 2000000;
+
+// The most packets read per call to service
+static const size_t cMaxPacketsPerService = 256;
+
+// The length of the window in which received packets are remembered (to detect duplicates)
+static const uint32_t cReceivedWindow = 64;
+
+
+static uint32_t readUint32(const uint8_t *data) {
+	return data[0] | (data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+
+bool decodeRssiPacket(const uint8_t *data, size_t length, RssiPacket &packet) {
+	if (length != cSamplePacketLength || data[0] != 'W' || data[1] != 'R' || data[2] != cRssiStreamVersion) {
+		return false;
+	}
+
+	packet.moduleId = data[3];
+	packet.sequence = readUint32(data + 4);
+	packet.timestamp_us = readUint32(data + 8);
+	packet.rssi = (int16_t)(data[12] | (data[13] << 8));
+	return true;
+}
+
+
+void encodeSubscribePacket(uint32_t interval_us, uint8_t *data) {
+	data[0] = 'W';
+	data[1] = 'S';
+	data[2] = cRssiStreamVersion;
+	data[3] = 0;
+	for (int i = 0; i < 4; i++) {
+		data[4 + i] = (interval_us >> (8 * i)) & 0xFF;
+	}
+}
+
+
+RssiStreamReceiver::RssiStreamReceiver(uint32_t interval_us, uint16_t localPort) :
+	m_interval_us(interval_us),
+	m_moduleIndices(256, -1),
+	m_nextSubscription(chrono::steady_clock::now()) {
+
+	initSockets();
+
+	m_socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (m_socket == cInvalidSocket) {
+		printf("Unable to create the RSSI stream socket (error %d)\n", lastSocketError());
+		return;
+	}
+
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(localPort);
+
+	if (::bind(m_socket, (const sockaddr*)&address, sizeof(address)) != 0 || !setSocketNonBlocking(m_socket)) {
+		printf("Unable to bind the RSSI stream socket (error %d)\n", lastSocketError());
+		closeSocket(m_socket);
+		m_socket = cInvalidSocket;
+	}
+}
+
+
+RssiStreamReceiver::~RssiStreamReceiver() {
+	if (m_socket != cInvalidSocket) {
+		closeSocket(m_socket);
+	}
+}
+
+
+void RssiStreamReceiver::addReceiver(WiFiReceiver *receiver) {
+	unique_ptr<Module> module(new Module());
+	module->receiver = receiver;
+
+	memset(&module->address, 0, sizeof(module->address));
+	module->address.sin_family = AF_INET;
+	module->address.sin_port = htons(cRssiStreamPort);
+	if (inet_pton(AF_INET, receiver->ipAddress().c_str(), &module->address.sin_addr) != 1) {
+		printf("Unable to stream from %s (not an IPv4 address)\n", receiver->ipAddress().c_str());
+	}
+
+	uint8_t moduleId = ntohl(module->address.sin_addr.s_addr) & 0xFF;
+	if (m_moduleIndices[moduleId] >= 0) {
+		printf("Modules with the id %d cannot be told apart\n", moduleId);
+	}
+
+	m_moduleIndices[moduleId] = (int)m_modules.size();
+	m_modules.push_back(move(module));
+}
+
+
+void RssiStreamReceiver::update(time_point now) {
+	if (now >= m_nextSubscription) {
+		subscribe(m_interval_us);
+		m_nextSubscription = now + cSubscriptionPeriod;
+	}
+}
+
+
+void RssiStreamReceiver::service(time_point now) {
+	uint8_t data[64];
+	for (size_t i = 0; i < cMaxPacketsPerService; i++) {
+		int length = recv(m_socket, reinterpret_cast<char*>(data), sizeof(data), 0);
+		if (length < 0) {
+			// Windows reports ICMP port unreachable messages (from modules which are offline) here
+			if (isInProgressError(lastSocketError())) {
+				return;
+			}
+			continue;
+		}
+
+		RssiPacket packet;
+		if (!decodeRssiPacket(data, length, packet) || m_moduleIndices[packet.moduleId] < 0) {
+			continue;
+		}
+
+		handlePacket(*m_modules[m_moduleIndices[packet.moduleId]], packet, now);
+	}
+}
+
+
+void RssiStreamReceiver::unsubscribe() {
+	subscribe(0);
+}
+
+
+void RssiStreamReceiver::subscribe(uint32_t interval_us) {
+	uint8_t packet[cSubscribePacketLength];
+	encodeSubscribePacket(interval_us, packet);
+
+	for (unique_ptr<Module> &module : m_modules) {
+		sendto(m_socket, reinterpret_cast<const char*>(packet), sizeof(packet), 0, (const sockaddr*)&module->address, sizeof(module->address));
+	}
+}
+
+
+void RssiStreamReceiver::handlePacket(Module &module, const RssiPacket &packet, time_point now) {
+	RssiStreamStats &stats = module.stats;
+	bool inOrder = true;
+
+	// The module's clock restarts with its sequence, so a restart shows as a later packet sampled before the
+	// latest one, or as an earlier packet sampled after it (or long before it), however far its sequence has reached
+	uint32_t sampledBefore_us = module.highestTimestamp_us - packet.timestamp_us;
+	bool later = packet.sequence > module.highestSequence;
+	bool restarted = later ? (int32_t)sampledBefore_us > 0 : sampledBefore_us > cMaxLateness_us;
+
+	if (module.highestSequence == 0 || restarted) {
+		module.firstSequence = packet.sequence;
+		module.highestSequence = packet.sequence;
+		module.highestTimestamp_us = packet.timestamp_us;
+		module.received = 1;
+		module.receiver->resetModuleClock();
+	} else if (later) {
+		uint32_t gap = packet.sequence - module.highestSequence;
+		module.received = gap < cReceivedWindow ? (module.received << gap) | 1 : 1;
+		module.highestSequence = packet.sequence;
+		module.highestTimestamp_us = packet.timestamp_us;
+		stats.lost += gap - 1;
+	} else {
+		// A packet older than the window may be late or a duplicate, so it is ignored (as is one from before the
+		// first packet received, which was never counted as lost)
+		uint32_t age = module.highestSequence - packet.sequence;
+		if (age >= cReceivedWindow || packet.sequence < module.firstSequence) {
+			return;
+		}
+
+		if (module.received & (1ull << age)) {
+			stats.duplicates++;
+			module.published.store(stats);
+			return;
+		}
+
+		// A late packet, which was counted as lost when a later one arrived
+		module.received |= 1ull << age;
+		stats.reordered++;
+		stats.lost--;
+		inOrder = false;
+	}
+
+	stats.received++;
+	module.published.store(stats);
+
+	// The receiver's samples are ordered by time, so late packets are only counted
+	if (!inOrder) {
+		return;
+	}
+
+	module.receiver->addModuleSample(packet.rssi, packet.timestamp_us, now);
+}
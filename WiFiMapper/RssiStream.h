@@ -0,0 +1,117 @@
+/*
+ * The module responsible for receiving RSSI values streamed (over UDP) by the
+ * ESP8266 modules, as an alternative to requesting each value over HTTP.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "SeqLock.h"
+#include "Sockets.h"
+#include "WiFiReceiver.h"
+
+// The UDP port on which the modules accept subscriptions
+static const uint16_t cRssiStreamPort = 4210;
+
+// Subscribe packet (host to module), little-endian: 'W', 'S', version, 0, uint32 sample interval (us, 0 to stop)
+static const size_t cSubscribePacketLength = 8;
+
+// Sample packet (module to host), little-endian: 'W', 'R', version, uint8 module id,
+// uint32 sequence number (from 1), uint32 micros() at sampling, int16 RSSI (dBm), 0, 0
+static const size_t cSamplePacketLength = 16;
+
+static const uint8_t cRssiStreamVersion = 1;
+
+
+// A decoded sample packet
+struct RssiPacket {
+	uint8_t moduleId;
+	uint32_t sequence;
+	uint32_t timestamp_us; // the module's clock
+	int rssi; // dBm
+};
+
+// Returns false if the given datagram is not a sample packet
+bool decodeRssiPacket(const uint8_t *data, size_t length, RssiPacket &packet);
+
+void encodeSubscribePacket(uint32_t interval_us, uint8_t *data);
+
+
+// The packets received from one module
+struct RssiStreamStats {
+	uint64_t received = 0;
+	uint64_t lost = 0; // never received (so far)
+	uint64_t reordered = 0; // received after a later packet
+	uint64_t duplicates = 0;
+};
+
+
+// Receives the streams of any number of modules on a single non-blocking UDP socket,
+// which is driven by polling (see ReceiverPoller). Subscriptions are renewed regularly.
+class RssiStreamReceiver {
+public:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	RssiStreamReceiver(uint32_t interval_us, uint16_t localPort = 0);
+	~RssiStreamReceiver();
+
+	RssiStreamReceiver(const RssiStreamReceiver &) = delete;
+	RssiStreamReceiver &operator=(const RssiStreamReceiver &) = delete;
+
+	// Adds a module to subscribe to. Its packets are identified by the last byte of its IP
+	// address (the module id), and their RSSI values are added to the given receiver.
+	void addReceiver(WiFiReceiver *receiver);
+
+	// Sends any subscriptions which are due. Must be called before each poll.
+	void update(time_point now);
+
+	socket_t socket() const {
+		return m_socket;
+	}
+
+	// Reads all waiting packets
+	void service(time_point now);
+
+	// The time by which update must next be called
+	time_point deadline() const {
+		return m_nextSubscription;
+	}
+
+	// Sends unsubscribe packets to all modules
+	void unsubscribe();
+
+	// The statistics of the i'th added module (safe to call from any thread)
+	RssiStreamStats stats(size_t i) const {
+		return m_modules[i]->published.load();
+	}
+
+private:
+	struct Module {
+		WiFiReceiver *receiver;
+		sockaddr_in address;
+		RssiStreamStats stats;
+		SeqLock<RssiStreamStats> published;
+
+		uint32_t firstSequence = 0; // of the first packet received (since the module last restarted)
+		uint32_t highestSequence = 0; // 0 before the first packet
+		uint32_t highestTimestamp_us = 0; // of the packet with the highest sequence
+		uint64_t received = 0; // bit i set if packet (highestSequence - i) has been received
+	};
+
+	uint32_t m_interval_us;
+	socket_t m_socket = cInvalidSocket;
+	std::vector<std::unique_ptr<Module>> m_modules;
+	std::vector<int> m_moduleIndices; // by module id (-1 if unknown)
+	time_point m_nextSubscription;
+
+	void subscribe(uint32_t interval_us);
+	void handlePacket(Module &module, const RssiPacket &packet, time_point now);
+};
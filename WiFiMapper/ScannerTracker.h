@@ -0,0 +1,252 @@
+/*
+ * The module responsible for tracking both markers of the Wi-Fi scanner as the ends
+ * of a rigid bar of known length, and estimating the position and orientation of the bar.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <cmath>
+
+#include "MarkerTracker.h"
+#include "DepthProjection.h"
+#include "TrackingEngine.h"
+
+
+// Returns the Euclidean distance between two positions
+inline float distanceBetween(cv::Point3f positionA, cv::Point3f positionB) {
+	cv::Point3f diff = positionB - positionA;
+	return std::sqrt(diff.dot(diff));
+}
+
+
+// The parameters describing the scanner and where its markers are initially found.
+// The defaults describe the scanner used with WiFiMapper (see WiFiMapper.h).
+struct ScannerTrackerConfig {
+	uint depthWidth = 512;
+	uint depthHeight = 424;
+	double depthVFov_deg = 60.0;
+	cv::Point2f initOriginA{ 512 / 3, 424 / 2 };
+	cv::Point2f initOriginB{ 2 * 512 / 3, 424 / 2 };
+	uint initDistance_mm = 750;
+	uint markerRadius_mm = 34;
+	float markerRadiusTolerance = 0.2f;
+	uint centerTolerance_px = 25;
+	float scannerLength_mm = 490;
+	float scannerLengthTolerance = 0.2f;
+};
+
+
+// The outcome of tracking both markers in a single depth frame
+struct ScannerResult {
+	MarkerTracker::RET_TYPE typeA = MarkerTracker::RET_TYPE::EMPTY;
+	MarkerTracker::RET_TYPE typeB = MarkerTracker::RET_TYPE::EMPTY;
+	cv::Point3f descA; // (px, px, mm)
+	cv::Point3f descB;
+	cv::Point3f positionA; // (mm, mm, mm), only set when valid
+	cv::Point3f positionB;
+	cv::Point3f center; // the midpoint of the scanner (mm, mm, mm), only set when valid
+	cv::Point3f direction; // the unit vector from A to B, only set when valid
+	bool valid = false; // true if the scanner's position is known (from both markers, or one and its recent orientation)
+	bool inferred = false; // true if one marker's position was inferred from the other's
+};
+
+
+// An object responsible for tracking the two markers of a Wi-Fi scanner
+class ScannerTracker {
+public:
+	ScannerTracker() = default;
+
+	ScannerTracker(const ScannerTracker &) = delete;
+	ScannerTracker &operator=(const ScannerTracker &) = delete;
+
+	// The projection is used to check marker separation, and must outlive the tracker. If a pool is given (which
+	// must also outlive the tracker), lost markers are searched for on its threads.
+	void init(const ScannerTrackerConfig &config, const DepthProjection *projection, TaskPool *pool = nullptr) {
+		m_config = config;
+		m_projection = projection;
+		m_scannerLengthMin_mm = config.scannerLength_mm * (1 - config.scannerLengthTolerance);
+		m_scannerLengthMax_mm = config.scannerLength_mm * (1 + config.scannerLengthTolerance);
+		m_hasPose = false;
+
+		m_trackerA.init(config.depthWidth, config.depthHeight, config.depthVFov_deg, config.initOriginA, config.initDistance_mm, config.markerRadius_mm, config.markerRadiusTolerance, config.centerTolerance_px);
+		m_trackerB.init(config.depthWidth, config.depthHeight, config.depthVFov_deg, config.initOriginB, config.initDistance_mm, config.markerRadius_mm, config.markerRadiusTolerance, config.centerTolerance_px);
+
+		m_engine.clear();
+		m_engine.setPool(pool);
+		m_engine.addTracker(&m_trackerA);
+		m_engine.addTracker(&m_trackerB);
+	}
+
+	// Tracks both markers in the given depth frame, given the time (in seconds) since the previous frame
+	ScannerResult update(const cv::Mat &depthFrame, double timeDiff) {
+		ScannerResult result;
+		std::pair<MarkerTracker::RET_TYPE, cv::Point3f> resultA;
+		std::pair<MarkerTracker::RET_TYPE, cv::Point3f> resultB;
+
+		bool isTrackingA = m_trackerA.markerEstimate().second > 0;
+		bool isTrackingB = m_trackerB.markerEstimate().second > 0;
+		bool isConstrained = isPoseRecent() && (isTrackingA || isTrackingB);
+
+		if (!isConstrained && (m_trackerA.isReacquiring() || m_trackerB.isReacquiring())) {
+			// Neither marker can be searched for relative to the other, so both (slow) searches are made at once
+			const std::vector<TrackingEngine::Result> &results = m_engine.update(depthFrame, timeDiff);
+			resultA = results[0];
+			resultB = results[1];
+		} else {
+			// The marker being tracked is found first (A, unless only B is being tracked), so that the other only needs
+			// to be searched for at the scanner's length from it (once the markers have been seen at that length, as
+			// they need not be while being presented). Neither can be reacquired where the other is.
+			bool isBFirst = !isTrackingA && isTrackingB;
+			MarkerTracker &first = isBFirst ? m_trackerB : m_trackerA;
+			MarkerTracker &second = isBFirst ? m_trackerA : m_trackerB;
+
+			excludeMarker(second, first);
+			std::pair<MarkerTracker::RET_TYPE, cv::Point3f> firstResult = first.update(depthFrame, timeDiff);
+			excludeMarker(first, second);
+			if (firstResult.first == MarkerTracker::RET_TYPE::TRACKING && isPoseRecent()) {
+				second.constrainDistance(m_projection, m_projection->desc2Pos(firstResult.second), m_scannerLengthMin_mm, m_scannerLengthMax_mm);
+			}
+			std::pair<MarkerTracker::RET_TYPE, cv::Point3f> secondResult = second.update(depthFrame, timeDiff);
+
+			resultA = isBFirst ? secondResult : firstResult;
+			resultB = isBFirst ? firstResult : secondResult;
+		}
+
+		result.typeA = resultA.first;
+		result.typeB = resultB.first;
+		result.descA = resultA.second;
+		result.descB = resultB.second;
+
+		bool isTrackedA = resultA.first == MarkerTracker::RET_TYPE::TRACKING;
+		bool isTrackedB = resultB.first == MarkerTracker::RET_TYPE::TRACKING;
+		cv::Point3f positionA = isTrackedA ? m_projection->desc2Pos(resultA.second) : cv::Point3f();
+		cv::Point3f positionB = isTrackedB ? m_projection->desc2Pos(resultB.second) : cv::Point3f();
+		m_timeSincePose_s += timeDiff;
+
+		if (isTrackedA && isTrackedB) {
+			float distance_mm = distanceBetween(positionA, positionB);
+			if (distance_mm >= m_scannerLengthMin_mm && distance_mm <= m_scannerLengthMax_mm) {
+				fitPose(positionA, positionB);
+				setPose(result, false);
+				return result;
+			}
+
+			// One of the markers is wrong (eg: its depth includes the background), so keep whichever is nearer to
+			// where it was last
+			if (isPoseRecent()) {
+				float errorA_mm = distanceBetween(positionA, m_positionA);
+				float errorB_mm = distanceBetween(positionB, m_positionB);
+				isTrackedA = errorA_mm <= errorB_mm && errorA_mm <= m_scannerLengthMax_mm - m_scannerLengthMin_mm;
+				isTrackedB = errorB_mm < errorA_mm && errorB_mm <= m_scannerLengthMax_mm - m_scannerLengthMin_mm;
+			}
+		}
+
+		// With only one marker, the other is (briefly) assumed to be at the scanner's length along its recent orientation
+		if ((isTrackedA != isTrackedB) && isPoseRecent()) {
+			cv::Point3f direction = predictDirection();
+			if (isTrackedA) {
+				inferPose(positionA, positionA + direction * m_config.scannerLength_mm);
+			} else {
+				inferPose(positionB - direction * m_config.scannerLength_mm, positionB);
+			}
+			setPose(result, true);
+		}
+
+		return result;
+	}
+
+	const ScannerTrackerConfig &config() const {
+		return m_config;
+	}
+
+	const MarkerTracker &trackerA() const {
+		return m_trackerA;
+	}
+
+	const MarkerTracker &trackerB() const {
+		return m_trackerB;
+	}
+
+private:
+	ScannerTrackerConfig m_config;
+	const DepthProjection *m_projection = nullptr;
+	float m_scannerLengthMin_mm;
+	float m_scannerLengthMax_mm;
+	MarkerTracker m_trackerA;
+	MarkerTracker m_trackerB;
+	TrackingEngine m_engine; // (of both trackers)
+
+	// The most recent pose of the scanner: its ends, orientation (unit vector from A to B) and the rate at which the
+	// orientation was changing (per second), and the time since it was last measured with both markers
+	cv::Point3f m_positionA;
+	cv::Point3f m_positionB;
+	cv::Point3f m_direction;
+	cv::Point3f m_directionRate;
+	double m_timeSincePose_s = 0;
+	uint m_measuredPoses = 0; // (consecutive, with at most cMaxInferredTime_s between them)
+	bool m_hasPose = false;
+
+	// The longest a marker's position is inferred from the other's (the orientation is extrapolated meanwhile)
+	const double cMaxInferredTime_s = 0.25;
+
+	// The weight of each new measurement of the orientation's rate of change
+	const float cDirectionRateSmoothing = 0.3f;
+
+	bool isPoseRecent() const {
+		return m_hasPose && m_timeSincePose_s <= cMaxInferredTime_s;
+	}
+
+	// The orientation of the scanner now, extrapolated from the most recent measurement
+	cv::Point3f predictDirection() const {
+		cv::Point3f direction = m_direction + m_directionRate * (float)m_timeSincePose_s;
+		return direction / std::sqrt(direction.dot(direction));
+	}
+
+	// Fits a rigid bar of the scanner's length to the measured positions of its ends (keeping their midpoint
+	// and direction), and updates the rate at which the orientation is changing
+	void fitPose(cv::Point3f positionA, cv::Point3f positionB) {
+		cv::Point3f center = (positionA + positionB) * 0.5f;
+		cv::Point3f direction = (positionB - positionA) / distanceBetween(positionA, positionB);
+
+		if (isPoseRecent() && m_timeSincePose_s > 0) {
+			cv::Point3f rate = (direction - m_direction) / (float)m_timeSincePose_s;
+			m_directionRate = m_measuredPoses > 1 ? m_directionRate + (rate - m_directionRate) * cDirectionRateSmoothing : rate;
+			m_measuredPoses++;
+		} else {
+			m_directionRate = cv::Point3f();
+			m_measuredPoses = 1;
+		}
+
+		m_direction = direction;
+		m_positionA = center - direction * (m_config.scannerLength_mm / 2);
+		m_positionB = center + direction * (m_config.scannerLength_mm / 2);
+		m_timeSincePose_s = 0;
+		m_hasPose = true;
+	}
+
+	// Records a pose with an inferred end (which leaves the time since the orientation was measured unchanged)
+	void inferPose(cv::Point3f positionA, cv::Point3f positionB) {
+		m_positionA = positionA;
+		m_positionB = positionB;
+	}
+
+	void setPose(ScannerResult &result, bool inferred) const {
+		result.positionA = m_positionA;
+		result.positionB = m_positionB;
+		result.center = (m_positionA + m_positionB) * 0.5f;
+		result.direction = (m_positionB - m_positionA) / m_config.scannerLength_mm;
+		result.valid = true;
+		result.inferred = inferred;
+	}
+
+	// Prevents the given tracker from reacquiring its marker where the other tracker's marker is
+	static void excludeMarker(const MarkerTracker &other, MarkerTracker &tracker) {
+		std::pair<cv::Point2f, float> marker = other.markerEstimate();
+		if (marker.second > 0) {
+			tracker.excludeRegion(marker.first, marker.second);
+		}
+	}
+};
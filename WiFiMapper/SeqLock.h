@@ -0,0 +1,77 @@
+/*
+ * A lock-free container for publishing a value from one thread to any number
+ * of readers (a sequence lock).
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+
+// Holds the most recently stored value. Only one thread may call store, and load
+// never blocks the writer (a reader retries if the value changes while it is read).
+template <typename T>
+class SeqLock {
+	static_assert(std::is_trivially_copyable<T>::value, "SeqLock values are copied word by word");
+
+public:
+	SeqLock() {
+		store(T());
+	}
+
+	SeqLock(const SeqLock &) = delete;
+	SeqLock &operator=(const SeqLock &) = delete;
+
+	void store(const T &value) {
+		uint64_t words[cWordCount] = { 0 };
+		memcpy(words, &value, sizeof(T));
+
+		// An odd sequence number marks the value as being written
+		uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+		m_sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		for (size_t i = 0; i < cWordCount; i++) {
+			m_words[i].store(words[i], std::memory_order_relaxed);
+		}
+
+		m_sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	T load() const {
+		uint64_t words[cWordCount];
+		uint64_t before, after;
+
+		do {
+			before = m_sequence.load(std::memory_order_acquire);
+			while (before & 1) {
+				std::this_thread::yield();
+				before = m_sequence.load(std::memory_order_acquire);
+			}
+
+			for (size_t i = 0; i < cWordCount; i++) {
+				words[i] = m_words[i].load(std::memory_order_relaxed);
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			after = m_sequence.load(std::memory_order_relaxed);
+		} while (before != after);
+
+		T value;
+		memcpy(&value, words, sizeof(T));
+		return value;
+	}
+
+private:
+	static const size_t cWordCount = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+	std::atomic<uint64_t> m_sequence{ 0 };
+	std::array<std::atomic<uint64_t>, cWordCount> m_words;
+};
@@ -0,0 +1,313 @@
+/*
+ * The module responsible for recording a session's Wi-Fi point cloud to an append-only
+ * log as it is collected (on a background thread), and converting logs to PCD files,
+ * including logs left behind by a session which did not finish.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PointCloud.h"
+
+// Session log file layout (all values little-endian):
+//   header: magic "WMSL", uint32 version
+//   batches: uint32 point count, uint32 checksum (of the points), then each point as float x, y, z and uint32 rgb
+// A batch is only complete once all of it has been written, so a log ends with any number of complete batches,
+// and possibly part of one (if the program stopped while writing it), which is ignored when the log is read.
+
+#pragma pack(push, 1)
+struct SessionLogHeader {
+	char magic[4];
+	uint32_t version;
+};
+
+struct SessionLogBatchHeader {
+	uint32_t pointCount;
+	uint32_t checksum;
+};
+#pragma pack(pop)
+
+static const char cSessionLogMagic[4] = { 'W', 'M', 'S', 'L' };
+static const uint32_t cSessionLogVersion = 1;
+static const size_t cSessionLogPointSize = 4 * sizeof(uint32_t);
+static const size_t cSessionLogMaxBatch = 4096; // (points)
+
+
+// The FNV-1a hash of the given bytes
+inline uint32_t sessionLogChecksum(const void *data, size_t size) {
+	const uint8_t *bytes = static_cast<const uint8_t*>(data);
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+
+// Appends points to a session log. Points are added to a queue, which a background thread writes to the log in
+// batches (at least once every flush interval), so that adding points never waits for the file.
+class SessionLogWriter {
+public:
+	SessionLogWriter(const std::string &filename, std::chrono::milliseconds flushInterval = std::chrono::milliseconds(500))
+		: m_outFile(filename, std::ios::binary), m_flushInterval(flushInterval) {
+		if (!m_outFile) {
+			throw std::runtime_error("Unable to open \"" + filename + "\" for writing");
+		}
+
+		SessionLogHeader header;
+		std::memcpy(header.magic, cSessionLogMagic, sizeof(header.magic));
+		header.version = cSessionLogVersion;
+		m_outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		m_outFile.flush();
+
+		m_pending.reserve(cSessionLogMaxBatch);
+		m_encoded.reserve(cSessionLogMaxBatch * 4);
+		m_thread = std::thread(&SessionLogWriter::run, this);
+	}
+
+	~SessionLogWriter() {
+		close();
+	}
+
+	SessionLogWriter(const SessionLogWriter &) = delete;
+	SessionLogWriter &operator=(const SessionLogWriter &) = delete;
+
+	// Queues a point at the given position, with the given colour values
+	void addPoint(cv::Point3f point, UINT8 r, UINT8 g, UINT8 b) {
+		bool batchFull;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_closing) {
+				return;
+			}
+
+			m_pending.push_back({ point.x, point.y, point.z, r, g, b });
+			batchFull = m_pending.size() == cSessionLogMaxBatch;
+		}
+
+		if (batchFull) {
+			m_wake.notify_one();
+		}
+	}
+
+	// Writes the queued points and closes the log
+	void close() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closing = true;
+		}
+
+		m_wake.notify_one();
+		if (m_thread.joinable()) {
+			m_thread.join();
+		}
+		m_outFile.close();
+	}
+
+	// The number of points written to the log so far
+	uint64_t pointCount() const {
+		return m_pointCount;
+	}
+
+	// True if the log could not be written (the points added since are held by the writer instead)
+	bool failed() const {
+		return m_failed;
+	}
+
+	// Takes the points which could not be written to the log, in the order they were added (once closed)
+	std::vector<ColoredPoint> takeUnwritten() {
+		return std::move(m_unwritten);
+	}
+
+private:
+	std::ofstream m_outFile;
+	std::chrono::milliseconds m_flushInterval;
+	std::atomic<uint64_t> m_pointCount{ 0 };
+	std::atomic<bool> m_failed{ false };
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::vector<ColoredPoint> m_pending; // (guarded by m_mutex)
+	bool m_closing = false; // (guarded by m_mutex)
+
+	std::vector<uint32_t> m_encoded; // (used only by the background thread)
+	std::vector<ColoredPoint> m_unwritten; // (used only by the background thread, until it has stopped)
+	std::thread m_thread;
+
+	void run() {
+		std::vector<ColoredPoint> writing;
+		writing.reserve(cSessionLogMaxBatch);
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true) {
+			m_wake.wait_for(lock, m_flushInterval, [this] { return m_closing || m_pending.size() >= cSessionLogMaxBatch; });
+
+			writing.swap(m_pending);
+			bool closing = m_closing;
+			lock.unlock();
+
+			for (size_t start = 0; start < writing.size(); start += cSessionLogMaxBatch) {
+				size_t count = writing.size() - start < cSessionLogMaxBatch ? writing.size() - start : cSessionLogMaxBatch;
+				writeBatch(writing.data() + start, count);
+			}
+
+			// (each batch reaches the operating system before the next is queued, so it is kept if the program stops)
+			if (!writing.empty() && !m_failed) {
+				m_outFile.flush();
+			}
+			writing.clear();
+
+			lock.lock();
+			if (closing) {
+				break;
+			}
+		}
+	}
+
+	void writeBatch(const ColoredPoint *points, size_t count) {
+		if (m_failed) {
+			m_unwritten.insert(m_unwritten.end(), points, points + count);
+			return;
+		}
+
+		m_encoded.clear();
+		for (size_t i = 0; i < count; i++) {
+			const ColoredPoint &p = points[i];
+			uint32_t fields[4] = { 0, 0, 0, ((uint32_t)p.r << 16) | ((uint32_t)p.g << 8) | p.b };
+			std::memcpy(fields, &p.x, 3 * sizeof(float));
+			m_encoded.insert(m_encoded.end(), fields, fields + 4);
+		}
+
+		SessionLogBatchHeader header{ (uint32_t)count, sessionLogChecksum(m_encoded.data(), count * cSessionLogPointSize) };
+		m_outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		m_outFile.write(reinterpret_cast<const char*>(m_encoded.data()), count * cSessionLogPointSize);
+
+		if (!m_outFile) {
+			// (the log ends with this batch, or part of it, which is ignored when the log is read)
+			m_failed = true;
+			m_unwritten.insert(m_unwritten.end(), points, points + count);
+			std::cerr << "Unable to write to the session log, later points will be held in memory\n";
+			return;
+		}
+
+		m_pointCount += count;
+	}
+};
+
+
+// Reads the complete batches of a session log
+class SessionLogReader {
+public:
+	// Opens the given log, and finds its complete batches. Throws if it is not a session log.
+	explicit SessionLogReader(const std::string &filename) : m_inFile(filename, std::ios::binary) {
+		SessionLogHeader header;
+		if (!m_inFile.read(reinterpret_cast<char*>(&header), sizeof(header))
+			|| std::memcmp(header.magic, cSessionLogMagic, sizeof(header.magic)) != 0 || header.version != cSessionLogVersion) {
+			throw std::runtime_error("\"" + filename + "\" is not a session log");
+		}
+
+		m_encoded.reserve(cSessionLogMaxBatch * 4);
+		m_dataStart = m_inFile.tellg();
+		m_dataEnd = m_dataStart;
+
+		size_t count;
+		while (readBatch(count)) {
+			m_pointCount += count;
+			m_dataEnd = m_inFile.tellg();
+		}
+
+		m_inFile.clear();
+		m_inFile.seekg(0, std::ios::end);
+		m_truncated = m_inFile.tellg() != m_dataEnd;
+	}
+
+	// The number of points in the log's complete batches
+	size_t pointCount() const {
+		return m_pointCount;
+	}
+
+	// True if the log ends with an incomplete (or corrupt) batch, which has been left out
+	bool truncated() const {
+		return m_truncated;
+	}
+
+	// Passes the points of each complete batch, in order, to the given function (as a PointChunkSource)
+	void forEachChunk(const PointChunkHandler &handleChunk) {
+		m_inFile.clear();
+		m_inFile.seekg(m_dataStart);
+
+		std::vector<ColoredPoint> points;
+		size_t count;
+		while (m_inFile.tellg() < m_dataEnd && readBatch(count)) {
+			points.resize(count);
+			for (size_t i = 0; i < count; i++) {
+				const uint32_t *fields = &m_encoded[4 * i];
+				ColoredPoint &p = points[i];
+				std::memcpy(&p.x, fields, 3 * sizeof(float));
+				p.r = (UINT8)(fields[3] >> 16);
+				p.g = (UINT8)(fields[3] >> 8);
+				p.b = (UINT8)fields[3];
+			}
+			handleChunk(points.data(), count);
+		}
+	}
+
+private:
+	std::ifstream m_inFile;
+	std::streampos m_dataStart;
+	std::streampos m_dataEnd; // the end of the last complete batch
+	size_t m_pointCount = 0;
+	bool m_truncated = false;
+	std::vector<uint32_t> m_encoded; // the encoded points of the batch last read
+
+	// Reads the next batch into m_encoded (returning false if it is incomplete)
+	bool readBatch(size_t &count) {
+		SessionLogBatchHeader header;
+		if (!m_inFile.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.pointCount > cSessionLogMaxBatch) {
+			return false;
+		}
+
+		count = header.pointCount;
+		m_encoded.resize(4 * count);
+		return m_inFile.read(reinterpret_cast<char*>(m_encoded.data()), count * cSessionLogPointSize)
+			&& sessionLogChecksum(m_encoded.data(), count * cSessionLogPointSize) == header.checksum;
+	}
+};
+
+
+// Writes the points of the given session log to a PCD file (without holding them all in memory), then deletes
+// the log. Returns the number of points written. Throws (keeping the log) if either file cannot be used.
+inline size_t finalizeSessionLog(const std::string &logFilename, const std::string &pcdFilename, PcdFormat format) {
+	size_t count;
+	{
+		SessionLogReader reader(logFilename);
+		if (reader.truncated()) {
+			std::cerr << "\"" << logFilename << "\" ends with an incomplete batch of points, which has been left out\n";
+		}
+
+		count = reader.pointCount();
+		PcdWriter::write(pcdFilename, count, format, [&reader](const PointChunkHandler &handleChunk) {
+			reader.forEachChunk(handleChunk);
+		});
+	}
+
+	std::remove(logFilename.c_str());
+	return count;
+}
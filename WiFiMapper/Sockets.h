@@ -0,0 +1,106 @@
+/*
+ * Platform shims for the BSD socket functions used to communicate with the ESP8266 modules.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#pragma comment (lib, "ws2_32.lib")
+
+typedef SOCKET socket_t;
+static const socket_t cInvalidSocket = INVALID_SOCKET;
+static const int cSendFlags = 0;
+
+inline void closeSocket(socket_t socket) {
+	closesocket(socket);
+}
+
+// Starts Winsock (once per process)
+inline bool initSockets() {
+	static bool initialised = false;
+	if (!initialised) {
+		WSADATA wsaData;
+		initialised = WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+	}
+	return initialised;
+}
+
+inline int lastSocketError() {
+	return WSAGetLastError();
+}
+
+// Returns true if the given error means that a non-blocking operation could not complete yet
+inline bool isInProgressError(int error) {
+	return error == WSAEWOULDBLOCK || error == WSAEINPROGRESS;
+}
+
+inline bool setSocketNonBlocking(socket_t socket) {
+	u_long enable = 1;
+	return ioctlsocket(socket, FIONBIO, &enable) == 0;
+}
+
+inline int pollSockets(pollfd *sockets, size_t socketCount, int timeout_ms) {
+	return WSAPoll(sockets, (ULONG)socketCount, timeout_ms);
+}
+#else
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef int socket_t;
+static const socket_t cInvalidSocket = -1;
+static const int cSendFlags = MSG_NOSIGNAL; // report closed connections as errors rather than signals
+
+inline void closeSocket(socket_t socket) {
+	close(socket);
+}
+
+inline bool initSockets() {
+	return true;
+}
+
+inline int lastSocketError() {
+	return errno;
+}
+
+// Returns true if the given error means that a non-blocking operation could not complete yet
+inline bool isInProgressError(int error) {
+	return error == EWOULDBLOCK || error == EAGAIN || error == EINPROGRESS;
+}
+
+inline bool setSocketNonBlocking(socket_t socket) {
+	int flags = fcntl(socket, F_GETFL, 0);
+	return flags != -1 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+inline int pollSockets(pollfd *sockets, size_t socketCount, int timeout_ms) {
+	return poll(sockets, (nfds_t)socketCount, timeout_ms);
+}
+#endif
+
+
+// Returns (and clears) the error of a socket, eg: the result of a non-blocking connect
+inline int takeSocketError(socket_t socket) {
+	int error = 0;
+	socklen_t length = sizeof(error);
+	getsockopt(socket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &length);
+	return error;
+}
+
+// Disables Nagle's algorithm, so that small requests are sent immediately
+inline void setSocketNoDelay(socket_t socket) {
+	int enable = 1;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&enable), sizeof(enable));
+}
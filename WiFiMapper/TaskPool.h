@@ -0,0 +1,123 @@
+/*
+ * The module responsible for running the tasks of a parallel loop on a small pool of
+ * threads (shared by the marker trackers and the point cloud builder).
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// A fixed set of worker threads which share the tasks of each call to run with the calling thread
+class TaskPool {
+public:
+	// Starts the given number of threads in total, including the calling thread (0: one per core)
+	explicit TaskPool(size_t threadCount = 0) {
+		if (threadCount == 0) {
+			threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+		}
+
+		for (size_t i = 1; i < threadCount; i++) {
+			m_workers.emplace_back(&TaskPool::work, this);
+		}
+	}
+
+	~TaskPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_started.notify_all();
+
+		for (std::thread &worker : m_workers) {
+			worker.join();
+		}
+	}
+
+	TaskPool(const TaskPool &) = delete;
+	TaskPool &operator=(const TaskPool &) = delete;
+
+	// The number of threads which run tasks (including the calling thread)
+	size_t threadCount() const {
+		return m_workers.size() + 1;
+	}
+
+	// Calls task(i) for each i in [0, taskCount), in any order and on any of the threads, returning once all have
+	// finished. Tasks must not throw. Only one thread may call run at a time.
+	void run(size_t taskCount, const std::function<void(size_t)> &task) {
+		if (taskCount <= 1 || m_workers.empty()) {
+			for (size_t i = 0; i < taskCount; i++) {
+				task(i);
+			}
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_task = &task;
+			m_taskCount = taskCount;
+			m_nextTask = 0;
+			m_busyWorkers = m_workers.size();
+			m_generation++;
+		}
+		m_started.notify_all();
+
+		runTasks();
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_finished.wait(lock, [this] { return m_busyWorkers == 0; });
+		m_task = nullptr;
+	}
+
+private:
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_started;
+	std::condition_variable m_finished;
+
+	// The current call to run (guarded by m_mutex, apart from m_nextTask)
+	const std::function<void(size_t)> *m_task = nullptr;
+	size_t m_taskCount = 0;
+	std::atomic<size_t> m_nextTask{ 0 };
+	size_t m_busyWorkers = 0;
+	uint64_t m_generation = 0;
+	bool m_stopping = false;
+
+	void work() {
+		uint64_t generation = 0;
+
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_started.wait(lock, [&] { return m_stopping || m_generation != generation; });
+				if (m_stopping) {
+					return;
+				}
+				generation = m_generation;
+			}
+
+			runTasks();
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_busyWorkers == 0) {
+				m_finished.notify_one();
+			}
+		}
+	}
+
+	// Takes tasks until there are none left
+	void runTasks() {
+		for (size_t i = m_nextTask++; i < m_taskCount; i = m_nextTask++) {
+			(*m_task)(i);
+		}
+	}
+};
@@ -0,0 +1,318 @@
+/*
+ * A program which measures the accuracy and speed of the marker trackers over a
+ * reproducible synthetic session: both of the scanner's markers swept along scripted
+ * paths in front of a cluttered room, as seen by a noisy depth sensor.
+ *
+ * Written by Marc Katzef
+ */
+
+#include "Portability.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "DepthProjection.h"
+#include "DepthSource.h"
+#include "ScannerTracker.h"
+#include "TrackingEngine.h"
+
+using namespace std;
+
+// The time (s) for which the markers are held at their initialisation positions, and then taken to the scanner's length
+static const double cPresentTime_s = 1.5;
+static const double cExtendTime_s = 1.0;
+
+
+// Prints command line usage
+void printUsage(const char *programName) {
+	cerr << "Usage: " << programName << " [options]\n"
+		"Options:\n"
+		"  --frames <count>      the length of the session (default 900, 30 s)\n"
+		"  --speed <factor>      the speed of the sweeps, relative to a slow hand movement (default 1)\n"
+		"  --noise <mm>          the depth noise at 1 m (default 1.5)\n"
+		"  --holes <fraction>    the fraction of pixels without a depth (default 0.005)\n"
+		"  --edge-holes <fraction> the fraction of pixels along silhouettes without a depth (default 0.3)\n"
+		"  --clutter <count>     the number of boxes and spheres placed around the room (default 8)\n"
+		"  --seed <number>       the seed of the scene's clutter and noise (default 1)\n"
+		"  --csv <file>          write per-frame results (and ground truth) to the given file\n"
+		"  --max-p99 <ms>        fail if the 99th percentile frame latency is above the given time\n"
+		"  --max-error <mm>      fail if the mean position error of either marker is above the given distance\n"
+		"  --max-lock-losses <count> fail if the markers lose track more than the given number of times\n";
+}
+
+
+// Returns the value at the given proportion through the sorted values
+double percentile(const vector<double> &sorted, double proportion) {
+	if (sorted.empty()) {
+		return 0;
+	}
+
+	return sorted[min(sorted.size() - 1, (size_t)(proportion * sorted.size()))];
+}
+
+
+// The nearest point of a sphere to the camera (what the tracker measures: the depth of its centre pixels)
+cv::Point3f nearestPoint(cv::Point3f center, float radius_mm) {
+	return center - center * (radius_mm / sqrt(center.dot(center)));
+}
+
+
+// A session in which the markers are presented at their initialisation positions, then held at the
+// scanner's length and swept (and turned) around the room, with static boxes and spheres around them
+SyntheticDepthSource *makeBenchmarkScene(const ScannerTrackerConfig &config, size_t frameCount, double speed, size_t clutterCount, const SyntheticSensorModel &sensor) {
+	const double frameRate = 30;
+	DepthProjection projection;
+	projection.setPinhole(config.depthWidth, config.depthHeight, config.depthVFov_deg);
+
+	cv::Point3f startA = projection.desc2Pos({ config.initOriginA.x, config.initOriginA.y, (float)config.initDistance_mm });
+	cv::Point3f startB = projection.desc2Pos({ config.initOriginB.x, config.initOriginB.y, (float)config.initDistance_mm });
+	cv::Point3f center = startA + cv::Point3f{ config.scannerLength_mm / 2, 0, 0 };
+
+	SyntheticMarker markerA;
+	SyntheticMarker markerB;
+	markerA.waypoints = { { 0.0, startA }, { cPresentTime_s, startA } };
+	markerB.waypoints = { { 0.0, startB }, { cPresentTime_s, startB } };
+
+	// (The sweep starts from rest with the markers at the scanner's length, in line with the initial positions.)
+	// The scanner's centre follows a Lissajous curve (at most 1.5 m from the camera) while it turns about two axes
+	double sweepStart_s = cPresentTime_s + cExtendTime_s;
+	for (size_t frame = (size_t)(sweepStart_s * frameRate); frame < frameCount; frame++) {
+		double time_s = frame / frameRate;
+		double phase = (time_s - sweepStart_s) * speed;
+		double ramp = min(phase, 1.0); // (starting from rest)
+
+		cv::Point3f offset{ (float)(200 * sin(0.9 * phase)), (float)(100 * sin(1.3 * phase)), (float)(350 * (1 - cos(0.6 * phase))) };
+		double yaw = ramp * 0.6 * sin(0.7 * phase);
+		double pitch = ramp * 0.3 * sin(1.1 * phase);
+		cv::Point3f direction{ (float)(cos(yaw) * cos(pitch)), (float)sin(pitch), (float)(sin(yaw) * cos(pitch)) };
+		cv::Point3f halfLength = direction * (config.scannerLength_mm / 2);
+
+		markerA.waypoints.push_back({ time_s, center + offset * (float)ramp - halfLength });
+		markerB.waypoints.push_back({ time_s, center + offset * (float)ramp + halfLength });
+	}
+
+	// Clutter away from the swept region: boxes (eg: furniture) and spheres of other sizes (eg: lamps, heads)
+	mt19937 random(sensor.seed);
+	uniform_real_distribution<float> unit(0, 1);
+	vector<SyntheticMarker> spheres = { markerA, markerB };
+	vector<SyntheticBox> boxes;
+	for (size_t i = 0; i < clutterCount; i++) {
+		float depth_mm = 1700 + 700 * unit(random);
+		float x_mm = (unit(random) - 0.5f) * 2 * depth_mm * 0.7f;
+		float y_mm = (unit(random) - 0.5f) * 2 * depth_mm * 0.5f;
+
+		if (i % 2 == 0) {
+			float width_mm = 200 + 500 * unit(random);
+			float height_mm = 200 + 800 * unit(random);
+			boxes.push_back({ { x_mm, y_mm, depth_mm }, { x_mm + width_mm, y_mm + height_mm, depth_mm + 400 } });
+		} else {
+			SyntheticMarker sphere;
+			sphere.radius_mm = 60 + 60 * unit(random);
+			sphere.waypoints = { { 0.0, { x_mm, y_mm, depth_mm } } };
+			spheres.push_back(sphere);
+		}
+	}
+
+	SyntheticDepthSource *source = new SyntheticDepthSource(config.depthWidth, config.depthHeight, config.depthVFov_deg, (float)config.markerRadius_mm, spheres, frameCount, 2500, frameRate);
+	for (const SyntheticBox &box : boxes) {
+		source->addBox(box);
+	}
+	source->setSensorModel(sensor);
+	return source;
+}
+
+
+// The accuracy of one marker's tracker over a session
+struct MarkerStats {
+	size_t trackedFrames = 0;
+	size_t lockLosses = 0; // the number of times the tracker lost the marker after tracking it
+	size_t firstLock = 0; // the first frame in which the marker was tracked
+	vector<double> errors_mm; // (for each tracked frame)
+	double pixelErrorSum = 0;
+};
+
+
+int main(int argc, char **argv) {
+	size_t frameCount = 900;
+	double speed = 1;
+	size_t clutterCount = 8;
+	string csvName;
+	double maxP99_ms = -1;
+	double maxError_mm = -1;
+	long maxLockLosses = -1;
+
+	SyntheticSensorModel sensor;
+	sensor.depthNoise_mm = 1.5f;
+	sensor.holeFraction = 0.005f;
+	sensor.edgeHoleFraction = 0.3f;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--frames" && hasValue) {
+			frameCount = strtoul(argv[++i], NULL, 10);
+		} else if (arg == "--speed" && hasValue) {
+			speed = atof(argv[++i]);
+		} else if (arg == "--noise" && hasValue) {
+			sensor.depthNoise_mm = (float)atof(argv[++i]);
+		} else if (arg == "--holes" && hasValue) {
+			sensor.holeFraction = (float)atof(argv[++i]);
+		} else if (arg == "--edge-holes" && hasValue) {
+			sensor.edgeHoleFraction = (float)atof(argv[++i]);
+		} else if (arg == "--clutter" && hasValue) {
+			clutterCount = strtoul(argv[++i], NULL, 10);
+		} else if (arg == "--seed" && hasValue) {
+			sensor.seed = strtoul(argv[++i], NULL, 10);
+		} else if (arg == "--csv" && hasValue) {
+			csvName = argv[++i];
+		} else if (arg == "--max-p99" && hasValue) {
+			maxP99_ms = atof(argv[++i]);
+		} else if (arg == "--max-error" && hasValue) {
+			maxError_mm = atof(argv[++i]);
+		} else if (arg == "--max-lock-losses" && hasValue) {
+			maxLockLosses = strtol(argv[++i], NULL, 10);
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (frameCount == 0) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	ScannerTrackerConfig config;
+	DepthProjection projection;
+	projection.setPinhole(config.depthWidth, config.depthHeight, config.depthVFov_deg);
+	unique_ptr<SyntheticDepthSource> source(makeBenchmarkScene(config, frameCount, speed, clutterCount, sensor));
+
+	// Each marker is tracked independently (as MarkerTracker::update sees it), sharing only the exclusion of each other
+	const size_t markerCount = 2;
+	MarkerTracker trackers[markerCount];
+	trackers[0].init(config.depthWidth, config.depthHeight, config.depthVFov_deg, config.initOriginA, config.initDistance_mm, config.markerRadius_mm, config.markerRadiusTolerance, config.centerTolerance_px);
+	trackers[1].init(config.depthWidth, config.depthHeight, config.depthVFov_deg, config.initOriginB, config.initDistance_mm, config.markerRadius_mm, config.markerRadiusTolerance, config.centerTolerance_px);
+	TrackingEngine engine;
+	for (MarkerTracker &tracker : trackers) {
+		engine.addTracker(&tracker);
+	}
+
+	ofstream csvFile;
+	if (!csvName.empty()) {
+		csvFile.open(csvName);
+		csvFile << "frame,latency_ms";
+		for (size_t m = 0; m < markerCount; m++) {
+			csvFile << ",state_" << m << ",x_" << m << ",y_" << m << ",depth_" << m << ",true_x_" << m << ",true_y_" << m << ",true_depth_" << m << ",error_mm_" << m;
+		}
+		csvFile << "\n";
+	}
+
+	MarkerStats stats[markerCount];
+	bool wasTracking[markerCount] = { false, false };
+	vector<double> latencies_ms;
+	latencies_ms.reserve(frameCount);
+	int64_t lastTimestamp = 0;
+
+	DepthFrame frame;
+	size_t frameIndex = 0;
+	while (source->acquireFrame(frame)) {
+		double dt = (double)(frame.timestamp - lastTimestamp) / cDepthTicksPerSecond;
+		lastTimestamp = frame.timestamp;
+		cv::Mat depthFrame(frame.height, frame.width, CV_16UC1, const_cast<UINT16*>(frame.data));
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		const vector<TrackingEngine::Result> &results = engine.update(depthFrame, dt);
+		double latency_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		latencies_ms.push_back(latency_ms);
+
+		if (csvFile.is_open()) {
+			csvFile << frameIndex << "," << latency_ms;
+		}
+
+		for (size_t m = 0; m < markerCount; m++) {
+			MarkerStats &markerStats = stats[m];
+			cv::Point3f truth = nearestPoint(source->markerPosition(m), (float)config.markerRadius_mm);
+			cv::Point2f truthPx = projection.pos2Pixel(truth);
+			double error_mm = -1;
+
+			if (results[m].first == MarkerTracker::RET_TYPE::TRACKING) {
+				cv::Point3f position = projection.desc2Pos(results[m].second);
+				cv::Point2f pixelError = cv::Point2f(results[m].second.x, results[m].second.y) - truthPx;
+				error_mm = distanceBetween(position, truth);
+
+				if (markerStats.trackedFrames == 0) {
+					markerStats.firstLock = frameIndex;
+				}
+				markerStats.trackedFrames++;
+				markerStats.errors_mm.push_back(error_mm);
+				markerStats.pixelErrorSum += sqrt(pixelError.dot(pixelError));
+			}
+
+			bool isTracking = trackers[m].markerEstimate().second > 0;
+			if (wasTracking[m] && !isTracking) {
+				markerStats.lockLosses++;
+			}
+			wasTracking[m] = isTracking;
+
+			if (csvFile.is_open()) {
+				csvFile << "," << (int)results[m].first << "," << results[m].second.x << "," << results[m].second.y << "," << results[m].second.z
+					<< "," << truthPx.x << "," << truthPx.y << "," << truth.z << "," << error_mm;
+			}
+		}
+
+		if (csvFile.is_open()) {
+			csvFile << "\n";
+		}
+		frameIndex++;
+	}
+
+	sort(latencies_ms.begin(), latencies_ms.end());
+	double p99_ms = percentile(latencies_ms, 0.99);
+	cout << "Frames: " << frameIndex << " (speed " << speed << ", noise " << sensor.depthNoise_mm << " mm, holes " << sensor.holeFraction
+		<< ", edge holes " << sensor.edgeHoleFraction << ", clutter " << clutterCount << ", seed " << sensor.seed << ")\n"
+		<< "Frame latency (ms): p50 " << percentile(latencies_ms, 0.5) << ", p90 " << percentile(latencies_ms, 0.9)
+		<< ", p99 " << p99_ms << ", max " << latencies_ms.back() << "\n";
+
+	bool passed = maxP99_ms < 0 || p99_ms <= maxP99_ms;
+	size_t lockLosses = 0;
+	for (size_t m = 0; m < markerCount; m++) {
+		MarkerStats &markerStats = stats[m];
+		lockLosses += markerStats.lockLosses;
+
+		double meanError_mm = 0;
+		for (double error_mm : markerStats.errors_mm) {
+			meanError_mm += error_mm;
+		}
+		meanError_mm = markerStats.trackedFrames > 0 ? meanError_mm / markerStats.trackedFrames : 0;
+		sort(markerStats.errors_mm.begin(), markerStats.errors_mm.end());
+
+		size_t framesAfterLock = markerStats.trackedFrames > 0 ? frameIndex - markerStats.firstLock : 0;
+		cout << "Marker " << (char)('A' + m) << ": tracked in " << markerStats.trackedFrames << " frames ("
+			<< (framesAfterLock > 0 ? 100.0 * markerStats.trackedFrames / framesAfterLock : 0) << "% after first locking on at frame " << markerStats.firstLock << "), "
+			<< markerStats.lockLosses << " lock losses, position error mean " << meanError_mm << " mm (p95 " << percentile(markerStats.errors_mm, 0.95) << " mm, "
+			<< (markerStats.trackedFrames > 0 ? markerStats.pixelErrorSum / markerStats.trackedFrames : 0) << " px)\n";
+
+		if (maxError_mm >= 0 && (markerStats.trackedFrames == 0 || meanError_mm > maxError_mm)) {
+			passed = false;
+		}
+	}
+
+	if (maxLockLosses >= 0 && lockLosses > (size_t)maxLockLosses) {
+		passed = false;
+	}
+
+	if (!passed) {
+		cout << "FAILED: outside the given limits\n";
+		return 2;
+	}
+
+	return 0;
+}
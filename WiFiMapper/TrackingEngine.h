@@ -0,0 +1,95 @@
+/*
+ * The module responsible for updating any number of marker trackers with each depth
+ * frame, spreading their searches across a small pool of threads.
+ *
+ * Written by Marc Katzef
+ */
+
+#pragma once
+
+#include "Portability.h"
+#include <vector>
+
+#include "DepthPyramid.h"
+#include "MarkerTracker.h"
+#include "TaskPool.h"
+
+
+// Updates a set of marker trackers with each depth frame. Each tracker only reads the frame and
+// its own state, so they are updated concurrently, and their results are returned in the order
+// the trackers were added (whichever thread updated them), so they do not depend on scheduling.
+class TrackingEngine {
+public:
+	typedef std::pair<MarkerTracker::RET_TYPE, cv::Point3f> Result;
+
+	// The pool is shared with the caller (nullptr: the trackers are updated in turn), and must outlive the engine
+	explicit TrackingEngine(TaskPool *pool = nullptr) : m_pool(pool) {}
+
+	void setPool(TaskPool *pool) {
+		m_pool = pool;
+	}
+
+	// Adds a tracker (which must outlive the engine) to be updated with each frame, returning the index of its results
+	size_t addTracker(MarkerTracker *tracker) {
+		m_trackers.push_back(tracker);
+		m_results.resize(m_trackers.size());
+		return m_trackers.size() - 1;
+	}
+
+	void clear() {
+		m_trackers.clear();
+		m_results.clear();
+	}
+
+	// Updates every tracker with the given depth frame, given the time (in seconds) since the previous frame.
+	// Returns the results of the trackers, in the order they were added.
+	const std::vector<Result> &update(const cv::Mat &depthFrame, double timeDiff) {
+		// No marker may be reacquired where another is being tracked (as of the previous frame)
+		bool isReacquiring = false;
+		for (MarkerTracker *tracker : m_trackers) {
+			for (MarkerTracker *other : m_trackers) {
+				std::pair<cv::Point2f, float> marker = other->markerEstimate();
+				if (other != tracker && marker.second > 0) {
+					tracker->excludeRegion(marker.first, marker.second);
+				}
+			}
+			isReacquiring = isReacquiring || tracker->isReacquiring();
+		}
+
+		// Lost markers are searched for in the same (downsampled) copy of the frame, formed once
+		const DepthPyramid *pyramid = nullptr;
+		if (isReacquiring) {
+			m_pyramid.build(depthFrame, MarkerTracker::cReacquisitionLevel);
+			pyramid = &m_pyramid;
+		}
+
+		// Tracking a marker takes a few microseconds (less than waking the pool's threads), so the pool is only used
+		// when a marker is being searched for in the whole frame, or when there are many markers
+		auto updateTracker = [&](size_t i) {
+			m_results[i] = m_trackers[i]->update(depthFrame, timeDiff, pyramid);
+		};
+
+		if (m_pool && (isReacquiring || m_trackers.size() >= cMinParallelTrackers)) {
+			m_pool->run(m_trackers.size(), updateTracker);
+		} else {
+			for (size_t i = 0; i < m_trackers.size(); i++) {
+				updateTracker(i);
+			}
+		}
+
+		return m_results;
+	}
+
+	const std::vector<Result> &results() const {
+		return m_results;
+	}
+
+private:
+	TaskPool *m_pool;
+	std::vector<MarkerTracker*> m_trackers;
+	std::vector<Result> m_results;
+	DepthPyramid m_pyramid;
+
+	// The number of trackers at which they are always updated concurrently
+	const size_t cMinParallelTrackers = 8;
+};
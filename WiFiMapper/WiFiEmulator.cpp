@@ -0,0 +1,206 @@
+/*
+ * A program which emulates any number of ESP8266 modules on local ports, and
+ * (optionally) benchmarks the receiver modules against them.
+ *
+ * Written by Marc Katzef
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "EspEmulator.h"
+#include "ReceiverPoller.h"
+#include "WiFiReceiver.h"
+
+using namespace std;
+
+// The interval at which the benchmark checks the age of every module's latest sample
+static const chrono::milliseconds cCheckInterval(5);
+
+
+// Prints command line usage
+void printUsage(const char *programName) {
+	cerr << "Usage: " << programName << " [options]\n"
+		"Options:\n"
+		"  --modules <count>     the number of modules to emulate (default 5)\n"
+		"  --port <port>         the port of the first module (default 18000)\n"
+		"  --latency <ms>        the delay before each response (default 5)\n"
+		"  --jitter <ms>         the variation in the delay either way (default 2)\n"
+		"  --drop <rate>         the proportion of requests whose connection is closed (default 0)\n"
+		"  --waveform <name>     constant, sine, square or noise (default sine)\n"
+		"  --duration <s>        stop after the given time (default: run until stopped)\n"
+		"  --benchmark           collect from the modules with a ReceiverPoller and report its performance\n"
+		"  --batch               (with --benchmark) fetch samples in batches\n"
+		"  --no-batches          emulate firmware which does not serve /rssi/batch\n";
+}
+
+
+// Returns the value at the given proportion through the sorted values
+double percentile(const vector<double> &sorted, double proportion) {
+	if (sorted.empty()) {
+		return 0;
+	}
+
+	return sorted[min(sorted.size() - 1, (size_t)(proportion * sorted.size()))];
+}
+
+
+// Collects from every emulated module for the given time, and reports the rate at which
+// samples were received and the ages of the latest samples (as seen by a consumer)
+void runBenchmark(const EspEmulatorConfig &config, double duration_s, bool batch) {
+	vector<WiFiReceiver> receivers(config.moduleCount);
+	ReceiverPoller poller;
+	for (size_t i = 0; i < config.moduleCount; i++) {
+		receivers[i].setIpAddress("127.0.0.1", (uint16_t)(config.firstPort + i));
+		poller.addReceiver(&receivers[i]);
+	}
+
+	poller.setBatching(batch);
+	poller.start();
+
+	// Measure once every module has been reached
+	chrono::steady_clock::time_point warmupEnd = chrono::steady_clock::now() + chrono::seconds(1);
+	while (chrono::steady_clock::now() < warmupEnd) {
+		this_thread::sleep_for(cCheckInterval);
+	}
+
+	vector<uint64_t> startCounts(config.moduleCount);
+	for (size_t i = 0; i < config.moduleCount; i++) {
+		startCounts[i] = receivers[i].latestSample().sequence;
+	}
+
+	vector<double> ages_ms;
+	size_t silentChecks = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	chrono::steady_clock::time_point end = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(duration_s));
+	while (chrono::steady_clock::now() < end) {
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		for (WiFiReceiver &receiver : receivers) {
+			RssiSample sample = receiver.latestSample();
+			if (sample.sequence == 0) {
+				silentChecks++;
+			} else {
+				ages_ms.push_back(chrono::duration<double, milli>(now - sample.time).count());
+			}
+		}
+
+		this_thread::sleep_for(cCheckInterval);
+	}
+	double elapsed_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	poller.stop();
+
+	uint64_t sampleCount = 0;
+	double slowestRate = -1;
+	for (size_t i = 0; i < config.moduleCount; i++) {
+		uint64_t moduleCount = receivers[i].latestSample().sequence - startCounts[i];
+		sampleCount += moduleCount;
+
+		double rate = moduleCount / elapsed_s;
+		if (slowestRate < 0 || rate < slowestRate) {
+			slowestRate = rate;
+		}
+	}
+
+	sort(ages_ms.begin(), ages_ms.end());
+	cout << "Modules: " << config.moduleCount << (batch ? " (batches)" : " (latest value)") << "\n"
+		<< "Aggregate sample rate: " << sampleCount / elapsed_s << " samples/s (slowest module " << slowestRate << " samples/s)\n"
+		<< "Latest sample age (ms): p50 " << percentile(ages_ms, 0.5) << ", p90 " << percentile(ages_ms, 0.9)
+		<< ", p99 " << percentile(ages_ms, 0.99) << ", max " << (ages_ms.empty() ? 0 : ages_ms.back()) << "\n";
+
+	if (silentChecks > 0) {
+		cout << "Checks before a module's first sample: " << silentChecks << "\n";
+	}
+}
+
+
+int main(int argc, char **argv) {
+	EspEmulatorConfig config;
+	double duration_s = 0;
+	bool benchmark = false;
+	bool batch = false;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--modules" && hasValue) {
+			config.moduleCount = strtoul(argv[++i], NULL, 10);
+		} else if (arg == "--port" && hasValue) {
+			config.firstPort = (uint16_t)strtoul(argv[++i], NULL, 10);
+		} else if (arg == "--latency" && hasValue) {
+			config.latency_ms = atof(argv[++i]);
+		} else if (arg == "--jitter" && hasValue) {
+			config.jitter_ms = atof(argv[++i]);
+		} else if (arg == "--drop" && hasValue) {
+			config.dropRate = atof(argv[++i]);
+		} else if (arg == "--waveform" && hasValue) {
+			string name = argv[++i];
+			if (name == "constant") {
+				config.waveform = WAVEFORMS::CONSTANT;
+			} else if (name == "sine") {
+				config.waveform = WAVEFORMS::SINE;
+			} else if (name == "square") {
+				config.waveform = WAVEFORMS::SQUARE;
+			} else if (name == "noise") {
+				config.waveform = WAVEFORMS::NOISE;
+			} else {
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else if (arg == "--duration" && hasValue) {
+			duration_s = atof(argv[++i]);
+		} else if (arg == "--benchmark") {
+			benchmark = true;
+		} else if (arg == "--batch") {
+			batch = true;
+		} else if (arg == "--no-batches") {
+			config.serveBatches = false;
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (config.moduleCount == 0 || config.firstPort + config.moduleCount > 65536) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+#ifndef _WIN32
+	// Each module needs a listening socket, and (when benchmarking) both ends of a connection
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+#endif
+
+	EspEmulator emulator(config);
+	if (!emulator.start()) {
+		return 1;
+	}
+
+	cout << "Emulating " << config.moduleCount << " modules on ports " << config.firstPort << "-" << config.firstPort + config.moduleCount - 1 << "\n";
+
+	if (benchmark) {
+		runBenchmark(config, duration_s > 0 ? duration_s : 5, batch);
+	} else if (duration_s > 0) {
+		this_thread::sleep_for(chrono::duration<double>(duration_s));
+	} else {
+		cout << "Press enter to stop\n";
+		cin.get();
+	}
+
+	emulator.stop();
+	cout << "Answered " << emulator.responseCount() << " requests (" << emulator.dropCount() << " dropped)\n";
+	return 0;
+}
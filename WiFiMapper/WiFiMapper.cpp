@@ -12,9 +12,12 @@
 #include "resource.h"
 #include "WiFiMapper.h"
 #include "PointCloud.h"
+#include "KinectDepthSource.h"
 
 #include <iostream>
+#include <cctype>
 #include <chrono>
+#include <cmath>
 #include <thread>
 #include <string>
 #include <ctime>
@@ -26,53 +29,153 @@ using namespace std;
 
 std::string cloudDir = "./Clouds/";
 bool writeEnvCloud = true;
+bool recordDepth = false;
+bool logSession = true;
+PcdFormat envCloudFormat = PcdFormat::BINARY_COMPRESSED;
+PcdFormat mapCloudFormat = PcdFormat::ASCII; // (read as text by the scripts in ./Clouds)
+
+
+// The time elapsed since the given time, in seconds
+static double secondsSince(chrono::steady_clock::time_point startTime) {
+	return chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+}
+
+
+// Writes the given session log to a PCD file of the same name, keeping the log if it cannot be written
+static void finalizeMapLog(const std::string &logFilename) {
+	std::string pcdFilename = logFilename.substr(0, logFilename.size() - std::string(".wmsl").size()) + ".pcd";
+	try {
+		size_t count = finalizeSessionLog(logFilename, pcdFilename, mapCloudFormat);
+		std::cout << "Wrote " << count << " Wi-Fi samples to \"" << pcdFilename << "\"\n";
+	} catch (const std::exception &e) {
+		std::cerr << "Failed to write \"" << logFilename << "\" to \"" << pcdFilename << "\" (it will be retried on the next start)\nDetails:\n";
+		std::cerr << e.what() << "\n";
+	}
+}
+
+
+// Finalizes the session logs left in the cloud directory by sessions which did not finish
+static void recoverSessionLogs() {
+	WIN32_FIND_DATAA findData;
+	HANDLE findHandle = FindFirstFileA((cloudDir + "*.wmsl").c_str(), &findData);
+	if (findHandle == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	do {
+		std::cout << "Recovering the unfinished session \"" << findData.cFileName << "\"\n";
+		finalizeMapLog(cloudDir + findData.cFileName);
+	} while (FindNextFileA(findHandle, &findData));
+
+	FindClose(findHandle);
+}
 
 int main(void) {
+	if (logSession) {
+		recoverSessionLogs();
+	}
+
 	WiFiMapper application;
 
 	chrono::time_point<chrono::system_clock> now = std::chrono::system_clock::now();
 	long long in_time_t = chrono::system_clock::to_time_t(now);
 
+	std::stringstream env_ss;
 	if (writeEnvCloud) {
 		PointCloud envCloud = application.GetEnvironmentCloud();
-		std::stringstream env_ss;
 		now = std::chrono::system_clock::now();
 		in_time_t = std::chrono::system_clock::to_time_t(now);
-		env_ss << cloudDir << "env_map " << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %H.%M.%S") << ".pcd";
-		envCloud.WriteToFileSafe(env_ss.str());
+		env_ss << cloudDir << "env_map " << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %H.%M.%S");
+		envCloud.WriteToFileSafe(env_ss.str() + ".pcd", envCloudFormat);
 	}
 
-	PointCloud mappedCloud = application.Run();
+	if (recordDepth) {
+		std::stringstream depth_ss;
+		now = std::chrono::system_clock::now();
+		in_time_t = std::chrono::system_clock::to_time_t(now);
+		depth_ss << cloudDir << "depth " << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %H.%M.%S") << ".wmds";
+		application.RecordDepth(depth_ss.str());
+	}
 
+	// (named for the start of the session, when logged)
 	stringstream map_ss;
 	now = std::chrono::system_clock::now();
 	in_time_t = std::chrono::system_clock::to_time_t(now);
-	map_ss << cloudDir << "map " << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %H.%M.%S") << ".pcd";
-	mappedCloud.WriteToFileSafe(map_ss.str());
+	map_ss << cloudDir << "map " << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %H.%M.%S");
+
+	std::string logFilename = map_ss.str() + ".wmsl";
+	bool loggingSession = logSession && application.LogSession(logFilename);
+
+	PointCloud mappedCloud = application.Run();
+
+	if (loggingSession) {
+		finalizeMapLog(logFilename);
+
+		// (the samples collected after the log could no longer be written)
+		if (mappedCloud.Size() > 0) {
+			mappedCloud.WriteToFileSafe(map_ss.str() + " (continued).pcd", mapCloudFormat);
+		}
+	} else {
+		now = std::chrono::system_clock::now();
+		in_time_t = std::chrono::system_clock::to_time_t(now);
+		map_ss.str("");
+		map_ss << cloudDir << "map " << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %H.%M.%S") << ".pcd";
+		mappedCloud.WriteToFileSafe(map_ss.str(), mapCloudFormat);
+	}
+
+	if (writeEnvCloud) {
+		// (written beside the startup cloud, which is kept)
+		chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+		PointCloud envCloud = application.GetSessionEnvironmentCloud();
+		if (envCloud.Size() > 0) {
+			std::cout << "Session environment cloud formed (" << envCloud.Size() << " points) in " << secondsSince(startTime) << " s\n";
+			envCloud.WriteToFileSafe(env_ss.str() + " (session).pcd", envCloudFormat);
+		}
+	}
 }
 
 
 WiFiMapper::WiFiMapper() :
 	m_pKinectSensor(NULL),
 	m_pMultiSourceReader(NULL),
+	m_pDepthFrameReader(NULL),
+	m_depthSource(NULL),
+	m_depthRecorder(NULL),
+	m_sessionLog(NULL),
+	m_environmentFusion(NULL),
 	m_pColorRGBX(NULL),
 	m_receivers(cWiFiModules.size()),
-	m_receiverSync(cWiFiModules.size()) {
+	m_rssiSnapshot(cWiFiModules.size()),
+	m_staleSampleCounts(cWiFiModules.size(), 0) {
 
 	for (size_t i = 0; i < cWiFiModules.size(); ++i) {
 		m_receivers[i].setIpAddress(cWiFiModules[i].ipAddress);
-		m_receivers[i].addRenzezvous(&m_receiverSync);
-		m_receivers[i].start();
+		m_receiverPoller.addReceiver(&m_receivers[i]);
 	}
 
+	m_receiverPoller.setBatching(cFetchRssiBatches);
+	m_receiverPoller.setStreaming(cRssiStreamInterval_us);
+	m_receiverPoller.start();
+
 	// create heap storage for color pixel data in RGBX format
 	m_pColorRGBX = new RGBQUAD[cColorWidth * cColorHeight];
 	m_pDepth = new UINT16[cDepthWidth * cDepthHeight];
 	m_displayBuffer = new UINT8[cDepthWidth * cDepthHeight * 3];
 
 	// Initialise marker trackers
-	m_trackerA.init(cDepthWidth, cDepthHeight, cDepthVFov, m_initOriginA, m_initDistance_mm, m_markerRadius_mm, m_markerRadiusTolerance, m_centerTolerance_px);
-	m_trackerB.init(cDepthWidth, cDepthHeight, cDepthVFov, m_initOriginB, m_initDistance_mm, m_markerRadius_mm, m_markerRadiusTolerance, m_centerTolerance_px);
+	ScannerTrackerConfig trackerConfig;
+	trackerConfig.depthWidth = cDepthWidth;
+	trackerConfig.depthHeight = cDepthHeight;
+	trackerConfig.depthVFov_deg = cDepthVFov;
+	trackerConfig.initOriginA = m_initOriginA;
+	trackerConfig.initOriginB = m_initOriginB;
+	trackerConfig.initDistance_mm = m_initDistance_mm;
+	trackerConfig.markerRadius_mm = m_markerRadius_mm;
+	trackerConfig.markerRadiusTolerance = m_markerRadiusTolerance;
+	trackerConfig.centerTolerance_px = m_centerTolerance_px;
+	trackerConfig.scannerLength_mm = cScannerLength_mm;
+	trackerConfig.scannerLengthTolerance = cScannerLengthTolerance;
+	m_scanner.init(trackerConfig, &m_projection, &m_trackingPool);
 
 	InitializeDepthAndColorSensors();
 	initMappingTable();
@@ -95,8 +198,28 @@ WiFiMapper::~WiFiMapper() {
 		m_displayBuffer = NULL;
 	}
 
+	if (m_depthSource) {
+		delete m_depthSource;
+		m_depthSource = NULL;
+	}
+
+	if (m_depthRecorder) {
+		delete m_depthRecorder;
+		m_depthRecorder = NULL;
+	}
+
+	if (m_sessionLog) {
+		delete m_sessionLog;
+		m_sessionLog = NULL;
+	}
+
+	if (m_environmentFusion) {
+		delete m_environmentFusion;
+		m_environmentFusion = NULL;
+	}
+
 	// done with frame readers
-	SafeRelease(m_pMultiSourceReader);
+	DisableMultiSourceReader();
 	SafeRelease(m_pDepthFrameReader);
 
 	// close the Kinect Sensor
@@ -106,18 +229,18 @@ WiFiMapper::~WiFiMapper() {
 
 	SafeRelease(m_pKinectSensor);
 
-	for (size_t i = 0; i < cWiFiModules.size(); ++i) {
-		m_receivers[i].disconnect();
-	}
-
-	m_receiverSync.destroy();
+	m_receiverPoller.stop();
 }
 
 
 PointCloud WiFiMapper::Run() {
-	if (m_pMultiSourceReader) {
-		DisableMultiSourceReader();
-		InitializeDepthFrameReader();
+	if (!m_depthSource) {
+		if (m_pMultiSourceReader) {
+			DisableMultiSourceReader();
+			InitializeDepthFrameReader();
+		}
+
+		m_depthSource = new KinectDepthSource(m_pDepthFrameReader);
 	}
 
 	namedWindow("Depth", WINDOW_NORMAL);
@@ -125,7 +248,7 @@ PointCloud WiFiMapper::Run() {
 	namedWindow("Mask B", WINDOW_NORMAL);
 
 	int key = cv::waitKey(1);
-	while (key != 'q') {
+	while (key != 'q' && !m_depthSource->finished()) {
 		Update();
 
 		if (key == 's') {
@@ -136,7 +259,7 @@ PointCloud WiFiMapper::Run() {
 				std::cout << "Beginning collection " << m_sampleCollectionCount << "\n";
 				std::cout << "Sample number,a_x,a_y,a_z,b_x,b_y,b_z";
 				for (size_t i = 0; i < cWiFiModules.size(); ++i) {
-					std::cout << ",rssi" << i + 1;
+					std::cout << ",rssi" << i + 1 << ",age" << i + 1;
 				}
 				std::cout << "\n";
 			}
@@ -145,223 +268,334 @@ PointCloud WiFiMapper::Run() {
 		key = cv::waitKey(1);
 	}
 
+	for (size_t i = 0; i < cWiFiModules.size(); ++i) {
+		std::cout << "Module " << cWiFiModules[i].ipAddress << ": " << m_receivers[i].sampleRate() << " samples/s, "
+			<< m_staleSampleCounts[i] << " stale samples discarded";
+
+		if (cFetchRssiBatches && cRssiStreamInterval_us == 0) {
+			std::cout << ", " << m_receivers[i].missedBatchSamples() << " samples missed between batches";
+		}
+
+		if (cRssiStreamInterval_us > 0) {
+			RssiStreamStats stats = m_receiverPoller.streamStats(i);
+			std::cout << ", " << stats.received << " packets received (" << stats.lost << " lost, "
+				<< stats.reordered << " reordered, " << stats.duplicates << " duplicated)";
+		}
+
+		std::cout << "\n";
+	}
+
+	if (m_depthRecorder) {
+		m_depthRecorder->close();
+		std::cout << "Recorded " << m_depthRecorder->frameCount() << " depth frames";
+		if (m_depthRecorder->failed()) {
+			std::cout << " (before the recording could not be written)";
+		}
+		std::cout << "\n";
+	}
+
+	if (m_sessionLog) {
+		m_sessionLog->close();
+		std::cout << "Logged " << m_sessionLog->pointCount() << " Wi-Fi samples\n";
+
+		if (m_sessionLog->failed()) {
+			// (the samples queued when the log failed come before those collected in memory since)
+			PointCloud unlogged(m_sessionLog->takeUnwritten());
+			unlogged.Append(m_wifiPointCloud);
+			m_wifiPointCloud = std::move(unlogged);
+			std::cout << m_wifiPointCloud.Size() << " Wi-Fi samples could not be logged, and are held in memory\n";
+		}
+	}
+
 	return m_wifiPointCloud;
 }
 
 
-void WiFiMapper::Update() {
-	if (!m_pDepthFrameReader) {
-		return;
+void WiFiMapper::SetDepthSource(DepthSource *depthSource) {
+	if (m_depthSource) {
+		delete m_depthSource;
 	}
 
-	IDepthFrame* pDepthFrame = NULL;
+	m_depthSource = depthSource;
+	m_depthClock.reset();
+}
 
-	HRESULT hr = m_pDepthFrameReader->AcquireLatestFrame(&pDepthFrame);
 
-	if (SUCCEEDED(hr)) {
-		UINT nBufferSize = 0;
-		UINT16 *pBuffer = NULL;
+void WiFiMapper::RecordDepth(std::string filename) {
+	if (m_depthRecorder) {
+		delete m_depthRecorder;
+		m_depthRecorder = NULL;
+	}
 
-		if (SUCCEEDED(hr)) {
-			hr = pDepthFrame->AccessUnderlyingBuffer(&nBufferSize, &pBuffer);
-		}
+	try {
+		m_depthRecorder = new DepthStreamWriter(filename, cDepthWidth, cDepthHeight);
+	} catch (const std::exception &e) {
+		std::cerr << "Depth frames will not be recorded: " << e.what() << "\n";
+	}
+}
 
-		if (SUCCEEDED(hr)) {
-			ProcessChannels(pBuffer, cDepthWidth, cDepthHeight);
-		}
+
+bool WiFiMapper::LogSession(std::string filename) {
+	if (m_sessionLog) {
+		delete m_sessionLog;
+		m_sessionLog = NULL;
 	}
 
-	SafeRelease(pDepthFrame);
+	try {
+		m_sessionLog = new SessionLogWriter(filename);
+	} catch (const std::exception &e) {
+		std::cerr << "The Wi-Fi point cloud will be held in memory until the program exits: " << e.what() << "\n";
+	}
+
+	return m_sessionLog != NULL;
 }
 
 
-PointCloud WiFiMapper::GetEnvironmentCloud() {
-	PointCloud result;
-	bool succeeded = false;
+void WiFiMapper::Update() {
+	if (!m_depthSource) {
+		return;
+	}
 
-	while (!succeeded) {
-		if (!m_pMultiSourceReader) {
-			continue;
+	DepthFrame frame;
+	if (m_depthSource->acquireFrame(frame)) {
+		chrono::steady_clock::time_point frameTime = m_depthClock.hostTime(frame.timestamp, chrono::steady_clock::now());
+
+		if (m_depthRecorder && frame.width == cDepthWidth && frame.height == cDepthHeight) {
+			m_depthRecorder->writeFrame(frame.data, frame.timestamp);
 		}
 
-		IColorFrame* pColorFrame = NULL;
-		IDepthFrame* pDepthFrame = NULL;
-		IMultiSourceFrame* pMultiFrame = NULL;
+		if (m_environmentFusion && cEnvironmentFusionInterval > 0 && frame.width == cDepthWidth && frame.height == cDepthHeight
+			&& ++m_framesSinceFusion >= cEnvironmentFusionInterval) {
+			m_framesSinceFusion = 0;
+			m_environmentFusion->fuseDepthFrame(frame.data);
+		}
 
-		HRESULT hr = m_pMultiSourceReader->AcquireLatestFrame(&pMultiFrame);
+		ProcessChannels(frame, frameTime);
+	}
+}
 
-		if (SUCCEEDED(hr)) {
-			ColorImageFormat imageFormat = ColorImageFormat_None;
-			UINT nBufferSizeColor = 0;
-			RGBQUAD *pBufferColor = NULL;
-			UINT nBufferSizeDepth = 0;
-			UINT16 *pBufferDepth = NULL;
 
-			IColorFrameReference *colorRef = NULL;
-			pMultiFrame->get_ColorFrameReference(&colorRef);
-			HRESULT hrColor = colorRef->AcquireFrame(&pColorFrame);
-			if (colorRef) {
-				colorRef->Release();
-			}
-			if (!SUCCEEDED(hrColor)) {
-				SafeRelease(pColorFrame);
-				SafeRelease(pDepthFrame);
-				SafeRelease(pMultiFrame);
-				continue;
-			}
+PointCloud WiFiMapper::GetEnvironmentCloud() {
+	PointCloud result;
+	if (!m_pMultiSourceReader) {
+		std::cout << "No colour frames available: the environment cloud will be empty\n";
+		return result;
+	}
 
-			IDepthFrameReference *depthRef = NULL;
-			pMultiFrame->get_DepthFrameReference(&depthRef);
-			HRESULT hrDepth = depthRef->AcquireFrame(&pDepthFrame);
-			if (depthRef) {
-				depthRef->Release();
-			}
-			if (!SUCCEEDED(hrDepth)) {
-				SafeRelease(pColorFrame);
-				SafeRelease(pDepthFrame);
-				SafeRelease(pMultiFrame);
-				continue;
-			}
+	chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+	uint frameCount = std::max(cEnvironmentFrames, 1u);
+	if (frameCount > 1 || cEnvironmentFusionInterval > 0) {
+		delete m_environmentFusion;
+		m_environmentFusion = new EnvironmentFusion(&m_projection, cEnvironmentVoxelSize_mm);
+	}
 
-			if (SUCCEEDED(hrDepth)) {
-				pBufferDepth = m_pDepth;
-				nBufferSizeColor = cDepthWidth * cDepthHeight * sizeof(UINT16);
-				hrDepth = pDepthFrame->CopyFrameDataToArray(cDepthWidth * cDepthHeight, pBufferDepth);
-
-				pBufferColor = m_pColorRGBX;
-				nBufferSizeColor = cColorWidth * cColorHeight * sizeof(RGBQUAD);
-				hrColor = pColorFrame->CopyConvertedFrameDataToArray(nBufferSizeColor, reinterpret_cast<BYTE*>(pBufferColor), ColorImageFormat_Bgra);
-			} else {
-				hrColor = E_FAIL;
-				hrDepth = E_FAIL;
-			}
+	for (uint i = 0; i < frameCount; i++) {
+		// (the frame acquired with the mapping table, if any, is the first frame used)
+		while (!m_hasStartupFrame && !acquireColorAndDepth()) {}
+		m_hasStartupFrame = false;
 
-			if (SUCCEEDED(hrColor) && SUCCEEDED(hrDepth)) {
-				SafeRelease(pColorFrame);
-				SafeRelease(pDepthFrame);
-				SafeRelease(pMultiFrame);
+		if (frameCount == 1) {
+			result = formPointCloud(m_pColorRGBX, m_pDepth);
+		} else {
+			mapDepthToColor(m_pDepth);
+		}
 
-				result = formPointCloud(pBufferColor, pBufferDepth);
-				succeeded = true;
-			}
+		if (m_environmentFusion) {
+			m_environmentFusion->fuseFrame(m_pDepth, reinterpret_cast<const Point2f*>(m_colorSpacePoints.data()),
+				reinterpret_cast<const ColorPixel*>(m_pColorRGBX), cColorWidth, cColorHeight);
 		}
+	}
 
-		SafeRelease(pColorFrame);
-		SafeRelease(pDepthFrame);
-		SafeRelease(pMultiFrame);
+	if (frameCount > 1) {
+		// (surfaces seen in too few of the frames are noise, or were moving)
+		result = m_environmentFusion->toPointCloud(std::max(frameCount / 3, 1u));
 	}
 
+	std::cout << "Environment cloud formed from " << frameCount << " frames (" << result.Size() << " points) in "
+		<< secondsSince(startTime) << " s\n";
 	return result;
 }
 
 
-void WiFiMapper::initMappingTable() {
-	bool succeeded = false;
-	while (!succeeded) {
-		if (!m_pMultiSourceReader) {
-			continue;
-		}
+PointCloud WiFiMapper::GetSessionEnvironmentCloud() {
+	if (!m_environmentFusion || cEnvironmentFusionInterval == 0) {
+		return PointCloud();
+	}
 
-		IColorFrame* pColorFrame = NULL;
-		IDepthFrame* pDepthFrame = NULL;
-		IMultiSourceFrame* pMultiFrame = NULL;
+	// (a surface hidden for much of the session is kept, as long as it was seen in enough frames)
+	return m_environmentFusion->toPointCloud(std::max(cSessionEnvironmentMinFrames, std::max(cEnvironmentFrames / 3, 1u)));
+}
 
-		HRESULT hr = m_pMultiSourceReader->AcquireLatestFrame(&pMultiFrame);
 
-		if (SUCCEEDED(hr)) {
-			ColorImageFormat imageFormat = ColorImageFormat_None;
-			UINT nBufferSizeColor = 0;
-			RGBQUAD *pBufferColor = NULL;
-			UINT nBufferSizeDepth = 0;
-			UINT16 *pBufferDepth = NULL;
+bool WiFiMapper::acquireColorAndDepth() {
+	if (!m_pMultiSourceReader) {
+		return false;
+	}
 
-			IColorFrameReference *colorRef = NULL;
-			pMultiFrame->get_ColorFrameReference(&colorRef);
-			HRESULT hrColor = colorRef->AcquireFrame(&pColorFrame);
-			if (colorRef) {
-				colorRef->Release();
-			}
-			if (!SUCCEEDED(hrColor)) {
-				SafeRelease(pColorFrame);
-				SafeRelease(pDepthFrame);
-				SafeRelease(pMultiFrame);
-				continue;
-			}
+	if (WaitForSingleObject(reinterpret_cast<HANDLE>(m_multiSourceFrameEvent), cSensorTimeout_ms) != WAIT_OBJECT_0) {
+		std::cout << "Waiting for frames from the Kinect...\n";
+		return false;
+	}
 
-			IDepthFrameReference *depthRef = NULL;
-			pMultiFrame->get_DepthFrameReference(&depthRef);
-			HRESULT hrDepth = depthRef->AcquireFrame(&pDepthFrame);
-			if (depthRef) {
-				depthRef->Release();
-			}
-			if (!SUCCEEDED(hrDepth)) {
-				SafeRelease(pColorFrame);
-				SafeRelease(pDepthFrame);
-				SafeRelease(pMultiFrame);
-				continue;
-			}
+	IMultiSourceFrameArrivedEventArgs *pFrameArgs = NULL;
+	IMultiSourceFrameReference *pFrameReference = NULL;
+	IMultiSourceFrame *pMultiFrame = NULL;
+	IColorFrameReference *pColorReference = NULL;
+	IColorFrame *pColorFrame = NULL;
+	IDepthFrameReference *pDepthReference = NULL;
+	IDepthFrame *pDepthFrame = NULL;
 
-			if (SUCCEEDED(hrDepth)) {
-				pBufferDepth = m_pDepth;
-				nBufferSizeColor = cDepthWidth * cDepthHeight * sizeof(UINT16);
-				hrDepth = pDepthFrame->CopyFrameDataToArray(cDepthWidth * cDepthHeight, pBufferDepth);
-
-				pBufferColor = m_pColorRGBX;
-				nBufferSizeColor = cColorWidth * cColorHeight * sizeof(RGBQUAD);
-				hrColor = pColorFrame->CopyConvertedFrameDataToArray(nBufferSizeColor, reinterpret_cast<BYTE*>(pBufferColor), ColorImageFormat_Bgra);
-			} else {
-				hrColor = E_FAIL;
-				hrDepth = E_FAIL;
-			}
+	// Each step only runs if every previous step succeeded
+	HRESULT hr = m_pMultiSourceReader->GetMultiSourceFrameArrivedEventData(m_multiSourceFrameEvent, &pFrameArgs);
 
-			if (SUCCEEDED(hrColor) && SUCCEEDED(hrDepth)) {
-				uint depthPixelCount;
-				m_pMapper->GetDepthFrameToCameraSpaceTable(&depthPixelCount, &m_depthToCameraSpaceTable);
-				succeeded = true;
-			}
-		}
+	if (SUCCEEDED(hr)) {
+		hr = pFrameArgs->get_FrameReference(&pFrameReference);
+	}
 
-		SafeRelease(pColorFrame);
-		SafeRelease(pDepthFrame);
-		SafeRelease(pMultiFrame);
+	if (SUCCEEDED(hr)) {
+		hr = pFrameReference->AcquireFrame(&pMultiFrame);
 	}
-}
 
+	if (SUCCEEDED(hr)) {
+		hr = pMultiFrame->get_ColorFrameReference(&pColorReference);
+	}
 
-PointCloud WiFiMapper::formPointCloud(RGBQUAD *pBufferColor, UINT16 *pBufferDepth) {
-	PointCloud result;
-	size_t depthPixelCount = cDepthWidth * cDepthHeight;
-	ColorSpacePoint *colorSpacePoints = new ColorSpacePoint[depthPixelCount];
-	m_pMapper->MapDepthFrameToColorSpace(depthPixelCount, pBufferDepth, depthPixelCount, colorSpacePoints);
+	if (SUCCEEDED(hr)) {
+		hr = pColorReference->AcquireFrame(&pColorFrame);
+	}
 
-	for (size_t y = 0; y < cDepthHeight; y++) {
-		for (size_t x = 0; x < cDepthHeight; x++) {
-			size_t index = y * cDepthWidth + x;
-			ColorSpacePoint csp = colorSpacePoints[index];
-			UINT16 depth = pBufferDepth[index];
+	if (SUCCEEDED(hr)) {
+		hr = pMultiFrame->get_DepthFrameReference(&pDepthReference);
+	}
 
-			if (depth == 0) {
-				continue;
-			}
+	if (SUCCEEDED(hr)) {
+		hr = pDepthReference->AcquireFrame(&pDepthFrame);
+	}
+
+	if (SUCCEEDED(hr)) {
+		hr = pDepthFrame->CopyFrameDataToArray(cDepthWidth * cDepthHeight, m_pDepth);
+	}
+
+	if (SUCCEEDED(hr)) {
+		UINT nBufferSizeColor = cColorWidth * cColorHeight * sizeof(RGBQUAD);
+		hr = pColorFrame->CopyConvertedFrameDataToArray(nBufferSizeColor, reinterpret_cast<BYTE*>(m_pColorRGBX), ColorImageFormat_Bgra);
+	}
+
+	SafeRelease(pDepthFrame);
+	SafeRelease(pDepthReference);
+	SafeRelease(pColorFrame);
+	SafeRelease(pColorReference);
+	SafeRelease(pMultiFrame);
+	SafeRelease(pFrameReference);
+	SafeRelease(pFrameArgs);
+
+	return SUCCEEDED(hr);
+}
 
-			int colX = csp.X;
-			int colY = csp.Y;
-			if (colX < 0 || colX >= cColorWidth || colY < 0 || colY >= cColorHeight) {
-				continue; // ignore 0 values
-			}
 
-			Point3f desc = { (float)x, (float)y, (float)depth };
-			RGBQUAD color = pBufferColor[colY * cColorWidth + colX];
+std::string WiFiMapper::getSensorId() {
+	if (!m_pKinectSensor) {
+		return "";
+	}
+
+	// The sensor only reports its ID once it is available (eg: once its driver has started)
+	WAITABLE_HANDLE availableEvent = 0;
+	BOOLEAN isAvailable = FALSE;
+	m_pKinectSensor->SubscribeIsAvailableChanged(&availableEvent);
+	m_pKinectSensor->get_IsAvailable(&isAvailable);
+
+	while (!isAvailable) {
+		if (WaitForSingleObject(reinterpret_cast<HANDLE>(availableEvent), cSensorTimeout_ms) != WAIT_OBJECT_0) {
+			std::cout << "Waiting for the Kinect to become available...\n";
+			continue;
+		}
 
-			result.AddPoint(desc2Pos(desc), color.rgbRed, color.rgbGreen, color.rgbBlue);
+		IIsAvailableChangedEventArgs *pAvailableArgs = NULL;
+		if (SUCCEEDED(m_pKinectSensor->GetIsAvailableChangedEventData(availableEvent, &pAvailableArgs))) {
+			pAvailableArgs->get_IsAvailable(&isAvailable);
 		}
+		SafeRelease(pAvailableArgs);
+	}
+
+	m_pKinectSensor->UnsubscribeIsAvailableChanged(availableEvent);
+
+	WCHAR sensorId[256] = { 0 };
+	if (FAILED(m_pKinectSensor->get_UniqueKinectId(_countof(sensorId), sensorId))) {
+		return "";
+	}
+
+	// (kept to characters which are safe in a file name)
+	std::string result;
+	for (size_t i = 0; sensorId[i] != 0; i++) {
+		result += (sensorId[i] < 128 && isalnum(sensorId[i])) ? (char)sensorId[i] : '_';
 	}
-	delete[] colorSpacePoints;
 
 	return result;
 }
 
 
+void WiFiMapper::initMappingTable() {
+	if (!m_pMultiSourceReader) {
+		std::cout << "Using an ideal depth camera in place of the Kinect's mapping table\n";
+		m_projection.setPinhole(cDepthWidth, cDepthHeight, cDepthVFov);
+		return;
+	}
+
+	// Each sensor's table is kept, as it is only given once the sensor has started delivering frames
+	std::string sensorId = getSensorId();
+	std::string cacheFilename = sensorId.empty() ? "" : cMappingTablePrefix + sensorId + ".table";
+	if (!cacheFilename.empty() && m_projection.readFromFile(cacheFilename, cDepthWidth, cDepthHeight)) {
+		std::cout << "Kinect " << sensorId << " ready " << secondsSince(m_startTime) << " s after starting (mapping table loaded from \""
+			<< cacheFilename << "\")\n";
+		return;
+	}
+
+	// The table is only complete once the sensor is delivering frames, so each frame is followed by another attempt.
+	// The last frame acquired here is kept as the first frame of the environment cloud.
+	bool hasTable = false;
+	while (!hasTable) {
+		while (!acquireColorAndDepth()) {}
+		m_hasStartupFrame = true;
+
+		UINT32 depthPixelCount = 0;
+		PointF *depthToCameraSpaceTable = NULL;
+		HRESULT hr = m_pMapper->GetDepthFrameToCameraSpaceTable(&depthPixelCount, &depthToCameraSpaceTable);
+		hasTable = SUCCEEDED(hr) && depthToCameraSpaceTable && depthPixelCount == (UINT32)(cDepthWidth * cDepthHeight);
+
+		if (hasTable) {
+			m_projection.setTable(reinterpret_cast<float*>(depthToCameraSpaceTable), cDepthWidth, cDepthHeight);
+		} else {
+			std::cout << "Mapping table not yet available (" << depthPixelCount << " of " << cDepthWidth * cDepthHeight
+				<< " pixels), waiting for the next frame\n";
+		}
+
+		CoTaskMemFree(depthToCameraSpaceTable);
+	}
+
+	if (!cacheFilename.empty() && !m_projection.writeToFile(cacheFilename)) {
+		std::cerr << "Unable to save the mapping table to \"" << cacheFilename << "\"\n";
+	}
+
+	std::cout << "Kinect " << sensorId << " ready " << secondsSince(m_startTime) << " s after starting\n";
+}
+
+
+PointCloud WiFiMapper::formPointCloud(RGBQUAD *pBufferColor, UINT16 *pBufferDepth) {
+	mapDepthToColor(pBufferDepth);
+
+	// (ColorSpacePoint and RGBQUAD have the layouts of cv::Point2f and ColorPixel)
+	return formEnvironmentCloud(pBufferDepth, reinterpret_cast<const Point2f*>(m_colorSpacePoints.data()),
+		reinterpret_cast<const ColorPixel*>(pBufferColor), cColorWidth, cColorHeight, m_projection, &m_trackingPool);
+}
+
+
+void WiFiMapper::mapDepthToColor(UINT16 *pBufferDepth) {
+	size_t depthPixelCount = cDepthWidth * cDepthHeight;
+	m_colorSpacePoints.resize(depthPixelCount);
+	m_pMapper->MapDepthFrameToColorSpace(depthPixelCount, pBufferDepth, depthPixelCount, m_colorSpacePoints.data());
+}
+
+
 HRESULT WiFiMapper::InitializeDepthAndColorSensors() {
 	HRESULT hr;
 
@@ -376,6 +610,13 @@ HRESULT WiFiMapper::InitializeDepthAndColorSensors() {
 		hr = m_pKinectSensor->OpenMultiSourceFrameReader(FrameSourceTypes_Depth | FrameSourceTypes_Color, &m_pMultiSourceReader);
 	}
 
+	if (SUCCEEDED(hr) && m_pMultiSourceReader) {
+		hr = m_pMultiSourceReader->SubscribeMultiSourceFrameArrived(&m_multiSourceFrameEvent);
+		if (FAILED(hr)) {
+			SafeRelease(m_pMultiSourceReader);
+		}
+	}
+
 	if (!m_pKinectSensor || FAILED(hr)) {
 		std::cout << "No ready Kinect found!";
 		return E_FAIL;
@@ -387,6 +628,7 @@ HRESULT WiFiMapper::InitializeDepthAndColorSensors() {
 
 void WiFiMapper::DisableMultiSourceReader() {
 	if (m_pMultiSourceReader) {
+		m_pMultiSourceReader->UnsubscribeMultiSourceFrameArrived(m_multiSourceFrameEvent);
 		SafeRelease(m_pMultiSourceReader);
 		m_pMultiSourceReader = NULL;
 	}
@@ -407,40 +649,27 @@ HRESULT WiFiMapper::InitializeDepthFrameReader() {
 }
 
 
-float distanceBetween(Point3f positionA, Point3f positionB) {
-	Point3f diff = positionB - positionA;
-	float diffX = diff.x;
-	float diffY = diff.y;
-	float diffZ = diff.z;
-
-	return std::sqrtf(diffX * diffX + diffY * diffY + diffZ * diffZ);
-}
-
+void WiFiMapper::ProcessChannels(const DepthFrame &frame, chrono::steady_clock::time_point frameTime) {
+	const UINT16 *pBufferDepth = frame.data;
+	int nDepthWidth = frame.width;
+	int nDepthHeight = frame.height;
 
-void WiFiMapper::ProcessChannels(UINT16 *pBufferDepth, int nDepthWidth, int nDepthHeight) {
 	// Make sure we've received valid data
 	if (!(pBufferDepth && (nDepthWidth == cDepthWidth) && (nDepthHeight == cDepthHeight))) {
 		return;
 	}
 
-	double currentTicks = getTickCount();
-	double dt = (currentTicks - m_ticks) / getTickFrequency();
-
-	m_ticks = currentTicks;
+	// Use sensor timestamps so that replayed sessions track as they did live
+	double dt = (double)(frame.timestamp - m_lastTimestamp) / cDepthTicksPerSecond;
 
-	Mat depthFrame(nDepthHeight, nDepthWidth, CV_16UC1, pBufferDepth);
+	m_lastTimestamp = frame.timestamp;
 
-	std::pair<MarkerTracker::RET_TYPE, Point3f> resultA = m_trackerA.update(depthFrame, dt);
-	std::pair<MarkerTracker::RET_TYPE, Point3f> resultB = m_trackerB.update(depthFrame, dt);
+	Mat depthFrame(nDepthHeight, nDepthWidth, CV_16UC1, const_cast<UINT16*>(pBufferDepth));
 
-	if (resultA.first == MarkerTracker::RET_TYPE::TRACKING && resultB.first == MarkerTracker::RET_TYPE::TRACKING) {
-		Point3f positionA = desc2Pos(resultA.second);
-		Point3f positionB = desc2Pos(resultB.second);
-		float distance_mm = distanceBetween(positionA, positionB);
+	ScannerResult result = m_scanner.update(depthFrame, dt);
 
-		if (distance_mm >= cScannerLengthMin_mm && distance_mm <= cScannerLengthMax_mm) {
-			recordPoints(positionA, positionB);
-		}
+	if (result.valid) {
+		recordPoints(result.positionA, result.positionB, frameTime);
 	}
 
 	// Generate intuitive image from depth values
@@ -456,28 +685,32 @@ void WiFiMapper::ProcessChannels(UINT16 *pBufferDepth, int nDepthWidth, int nDep
 	Mat displayFrame(nDepthHeight, nDepthWidth, CV_8UC3, m_displayBuffer);
 
 	int radius = getObjectHeight_px(cDepthVFov * PI / 180.0, m_markerRadius_mm, m_initDistance_mm, cDepthHeight);
-	if (resultA.first == MarkerTracker::RET_TYPE::EMPTY) {
+	if (result.typeA == MarkerTracker::RET_TYPE::EMPTY) {
 		cv::circle(displayFrame, m_initOriginA, radius, { 0,0,255 }, 1);
 	}
-	if (resultB.first == MarkerTracker::RET_TYPE::EMPTY) {
+	if (result.typeB == MarkerTracker::RET_TYPE::EMPTY) {
 		cv::circle(displayFrame, m_initOriginB, radius, { 0,0,255 }, 1);
 	}
 
-	cv::circle(displayFrame, m_trackerA.deb_point, 1, { 255,255,0 }, 2);
-	cv::circle(displayFrame, m_trackerA.deb_point, m_trackerA.deb_sd.minRadius, { 255,255,0 });
-	cv::circle(displayFrame, m_trackerA.deb_point, (int)m_trackerA.deb_sd.maxRadius, { 255,255,0 });
+	const MarkerTracker &trackerA = m_scanner.trackerA();
+	cv::circle(displayFrame, trackerA.deb_point, 1, { 255,255,0 }, 2);
+	cv::circle(displayFrame, trackerA.deb_point, trackerA.deb_sd.minRadius, { 255,255,0 });
+	cv::circle(displayFrame, trackerA.deb_point, (int)trackerA.deb_sd.maxRadius, { 255,255,0 });
+	cv::rectangle(displayFrame, getCenteredRect(trackerA.deb_sd.origin, trackerA.deb_sd.searchSize, trackerA.deb_sd.searchSize), { 255,255,0 });
 
-	cv::circle(displayFrame, m_trackerB.deb_point, 1, { 255,255,0 }, 2);
-	cv::circle(displayFrame, m_trackerB.deb_point, m_trackerB.deb_sd.minRadius, { 255,255,0 });
-	cv::circle(displayFrame, m_trackerB.deb_point, (int)m_trackerB.deb_sd.maxRadius, { 255,255,0 });
+	const MarkerTracker &trackerB = m_scanner.trackerB();
+	cv::circle(displayFrame, trackerB.deb_point, 1, { 255,255,0 }, 2);
+	cv::circle(displayFrame, trackerB.deb_point, trackerB.deb_sd.minRadius, { 255,255,0 });
+	cv::circle(displayFrame, trackerB.deb_point, (int)trackerB.deb_sd.maxRadius, { 255,255,0 });
+	cv::rectangle(displayFrame, getCenteredRect(trackerB.deb_sd.origin, trackerB.deb_sd.searchSize, trackerB.deb_sd.searchSize), { 255,255,0 });
 
 	imshow("Depth", displayFrame);
-	imshow("Mask A", m_trackerA.deb_mask);
-	imshow("Mask B", m_trackerB.deb_mask);
+	imshow("Mask A", trackerA.deb_mask);
+	imshow("Mask B", trackerB.deb_mask);
 }
 
 
-void WiFiMapper::recordPoints(Point3f posA, Point3f posB) {
+void WiFiMapper::recordPoints(Point3f posA, Point3f posB, chrono::steady_clock::time_point frameTime) {
 	Point3f diff = posB - posA;
 	Point3f dirAB = diff / distanceBetween(posA, posB);
 
@@ -486,6 +719,11 @@ void WiFiMapper::recordPoints(Point3f posA, Point3f posB) {
 		std::cout << m_sampleCount << "," << posA.x << "," << posA.y << "," << posA.z << "," << posB.x << "," << posB.y << "," << posB.z;
 	}
 
+	// Each module's RSSI when the frame was captured (the modules are sampled independently)
+	for (size_t i = 0; i < cWiFiModules.size(); ++i) {
+		m_rssiSnapshot[i] = m_receivers[i].rssiAt(frameTime);
+	}
+
 	for (size_t i = 0; i < cWiFiModules.size(); ++i) {
 		Point3f baseMarkerPosition;
 		Point3f directionVector;
@@ -500,12 +738,19 @@ void WiFiMapper::recordPoints(Point3f posA, Point3f posB) {
 
 		Point3f position = baseMarkerPosition + directionVector * cWiFiModules[i].offset_mm;
 
-		int rssi = m_receivers[i].getRssi();
+		const RssiEstimate &estimate = m_rssiSnapshot[i];
+		bool fresh = estimate.valid && estimate.age <= cMaxSampleAge;
 
-		m_wifiPointCloud.AddPoint(position, -rssi, 0, 0);
+		if (fresh && m_sessionLog && !m_sessionLog->failed()) {
+			m_sessionLog->addPoint(position, (UINT8)std::lround(-estimate.rssi), 0, 0);
+		} else if (fresh) {
+			m_wifiPointCloud.AddPoint(position, (UINT8)std::lround(-estimate.rssi), 0, 0);
+		} else {
+			m_staleSampleCounts[i]++;
+		}
 
 		if (m_writeStats) {
-			 std::cout << "," << rssi;
+			std::cout << "," << estimate.rssi << "," << chrono::duration_cast<chrono::milliseconds>(estimate.age).count();
 		}
 	}
 
@@ -514,16 +759,3 @@ void WiFiMapper::recordPoints(Point3f posA, Point3f posB) {
 	}
 }
 
-
-Point3f WiFiMapper::desc2Pos(Point3f desc) {
-	int x = desc.x + 0.5;
-	int y = desc.y + 0.5;
-	float z = desc.z;
-
-	int index = y * cDepthWidth + x;
-	PointF mapping = m_depthToCameraSpaceTable[index];
-	float posX = mapping.X * z;
-	float posY = mapping.Y * z;
-
-	return{ posX, posY, z };
-}
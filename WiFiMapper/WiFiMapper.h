@@ -15,8 +15,14 @@
 #include "opencv2/imgproc.hpp"
 #include "opencv2/video/tracking.hpp"
 
-#include "MarkerTracker.h"
+#include "DepthProjection.h"
+#include "DepthSource.h"
+#include "DepthStream.h"
+#include "EnvironmentCloud.h"
+#include "ScannerTracker.h"
 #include "PointCloud.h"
+#include "ReceiverPoller.h"
+#include "SessionLog.h"
 #include "WiFiReceiver.h"
 
 class WiFiMapper {
@@ -53,15 +59,39 @@ class WiFiMapper {
 	const float m_markerRadiusTolerance = 0.2f;
 	static const uint m_centerTolerance_px = 25;
 	cv::Rect m_initRegion;
-	MarkerTracker m_trackerA;
+	TaskPool m_trackingPool{ 2 }; // (one thread for each marker while both are being searched for, and shared by formPointCloud)
+	ScannerTracker m_scanner;
 	cv::Point2i m_initOriginA{ cDepthWidth / 3, cDepthHeight / 2 };
-	MarkerTracker m_trackerB;
 	cv::Point2i m_initOriginB{ 2 * cDepthWidth / 3, cDepthHeight / 2 };
 	const float cDepthVFov = 60.0f;
 
-	// Scanner length sanity check
-	const float cScannerLengthMin_mm = cScannerLength_mm * 0.8;
-	const float cScannerLengthMax_mm = cScannerLength_mm * 1.2;
+	// Scanner length sanity check (accepted proportion either side of cScannerLength_mm)
+	const float cScannerLengthTolerance = 0.2f;
+
+	// Fetch every sample recorded by the modules in batches, rather than one value per request (modules running
+	// firmware from before /rssi/batch was added are sent single-value requests instead, until re-flashed)
+	const bool cFetchRssiBatches = true;
+
+	// The interval at which the modules stream RSSI values over UDP (0: request each value over HTTP)
+	const uint32_t cRssiStreamInterval_us = 0;
+
+	// RSSI values estimated further than this from a sample are discarded
+	const std::chrono::milliseconds cMaxSampleAge{ 500 };
+
+	// The time waited for the sensor (or each frame) before reporting that it is still being waited for
+	const DWORD cSensorTimeout_ms = 2000;
+
+	// Each sensor's mapping table is saved to (and read from) a file named with this prefix and the sensor's ID
+	const std::string cMappingTablePrefix = "./mapping table ";
+
+	// The environment cloud is fused from this many frames (1: formed from a single frame), into voxels of this size
+	const uint cEnvironmentFrames = 1;
+	const float cEnvironmentVoxelSize_mm = 20;
+
+	// Every this many depth frames used by Run is fused (with the startup frames) into a session environment cloud,
+	// written on exit (0: none). Surfaces seen in fewer than cSessionEnvironmentMinFrames frames are left out of it.
+	const uint cEnvironmentFusionInterval = 0;
+	const uint cSessionEnvironmentMinFrames = 10;
 
 	// Statistics variables
 	bool m_writeStats = false;
@@ -75,17 +105,48 @@ public:
 	// Destructor
 	~WiFiMapper();
 
-	// The main loop
+	// The main loop (returns the collected Wi-Fi point cloud, less any samples written to the session log)
 	PointCloud Run();
 
 	// Generates a coloured point cloud of the scanned room
 	PointCloud GetEnvironmentCloud();
 
+	// Forms the environment cloud again, refined by the depth frames fused by Run since GetEnvironmentCloud
+	// (empty if session fusion is disabled, or GetEnvironmentCloud has not been called)
+	PointCloud GetSessionEnvironmentCloud();
+
+	// Replaces the sensor as the source of depth frames used by Run (takes ownership)
+	void SetDepthSource(DepthSource *depthSource);
+
+	// Records every depth frame used by Run to the given depth stream file
+	void RecordDepth(std::string filename);
+
+	// Writes the Wi-Fi point cloud collected by Run to the given session log as it is collected (rather than
+	// holding it in memory). Returns false if the log cannot be created.
+	bool LogSession(std::string filename);
+
 private:
 	PointCloud m_wifiPointCloud;
 	std::vector<WiFiReceiver> m_receivers;
-	Rendezvous m_receiverSync;
-	double m_ticks = 0;
+	ReceiverPoller m_receiverPoller;
+	std::vector<RssiEstimate> m_rssiSnapshot;
+	std::vector<unsigned> m_staleSampleCounts;
+	int64_t m_lastTimestamp = 0;
+	DepthClock m_depthClock;
+	std::chrono::steady_clock::time_point m_startTime = std::chrono::steady_clock::now();
+
+	// Supplies depth frames to Update
+	DepthSource *m_depthSource;
+
+	// Records depth frames (if enabled)
+	DepthStreamWriter *m_depthRecorder;
+
+	// Records the Wi-Fi point cloud as it is collected (if enabled)
+	SessionLogWriter *m_sessionLog;
+
+	// Fuses the environment cloud's frames, and every cEnvironmentFusionInterval'th frame used by Run (if enabled)
+	EnvironmentFusion *m_environmentFusion;
+	uint m_framesSinceFusion = 0;
 
 	// Current Kinect
 	IKinectSensor* m_pKinectSensor;
@@ -93,10 +154,15 @@ private:
 	// Frame readers
 	IMultiSourceFrameReader* m_pMultiSourceReader;
 	IDepthFrameReader* m_pDepthFrameReader;
+	WAITABLE_HANDLE m_multiSourceFrameEvent = 0; // (signalled when the multi-source reader has a new frame)
+
+	// True if the buffers hold the frame acquired with the mapping table (not yet used for the environment cloud)
+	bool m_hasStartupFrame = false;
 
 	// Coordinate mapping
 	ICoordinateMapper* m_pMapper;
-	PointF* m_depthToCameraSpaceTable;
+	DepthProjection m_projection;
+	std::vector<ColorSpacePoint> m_colorSpacePoints; // the position of each depth pixel in the latest colour frame
 
 	// Display images
 	RGBQUAD* m_pColorRGBX;
@@ -111,19 +177,25 @@ private:
 	HRESULT InitializeDepthFrameReader();
 	void initMappingTable();
 
+	// Waits (up to cSensorTimeout_ms) for the next colour and depth frames, and copies them to the display buffers
+	bool acquireColorAndDepth();
+
+	// Waits for the sensor to become available, and returns its unique ID (empty if it is unknown)
+	std::string getSensorId();
+
 	// Switches to use only the depth frame input
 	void DisableMultiSourceReader();
 
 	// Merge a colour frame and depth frame to form a PointCloud
 	PointCloud formPointCloud(RGBQUAD *pBufferColor, UINT16 *pBufferDepth);
 
+	// Finds the position of each pixel of a depth frame in the colour frame (in m_colorSpacePoints)
+	void mapDepthToColor(UINT16 *pBufferDepth);
+
 	// Use depth values to identify scanner marker positions
-	void ProcessChannels(UINT16 *pBufferDepth, int nWidthDepth, int nHeightDepth);
+	void ProcessChannels(const DepthFrame &frame, std::chrono::steady_clock::time_point frameTime);
 	
 	// Use scanner marker positions to calculate Wi-Fi module positions
 	// and store them in a point cloud (along with their RSSI readings).
-	void recordPoints(cv::Point3f posA, cv::Point3f posB);
-	
-	// Convert from (px, px, mm) in depth space to (mm, mm, mm) in camera space
-	cv::Point3f desc2Pos(cv::Point3f desc);
+	void recordPoints(cv::Point3f posA, cv::Point3f posB, std::chrono::steady_clock::time_point frameTime);
 };
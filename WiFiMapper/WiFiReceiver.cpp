@@ -6,194 +6,162 @@
 
 #include "WiFiReceiver.h"
 
-#include <iostream>
-#include <string>
-#include <winhttp.h>
+#include <algorithm>
 
 using namespace std;
 
-// Convert string to the format expected by Windows network commands.
-// (From https://stackoverflow.com/questions/27220/how-to-convert-stdstring-to-lpcwstr-in-c-unicode)
-std::wstring s2ws(const std::string& s) {
-	int len;
-	int slength = (int)s.length() + 1;
-	len = MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, 0, 0);
-	wchar_t* buf = new wchar_t[len];
-	MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, buf, len);
-	std::wstring r(buf);
-	delete[] buf;
-	return r;
+
+void WiFiReceiver::setIpAddress(std::string ipAddress, uint16_t port) {
+	m_ipAddress = ipAddress;
+	m_port = port;
 }
 
 
-// Collect RSSI value from an ESP8266 module with the given IP address
-int fetchRssiFromServer(string ipAddress) {
-	DWORD dwSize = sizeof(DWORD);
-	DWORD dwDownloaded = 0;
-	LPSTR pszOutBuffer;
-	HINTERNET hConnect = NULL;
-	HINTERNET hRequest = NULL;
-	HINTERNET hSession = NULL;
-	bool bResults = false;
-	int rssi = 0;
-
-	// Use WinHttpOpen to obtain an HINTERNET handle.
-	hSession = WinHttpOpen(NULL,
-		WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
-		WINHTTP_NO_PROXY_NAME,
-		WINHTTP_NO_PROXY_BYPASS, 0);
-
-	std::wstring stemp = s2ws(ipAddress);
-	LPCWSTR ipAddressWindowsStr = stemp.c_str();
-
-	// Specify an HTTP server.
-	if (hSession)
-		hConnect = WinHttpConnect(hSession, ipAddressWindowsStr,
-			INTERNET_DEFAULT_HTTP_PORT, 0);
-
-	// Create an HTTP request handle.
-	if (hConnect)
-		hRequest = WinHttpOpenRequest(hConnect, L"GET", L"/rssi",
-			NULL, WINHTTP_NO_REFERER,
-			WINHTTP_DEFAULT_ACCEPT_TYPES,
-			0);
-
-	// Send a request.
-	if (hRequest)
-		bResults = WinHttpSendRequest(hRequest,
-			WINHTTP_NO_ADDITIONAL_HEADERS,
-			0, WINHTTP_NO_REQUEST_DATA, 0,
-			0, 0);
-
-	if (bResults)
-		bResults = WinHttpReceiveResponse(hRequest, NULL);
-
-
-	// Keep checking for data until there is nothing left.
-	if (bResults) {
-		do {
-			// Check for available data.
-			dwSize = 0;
-			if (!WinHttpQueryDataAvailable(hRequest, &dwSize)) {
-				printf("Error %u in WinHttpQueryDataAvailable.\n",
-					GetLastError());
-				break;
-			}
-
-			// No more available data.
-			if (!dwSize)
-				break;
-
-			// Allocate space for the buffer.
-			pszOutBuffer = new char[dwSize + 1];
-			if (!pszOutBuffer) {
-				printf("Out of memory\n");
-				break;
-			}
-
-			// Read the Data.
-			ZeroMemory(pszOutBuffer, dwSize + 1);
-
-			if (!WinHttpReadData(hRequest, (LPVOID)pszOutBuffer,
-				dwSize, &dwDownloaded)) {
-				printf("Error %u in WinHttpReadData.\n", GetLastError());
-			} else {
-				try {
-					rssi = atoi(pszOutBuffer);
-				} catch (exception &e) {
-					rssi = 0;
-				}
-			}
-
-			// Free the memory allocated to the buffer.
-			delete[] pszOutBuffer;
-
-			// This condition should never be reached since WinHttpQueryDataAvailable
-			// reported that there are bits to read.
-			if (!dwDownloaded)
-				break;
-
-		} while (dwSize > 0);
+RssiEstimate WiFiReceiver::rssiAt(chrono::steady_clock::time_point time, RSSI_QUERY query) const {
+	RssiEstimate estimate;
+	uint64_t sampleCount = m_sampleCount.load(memory_order_acquire);
+
+	// Search back from the newest sample for the last one received at or before the given time
+	RssiSample before, after;
+	bool haveBefore = false, haveAfter = false;
+	for (uint64_t sequence = sampleCount; sequence > 0 && sequence + cBufferLength > sampleCount; sequence--) {
+		RssiSample sample;
+		if (!bufferedSample(sequence, sample)) {
+			break;
+		}
+
+		if (sample.time <= time) {
+			before = sample;
+			haveBefore = true;
+			break;
+		}
+
+		after = sample;
+		haveAfter = true;
+	}
+
+	if (!haveBefore && !haveAfter) {
+		return estimate;
+	}
+
+	estimate.valid = true;
+	if (!haveAfter) {
+		estimate.rssi = (float)before.rssi;
+		estimate.age = time - before.time;
+	} else if (!haveBefore) {
+		estimate.rssi = (float)after.rssi;
+		estimate.age = after.time - time;
 	} else {
-		// Report any errors.
-		printf("Error %d has occurred.\n", GetLastError());
+		chrono::steady_clock::duration sinceBefore = time - before.time;
+		chrono::steady_clock::duration untilAfter = after.time - time;
+		estimate.age = min(sinceBefore, untilAfter);
+
+		if (query == RSSI_QUERY::INTERPOLATED) {
+			float progress = (float)sinceBefore.count() / (after.time - before.time).count();
+			estimate.rssi = before.rssi + progress * (after.rssi - before.rssi);
+		} else {
+			estimate.rssi = (float)(sinceBefore <= untilAfter ? before.rssi : after.rssi);
+		}
 	}
 
-	if (hRequest) WinHttpCloseHandle(hRequest);
-	if (hConnect) WinHttpCloseHandle(hConnect);
-	if (hSession) WinHttpCloseHandle(hSession);
+	return estimate;
+}
+
+
+double WiFiReceiver::sampleRate() const {
+	uint64_t sampleCount = m_sampleCount.load(memory_order_acquire);
+	if (sampleCount < 2) {
+		return 0;
+	}
 
-	return rssi;
+	// The oldest buffered sample may be overwritten while reading, so leave it out
+	uint64_t bufferedCount = min<uint64_t>(sampleCount, cBufferLength - 1);
+	RssiSample newest, oldest;
+	if (!bufferedSample(sampleCount, newest) || !bufferedSample(sampleCount - bufferedCount + 1, oldest)) {
+		return 0;
+	}
+
+	double period_s = chrono::duration<double>(newest.time - oldest.time).count();
+	return period_s > 0 ? (bufferedCount - 1) / period_s : 0;
 }
 
 
-// Collect RSSI values in an infinite loop
-DWORD WINAPI workerFunction(LPVOID lpParam) {
-	WorkerData *arg = (WorkerData*)lpParam;
-	string ipAddress = arg->ipAddress;
-	HANDLE *mutexHandle = arg->mutexHandle;
-	int *rssi = arg->rssi;
-	Rendezvous *rendezvous = arg->rendezvous;
+void WiFiReceiver::addSample(int rssi, chrono::steady_clock::time_point time) {
+	uint64_t sampleCount = m_sampleCount.load(memory_order_relaxed) + 1;
 
-	while (1) {
-		int newRssi = fetchRssiFromServer(ipAddress);
-		
-		WaitForSingleObject(*mutexHandle, INFINITE);
-		*rssi = newRssi;
-		ReleaseMutex(*mutexHandle);
+	RssiSample sample;
+	sample.rssi = rssi;
+	sample.sequence = sampleCount;
+	sample.time = time;
 
-		if (rendezvous) {
-			rendezvous->arrive();
-		}
-	}
+	m_samples[(sampleCount - 1) % cBufferLength].store(sample);
+	m_sampleCount.store(sampleCount, memory_order_release);
+	m_latest.store(sample);
 }
 
 
-void WiFiReceiver::setIpAddress(std::string ipAddress) {
-	m_ipAddress = ipAddress;
+void WiFiReceiver::addModuleSample(int rssi, uint32_t timestamp_us, chrono::steady_clock::time_point arrival) {
+	if (!m_clockInitialised) {
+		m_timestamp_us = timestamp_us;
+		m_clockInitialised = true;
+	} else {
+		m_timestamp_us += (uint32_t)(timestamp_us - m_lastTimestamp_us);
+	}
+	m_lastTimestamp_us = timestamp_us;
+
+	chrono::steady_clock::duration moduleTime = chrono::duration_cast<chrono::steady_clock::duration>(chrono::microseconds(m_timestamp_us));
+	addSample(rssi, m_clockOffset.hostTime(moduleTime, arrival));
 }
 
 
-void WiFiReceiver::addRenzezvous(Rendezvous *rendezvous) {
-	m_rendezvous = rendezvous;
+static uint32_t readUint32(const uint8_t *data) {
+	return data[0] | (data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
 }
 
 
-void WiFiReceiver::start() {
-	m_rssi = 0;
+int WiFiReceiver::addBatch(const char *data, size_t length, chrono::steady_clock::time_point arrival) {
+	const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data);
+	if (length < cBatchHeaderLength || bytes[0] != 'W' || bytes[1] != 'B' || bytes[2] != cBatchVersion
+		|| length != cBatchHeaderLength + bytes[3] * cBatchSampleLength) {
+		return -1;
+	}
 
-	m_rssiMutex = CreateMutex(
-		NULL,				// default security attributes
-		FALSE,				// initially not owned
-		NULL);				// unnamed mutex
+	size_t count = bytes[3];
+	uint32_t firstSequence = readUint32(bytes + 4);
+	if (count == 0) {
+		return 0;
+	}
 
-	workerArgs.ipAddress = m_ipAddress;
-	workerArgs.mutexHandle = &m_rssiMutex;
-	workerArgs.rssi = &m_rssi;
-	workerArgs.rendezvous = m_rendezvous;
+	// Sequence numbers start again when the module restarts
+	if (firstSequence <= m_batchSequence && firstSequence + count - 1 <= m_batchSequence) {
+		resetModuleClock();
+		m_batchSequence = 0;
+	}
 
-	m_threadHandle = CreateThread(
-		NULL,                   // default security attributes
-		0,                      // use default stack size  
-		workerFunction,			// thread function name
-		&workerArgs,			// argument to thread function 
-		0,                      // use default creation flags 
-		&m_threadId);
-}
+	if (m_batchSequence > 0 && firstSequence > m_batchSequence + 1) {
+		m_missedBatchSamples += firstSequence - m_batchSequence - 1;
+	}
 
+	int added = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint32_t sequence = firstSequence + (uint32_t)i;
+		if (sequence <= m_batchSequence) {
+			continue;
+		}
 
-int WiFiReceiver::getRssi() {
-	int rssi;
+		const uint8_t *sample = bytes + cBatchHeaderLength + i * cBatchSampleLength;
+		int rssi = (int16_t)(sample[4] | (sample[5] << 8));
+		addModuleSample(rssi, readUint32(sample), arrival);
 
-	WaitForSingleObject(m_rssiMutex, INFINITE);
-	rssi = m_rssi;
-	ReleaseMutex(m_rssiMutex);
+		m_batchSequence = sequence;
+		added++;
+	}
 
-	return rssi;
+	return added;
 }
 
 
-void WiFiReceiver::disconnect() {
-	CloseHandle(m_threadHandle);
-	CloseHandle(m_rssiMutex);
+bool WiFiReceiver::bufferedSample(uint64_t sequence, RssiSample &sample) const {
+	sample = m_samples[(sequence - 1) % cBufferLength].load();
+	return sample.sequence == sequence;
 }
@@ -6,48 +6,123 @@
 
 #pragma once
 
-#include "stdafx.h"
-#include <strsafe.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <string>
-#include <vector>
 
-#include "Rendezvous.h"
+#include "ClockOffset.h"
+#include "SeqLock.h"
 
-// A container to pass all required information to a worker thread
-struct WorkerData {
-	std::string ipAddress;
-	HANDLE *mutexHandle;
-	int *rssi;
-	Rendezvous *rendezvous;
+
+// An RSSI value and the time at which it was received
+struct RssiSample {
+	int rssi = 0; // dBm
+	uint64_t sequence = 0; // numbered from 1 (0: no sample has been received)
+	std::chrono::steady_clock::time_point time;
 };
 
 
-// The object which communicates with a single ESP8266 module
+// An RSSI value estimated for a particular time
+struct RssiEstimate {
+	float rssi = 0; // dBm
+	std::chrono::steady_clock::duration age{ 0 }; // from the nearest sample used
+	bool valid = false; // false if no samples have been received
+};
+
+
+// Batch layout (the body of a /rssi/batch response), little-endian: 'W', 'B', version,
+// uint8 sample count, uint32 sequence number of the first sample, then for each sample
+// uint32 micros() at sampling and int16 RSSI (dBm)
+static const size_t cBatchHeaderLength = 8;
+static const size_t cBatchSampleLength = 6;
+static const uint8_t cBatchVersion = 1;
+
+
+// The RSSI values received from a single ESP8266 module, which is sampled at its
+// own rate (for all modules together) by a ReceiverPoller.
 class WiFiReceiver {
 public:
+	enum class RSSI_QUERY { NEAREST, INTERPOLATED };
+
+	// The number of recent samples kept (enough for modules which record samples in batches)
+	static const size_t cBufferLength = 256;
+
 	WiFiReceiver() = default;
 
 	// Set the IP address of the target ESP8266 (eg: "192.168.1.72")
-	void setIpAddress(std::string ipAddress);
+	void setIpAddress(std::string ipAddress, uint16_t port = 80);
 
-	// (Optional) Set a receiver to wait for synchronization
-	void addRenzezvous(Rendezvous *rendezvous);
+	const std::string &ipAddress() const {
+		return m_ipAddress;
+	}
 
-	// Begin collecting samples
-	void start();
+	uint16_t port() const {
+		return m_port;
+	}
 
 	// A non-blocking function which returns the most recently-received RSSI value (in dBm) from the ESP8266
-	int getRssi();
+	int getRssi() const {
+		return m_latest.load().rssi;
+	}
+
+	// The most recently-received sample (with sequence 0 if there has not been one), without locking
+	RssiSample latestSample() const {
+		return m_latest.load();
+	}
+
+	// The RSSI value at the given time, either interpolated between the samples either side
+	// of it or taken from the nearest sample (without locking)
+	RssiEstimate rssiAt(std::chrono::steady_clock::time_point time, RSSI_QUERY query = RSSI_QUERY::INTERPOLATED) const;
 
-	// Kill worker thread (Warning: no reconnect method has been implemented.)
-	void disconnect();
+	// The rate at which the buffered samples were received (samples per second)
+	double sampleRate() const;
+
+	// Stores a newly-received RSSI value (in dBm). This and the following functions
+	// must only be called by one thread.
+	void addSample(int rssi, std::chrono::steady_clock::time_point time);
+
+	// Stores an RSSI value sampled at the given time on the module's clock (micros()),
+	// which is mapped to the host's clock using the time at which it arrived
+	void addModuleSample(int rssi, uint32_t timestamp_us, std::chrono::steady_clock::time_point arrival);
+
+	// Forgets the module's clock (eg: when the module restarts)
+	void resetModuleClock() {
+		m_clockInitialised = false;
+		m_clockOffset.reset();
+	}
+
+	// Decodes a batch of samples and stores those not already received. Returns the
+	// number stored, or -1 if the batch is invalid.
+	int addBatch(const char *data, size_t length, std::chrono::steady_clock::time_point arrival);
+
+	// The sequence number of the last batched sample received (0 before the first)
+	uint32_t batchSequence() const {
+		return m_batchSequence;
+	}
+
+	// The number of batched samples which were overwritten on the module before being fetched
+	uint64_t missedBatchSamples() const {
+		return m_missedBatchSamples;
+	}
 
 private:
 	std::string m_ipAddress;
-	int m_rssi;
-	DWORD m_threadId;
-	HANDLE m_threadHandle;
-	HANDLE m_rssiMutex;
-	WorkerData workerArgs;
-	Rendezvous *m_rendezvous;
-};
\ No newline at end of file
+	uint16_t m_port = 80;
+	std::array<SeqLock<RssiSample>, cBufferLength> m_samples; // indexed by (sequence - 1) % cBufferLength
+	std::atomic<uint64_t> m_sampleCount{ 0 };
+	SeqLock<RssiSample> m_latest;
+
+	// The module's clock
+	bool m_clockInitialised = false;
+	uint32_t m_lastTimestamp_us = 0;
+	uint64_t m_timestamp_us = 0; // without wrapping (micros() wraps every 71 minutes)
+	ClockOffset m_clockOffset;
+
+	uint32_t m_batchSequence = 0;
+	std::atomic<uint64_t> m_missedBatchSamples{ 0 };
+
+	// Fetches the buffered sample with the given sequence number (false if it has been overwritten)
+	bool bufferedSample(uint64_t sequence, RssiSample &sample) const;
+};
@@ -0,0 +1,210 @@
+/*
+ * A headless program which runs the scanner tracker over a recorded (or synthetic)
+ * depth session, reporting the tracked marker positions and the processing rate.
+ * Unlike WiFiMapper, it requires neither a Kinect sensor nor a display.
+ *
+ * Written by Marc Katzef
+ */
+
+#include "Portability.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "DepthProjection.h"
+#include "DepthSource.h"
+#include "DepthStream.h"
+#include "ScannerTracker.h"
+
+using namespace std;
+
+
+// Prints command line usage
+void printUsage(const char *programName) {
+	cerr << "Usage: " << programName << " (<recording> | --synthetic <frame count>) [options]\n"
+		"Options:\n"
+		"  --realtime          replay frames at the rate they were recorded\n"
+		"  --threads <count>   search for lost markers on the given number of threads (default: 1)\n"
+		"  --csv <file>        write per-frame tracking results to the given file\n"
+		"  --write <file>      save the replayed frames as a compressed depth stream\n"
+		"  --write-raw <file>  save the replayed frames as a raw depth recording\n";
+}
+
+
+// A scene in which both markers are presented at their initialisation positions,
+// then held at the scanner's length and swept around the room together.
+SyntheticDepthSource *makeSyntheticSession(const ScannerTrackerConfig &config, size_t frameCount) {
+	DepthProjection projection;
+	projection.setPinhole(config.depthWidth, config.depthHeight, config.depthVFov_deg);
+
+	cv::Point3f startA = projection.desc2Pos({ config.initOriginA.x, config.initOriginA.y, (float)config.initDistance_mm });
+	cv::Point3f startB = projection.desc2Pos({ config.initOriginB.x, config.initOriginB.y, (float)config.initDistance_mm });
+	cv::Point3f extendedB = startA + cv::Point3f{ config.scannerLength_mm, 0, 0 };
+	cv::Point3f sweep{ -200, 100, 400 };
+
+	SyntheticMarker markerA;
+	markerA.waypoints = { { 1.0, startA }, { 2.0, startA }, { 5.0, startA + sweep }, { 8.0, startA } };
+	SyntheticMarker markerB;
+	markerB.waypoints = { { 1.0, startB }, { 2.0, extendedB }, { 5.0, extendedB + sweep }, { 8.0, extendedB } };
+
+	return new SyntheticDepthSource(config.depthWidth, config.depthHeight, config.depthVFov_deg, (float)config.markerRadius_mm, { markerA, markerB }, frameCount);
+}
+
+
+int main(int argc, char **argv) {
+	string recordingName;
+	size_t syntheticFrameCount = 0;
+	bool realtime = false;
+	size_t threadCount = 1;
+	string csvName;
+	string writeName;
+	string writeRawName;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--synthetic" && i + 1 < argc) {
+			syntheticFrameCount = strtoul(argv[++i], NULL, 10);
+		} else if (arg == "--realtime") {
+			realtime = true;
+		} else if (arg == "--threads" && i + 1 < argc) {
+			threadCount = max(strtoul(argv[++i], NULL, 10), 1ul);
+		} else if (arg == "--csv" && i + 1 < argc) {
+			csvName = argv[++i];
+		} else if (arg == "--write" && i + 1 < argc) {
+			writeName = argv[++i];
+		} else if (arg == "--write-raw" && i + 1 < argc) {
+			writeRawName = argv[++i];
+		} else if (arg[0] != '-' && recordingName.empty()) {
+			recordingName = arg;
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (recordingName.empty() == (syntheticFrameCount == 0)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	ScannerTrackerConfig config;
+	DepthProjection projection;
+	projection.setPinhole(config.depthWidth, config.depthHeight, config.depthVFov_deg);
+
+	unique_ptr<DepthSource> depthSource;
+	try {
+		if (syntheticFrameCount) {
+			depthSource.reset(makeSyntheticSession(config, syntheticFrameCount));
+		} else {
+			depthSource.reset(openDepthRecording(recordingName, realtime));
+		}
+	} catch (const exception &e) {
+		cerr << e.what() << "\n";
+		return 1;
+	}
+
+	unique_ptr<DepthStreamWriter> writer;
+	unique_ptr<RawDepthWriter> rawWriter;
+	double encodingTime_s = 0;
+	try {
+		if (!writeName.empty()) {
+			writer.reset(new DepthStreamWriter(writeName, config.depthWidth, config.depthHeight));
+		}
+		if (!writeRawName.empty()) {
+			rawWriter.reset(new RawDepthWriter(writeRawName, config.depthWidth, config.depthHeight));
+		}
+	} catch (const exception &e) {
+		cerr << e.what() << "\n";
+		return 1;
+	}
+
+	ofstream csvFile;
+	if (!csvName.empty()) {
+		csvFile.open(csvName);
+		csvFile << "frame,timestamp,state_a,a_x,a_y,a_depth,state_b,b_x,b_y,b_depth,valid,inferred\n";
+	}
+
+	TaskPool trackingPool(threadCount);
+	ScannerTracker scanner;
+	scanner.init(config, &projection, &trackingPool);
+
+	size_t frameCount = 0;
+	size_t validCount = 0;
+	size_t inferredCount = 0;
+	int64_t lastTimestamp = 0;
+	double processingTime_s = 0;
+
+	DepthFrame frame;
+	while (!depthSource->finished()) {
+		if (!depthSource->acquireFrame(frame)) {
+			continue;
+		}
+
+		if (frame.width != (int)config.depthWidth || frame.height != (int)config.depthHeight) {
+			cerr << "Unexpected frame size " << frame.width << "x" << frame.height << "\n";
+			return 1;
+		}
+
+		if (writer) {
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			writer->writeFrame(frame.data, frame.timestamp);
+			encodingTime_s += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		}
+
+		if (rawWriter) {
+			rawWriter->writeFrame(frame.data, frame.timestamp);
+		}
+
+		double dt = (double)(frame.timestamp - lastTimestamp) / cDepthTicksPerSecond;
+		lastTimestamp = frame.timestamp;
+
+		cv::Mat depthFrame(frame.height, frame.width, CV_16UC1, const_cast<UINT16*>(frame.data));
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		ScannerResult result = scanner.update(depthFrame, dt);
+		processingTime_s += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		if (result.valid) {
+			validCount++;
+		}
+		if (result.inferred) {
+			inferredCount++;
+		}
+
+		if (csvFile.is_open()) {
+			csvFile << frameCount << "," << frame.timestamp
+				<< "," << (int)result.typeA << "," << result.descA.x << "," << result.descA.y << "," << result.descA.z
+				<< "," << (int)result.typeB << "," << result.descB.x << "," << result.descB.y << "," << result.descB.z
+				<< "," << result.valid << "," << result.inferred << "\n";
+		}
+
+		frameCount++;
+	}
+
+	cout << "Processed " << frameCount << " frames (" << validCount << " with a valid scanner position, " << inferredCount << " of them inferred from one marker)\n";
+	if (processingTime_s > 0) {
+		cout << "Tracking rate: " << frameCount / processingTime_s << " frames/s\n";
+	}
+
+	if (writer) {
+		writer->close();
+		if (writer->failed()) {
+			cerr << "Only " << writer->frameCount() << " of the " << frameCount << " frames were written to \"" << writeName << "\"\n";
+			return 1;
+		}
+	}
+
+	if (writer && frameCount > 0) {
+		double rawSize = (double)frameCount * frame.width * frame.height * sizeof(UINT16);
+		cout << "Depth stream: " << writer->bytesWritten() / (double)frameCount / 1024 << " KiB/frame ("
+			<< rawSize / writer->bytesWritten() << "x smaller than raw), "
+			<< encodingTime_s * 1000 / frameCount << " ms/frame to encode\n";
+	}
+
+	return 0;
+}